@@ -0,0 +1,109 @@
+#include "catch.hpp"
+
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace sys = std::tr2::sys;
+
+struct AsyncTestFixture {
+
+    const sys::path testdb = "C:/tmp/test-database.edb";
+
+    AsyncTestFixture() {
+        sys::remove(testdb);
+    }
+
+    ~AsyncTestFixture() {
+    }
+
+};
+
+TEST_CASE_METHOD(AsyncTestFixture, "run work on a worker pool") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    session->open_database(testdb)->create_table("numbers");
+
+    jato::AsyncOptions options;
+    options.workers = 4;
+    auto pool = session->open_async_database(testdb, options);
+
+    jato::async_call(*pool, [](jato::interface::Database& db) {
+        db.open_table("numbers")->create_field("n", jato::long_type::type);
+    }).get();
+
+    std::vector<std::future<void>> adds;
+    for (int i = 0; i < 200; ++i) {
+        adds.push_back(jato::async_transaction(*pool, jato::RetryPolicy(), [i](jato::interface::Database& db) {
+            auto record = jato::make_record();
+            record->set_field("n", jato::long_type(i));
+            db.open_table("numbers")->add_record(move(record));
+        }));
+    }
+    for (auto& add : adds) add.get();
+
+    auto count = jato::async_call(*pool, [](jato::interface::Database& db) {
+        return db.open_table("numbers")->count();
+    });
+    CHECK(count.get() == 200);
+
+    auto missing = jato::async_call(*pool, [](jato::interface::Database& db) {
+        db.open_table("missing");
+    });
+    CHECK_THROWS_AS(missing.get(), jato::error);
+}
+
+TEST_CASE_METHOD(AsyncTestFixture, "scan batches through an executor") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    {
+        auto db = session->open_database(testdb);
+        db->create_table("numbers");
+        auto table = db->open_table("numbers");
+        table->create_field("n", jato::long_type::type);
+        for (int i = 0; i < 100; ++i) {
+            auto record = jato::make_record();
+            record->set_field("n", jato::long_type(i));
+            table->add_record(move(record));
+        }
+    }
+
+    // a stand-in event loop: completions queue up until the test drains them
+    std::mutex lock;
+    std::deque<std::function<void()>> loop;
+    jato::AsyncOptions options;
+    options.workers = 2;
+    options.executor = [&](std::function<void()> completion) {
+        std::lock_guard<std::mutex> guard(lock);
+        loop.push_back(completion);
+    };
+    auto pool = session->open_async_database(testdb, options);
+
+    long long sum = 0;
+    bool finished = false;
+    pool->scan("numbers", { "n" }, 16, [&](const jato::RecordBatch& batch) {
+        for (std::size_t row = 0; row < batch.rows; ++row) sum += batch.columns[0].longs[row];
+        return true;
+    }, [&](std::exception_ptr error) {
+        CHECK_FALSE(error);
+        finished = true;
+    });
+
+    while (!finished) {
+        std::function<void()> completion;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!loop.empty()) {
+                completion = loop.front();
+                loop.pop_front();
+            }
+        }
+        if (completion) completion();
+    }
+    CHECK(sum == 4950);
+}
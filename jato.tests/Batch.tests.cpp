@@ -0,0 +1,116 @@
+#include "catch.hpp"
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace {
+
+    const std::size_t rows = 1000;     // not a multiple of 64
+
+    auto make_batch() -> jato::RecordBatch {
+        jato::RecordBatch batch;
+        batch.rows = rows;
+
+        jato::ColumnVector longs;
+        longs.name = "long";
+        longs.type = jato::long_type::type;
+        jato::ColumnVector long_longs;
+        long_longs.name = "long_long";
+        long_longs.type = jato::long_long_type::type;
+        jato::ColumnVector doubles;
+        doubles.name = "double";
+        doubles.type = jato::double_type::type;
+
+        for (std::size_t i = 0; i < rows; ++i) {
+            auto v = static_cast<std::int32_t>(i % 100) - 50;
+            longs.longs.push_back(v);
+            long_longs.long_longs.push_back(static_cast<std::int64_t>(v) * 10000000000LL);
+            doubles.doubles.push_back(v / 4.0);
+        }
+        doubles.doubles[7] = std::numeric_limits<double>::quiet_NaN();
+
+        // every tenth long is null
+        longs.nulls.resize((rows + 63) / 64);
+        for (std::size_t i = 0; i < rows; i += 10)
+            longs.nulls[i / 64] |= std::uint64_t(1) << (i % 64);
+
+        batch.columns.push_back(longs);
+        batch.columns.push_back(long_longs);
+        batch.columns.push_back(doubles);
+        return batch;
+    }
+
+    template <typename T>
+    auto expected(T value, jato::compare_op op, T operand) -> bool {
+        switch (op) {
+        case jato::compare_op::less: return value < operand;
+        case jato::compare_op::less_equal: return value <= operand;
+        case jato::compare_op::equal: return value == operand;
+        case jato::compare_op::not_equal: return value != operand;
+        case jato::compare_op::greater_equal: return value >= operand;
+        default: return value > operand;
+        }
+    }
+
+    const jato::compare_op ops[] = {
+        jato::compare_op::less, jato::compare_op::less_equal, jato::compare_op::equal,
+        jato::compare_op::not_equal, jato::compare_op::greater_equal, jato::compare_op::greater
+    };
+
+}
+
+TEST_CASE("filter long_type column") {
+    auto batch = make_batch();
+    for (auto op : ops) {
+        auto selection = jato::filter(batch, { jato::Predicate { "long", op, jato::long_type(7) } });
+        for (std::size_t i = 0; i < rows; ++i) {
+            bool null = i % 10 == 0;
+            REQUIRE(jato::is_selected(selection, i) == (!null && expected(batch.columns[0].longs[i], op, 7)));
+        }
+    }
+}
+
+TEST_CASE("filter long_long_type column") {
+    auto batch = make_batch();
+    for (auto op : ops) {
+        std::int64_t operand = -30000000000LL;
+        auto selection = jato::filter(batch, { jato::Predicate { "long_long", op, jato::long_long_type(operand) } });
+        for (std::size_t i = 0; i < rows; ++i)
+            REQUIRE(jato::is_selected(selection, i) == expected(batch.columns[1].long_longs[i], op, operand));
+    }
+}
+
+TEST_CASE("filter double_type column") {
+    auto batch = make_batch();
+    for (auto op : ops) {
+        auto selection = jato::filter(batch, { jato::Predicate { "double", op, jato::double_type(-2.5) } });
+        for (std::size_t i = 0; i < rows; ++i)
+            REQUIRE(jato::is_selected(selection, i) == expected(batch.columns[2].doubles[i], op, -2.5));
+    }
+}
+
+TEST_CASE("filter conjunction and selection count") {
+    auto batch = make_batch();
+    auto selection = jato::filter(batch, {
+        jato::Predicate { "long", jato::compare_op::greater_equal, jato::long_type(0) },
+        jato::Predicate { "double", jato::compare_op::less, jato::double_type(5.0) }
+    });
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < rows; ++i) {
+        auto v = batch.columns[0].longs[i];
+        if (i % 10 != 0 && v >= 0 && batch.columns[2].doubles[i] < 5.0) ++count;
+    }
+    CHECK(jato::count_selected(selection) == count);
+    CHECK_FALSE(jato::is_selected(selection, rows));
+}
+
+TEST_CASE("filter rejects mismatched predicates") {
+    auto batch = make_batch();
+    CHECK_THROWS_AS(jato::filter(batch, { jato::Predicate { "missing", jato::compare_op::equal, jato::long_type(1) } }), jato::error);
+    CHECK_THROWS_AS(jato::filter(batch, { jato::Predicate { "long", jato::compare_op::equal, jato::double_type(1.5) } }), jato::error);
+    CHECK_THROWS_AS(jato::filter(batch, { jato::Predicate { "long", jato::compare_op::equal, jato::text_type("1") } }), jato::error);
+}
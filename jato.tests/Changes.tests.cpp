@@ -0,0 +1,119 @@
+#include "catch.hpp"
+
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace sys = std::tr2::sys;
+
+struct ChangesTestFixture {
+
+    const sys::path testdb = "C:/tmp/test-database.edb";
+    const sys::path spool = "C:/tmp/test-changes.spool";
+
+    ChangesTestFixture() {
+        sys::remove(testdb);
+        sys::remove(spool);
+    }
+
+    ~ChangesTestFixture() {
+        sys::remove(spool);
+    }
+
+    auto create_counters(jato::interface::Database& db) -> jato::table_ptr {
+        db.create_table("counters");
+        auto table = db.open_table("counters");
+        table->create_field("id", jato::long_type::type);
+        table->create_field("hits", jato::long_long_type::type, jato::escrow_field);
+        table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+        return table;
+    }
+
+    void add_counter(jato::interface::Table& table, long id) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        table.add_record(move(record));
+    }
+
+    auto drain(jato::interface::ChangeFeed& feed) -> std::vector<jato::ChangeEvent> {
+        std::vector<jato::ChangeEvent> events;
+        feed.poll([&](const jato::ChangeEvent& event) {
+            events.push_back(event);
+            return true;
+        });
+        return events;
+    }
+
+    auto field(const jato::interface::Record& record, const std::string& fieldname) -> std::int64_t {
+        auto value = record.get_field(fieldname);
+        if (auto wide = boost::get<jato::long_long_type>(&value)) return wide->value;
+        return boost::get<jato::long_type>(value).value;
+    }
+
+};
+
+TEST_CASE_METHOD(ChangesTestFixture, "feed committed inserts and increments in order") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = create_counters(*db);
+    add_counter(*table, 1);
+
+    auto feed = db->subscribe_changes(jato::ChangeFeedOptions());
+    add_counter(*table, 2);
+    table->increment({ jato::long_type(2) }, "hits", 5);
+    CHECK_THROWS_AS(db->transaction([&]() {
+        add_counter(*table, 3);
+        throw std::runtime_error("rolled back");
+    }), std::runtime_error);
+
+    auto events = drain(*feed);
+    REQUIRE(events.size() == 2);
+    CHECK(events[0].kind == jato::change_kind::inserted);
+    CHECK(events[0].table == "counters");
+    CHECK(!events[0].before);
+    CHECK(field(*events[0].after, "id") == 2);
+    CHECK(field(*events[0].after, "hits") == 0);
+
+    CHECK(events[1].kind == jato::change_kind::updated);
+    CHECK(events[1].sequence > events[0].sequence);
+    CHECK(field(*events[1].before, "hits") == 0);
+    CHECK(field(*events[1].after, "hits") == 5);
+
+    CHECK(drain(*feed).empty());
+    CHECK(feed->dropped() == 0);
+}
+
+TEST_CASE_METHOD(ChangesTestFixture, "drop or spool what does not fit in the ring") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = create_counters(*db);
+
+    jato::ChangeFeedOptions small;
+    small.capacity = 2;
+    auto lossy = db->subscribe_changes(small);
+    small.spool_path = spool;
+    auto spooled = db->subscribe_changes(small);
+
+    for (long id = 0; id < 10; ++id) add_counter(*table, id);
+
+    CHECK(drain(*lossy).size() == 2);
+    CHECK(lossy->dropped() == 8);
+
+    auto events = drain(*spooled);
+    REQUIRE(events.size() == 10);
+    for (long id = 0; id < 10; ++id) CHECK(field(*events[id].after, "id") == id);
+    CHECK(spooled->dropped() == 0);
+
+    std::vector<std::uint64_t> replayed;
+    jato::replay_changes(spool, events[6].sequence, [&](const jato::ChangeEvent& event) {
+        replayed.push_back(event.sequence);
+        return true;
+    });
+    REQUIRE(replayed.size() == 3);
+    CHECK(replayed[0] == events[7].sequence);
+}
@@ -1,7 +1,9 @@
 #include "catch.hpp"
 
+#include <chrono>
 #include <filesystem>
 #include <string>
+#include <thread>
 
 #include <jato.h>
 
@@ -47,3 +49,205 @@ TEST_CASE_METHOD(DatabaseTestFixture, "drop non-existant database") {
     REQUIRE_FALSE(sys::exists(testdb));
     CHECK_THROWS_AS(jato::drop_database(testdb), jato::error);
 }
+
+TEST_CASE_METHOD(DatabaseTestFixture, "sessions share the default instance") {
+    auto session1 = jato::make_session();
+    auto session2 = jato::make_session();
+    session1->create_database(testdb);
+    CHECK_NOTHROW(auto db = session2->open_database(testdb));
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "sessions on separate named instances") {
+    const sys::path otherdb = "C:/tmp/test-database-b.edb";
+    sys::remove(otherdb);
+
+    jato::InstanceOptions a;
+    a.name = "tenant-a";
+    a.system_path = "C:/tmp/tenant-a";
+    a.log_path = "C:/tmp/tenant-a";
+
+    jato::InstanceOptions b;
+    b.name = "tenant-b";
+    b.system_path = "C:/tmp/tenant-b";
+    b.log_path = "C:/tmp/tenant-b";
+    b.cache_size_max = 1024;
+
+    auto session_a = jato::make_session(a);
+    auto session_b = jato::make_session(b);
+    session_a->create_database(testdb);
+    session_b->create_database(otherdb);
+
+    CHECK(sys::exists(a.log_path));
+    CHECK(sys::exists(b.log_path));
+    CHECK_NOTHROW(auto db = session_a->open_database(testdb));
+    CHECK_NOTHROW(auto db = session_b->open_database(otherdb));
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "reopen database from many sessions") {
+    jato::make_session()->create_database(testdb);
+
+    for (int i = 0; i < 100; ++i) {
+        auto session = jato::make_session();
+        auto db = session->open_database(testdb);
+        CHECK_NOTHROW(db->open_table("MSysObjects"));
+    }
+
+    // the last close detaches the database, so it can be dropped
+    CHECK_NOTHROW(jato::drop_database(testdb));
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "spellings of one path share an attachment") {
+    jato::make_session()->create_database(testdb);
+
+    auto first = jato::make_session()->open_database(testdb);
+    {
+        auto second = jato::make_session()->open_database("C:\\TMP\\test-database.edb");
+    }
+    // closing the second spelling must not detach the first
+    CHECK_NOTHROW(first->open_table("MSysObjects"));
+    first.reset();
+    CHECK_NOTHROW(jato::drop_database(testdb));
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "bulk load a new database") {
+    auto session = jato::make_session();
+    session->bulk_load(testdb, [](jato::interface::Database& db) {
+        db.create_table("bulk");
+    });
+    CHECK(sys::exists(testdb));
+
+    auto db = session->open_database(testdb);
+    CHECK_NOTHROW(db->open_table("bulk"));
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "bulk loads can use temporary tables") {
+    auto session = jato::make_session();
+    jato::join_method method = jato::join_method::hash;
+    std::size_t pairs = 0;
+    session->bulk_load(testdb, [&](jato::interface::Database& db) {
+        for (auto name : { "left", "right" }) {
+            db.create_table(name);
+            auto table = db.open_table(name);
+            table->create_field("id", jato::long_type::type);
+            for (long id = 0; id < 10; ++id) {
+                auto record = jato::make_record();
+                record->set_field("id", jato::long_type(id));
+                table->add_record(move(record));
+            }
+        }
+        jato::JoinSpec spec;
+        spec.outer_fields.push_back("id");
+        spec.inner_fields.push_back("id");
+        spec.memory_budget = 1;
+        auto left = db.open_table("left");
+        auto right = db.open_table("right");
+        method = left->join(*right, spec, [&](const jato::interface::Record&, const jato::interface::Record&) {
+            ++pairs;
+            return true;
+        });
+    });
+    CHECK(method == jato::join_method::partitioned_hash);
+    CHECK(pairs == 10);
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "failed bulk load removes the database") {
+    auto session = jato::make_session();
+    CHECK_THROWS_AS(session->bulk_load(testdb, [](jato::interface::Database& db) {
+        db.open_table("missing");
+    }), jato::error);
+    CHECK_FALSE(sys::exists(testdb));
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "transactions commit, roll back and retry conflicts") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("accounts");
+    auto table = db->open_table("accounts");
+    table->create_field("id", jato::long_type::type);
+
+    auto add = [&](int id) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        table->add_record(move(record));
+    };
+
+    // the counters are process-wide, so compare against what earlier tests left
+    auto retries = [&]() -> std::uint64_t {
+        for (auto& stats : db->conflict_stats())
+            if (stats.table == "accounts") return stats.retries;
+        return 0;
+    };
+    auto retries_before = retries();
+
+    db->transaction([&](){ add(1); });
+    CHECK_THROWS_AS(db->transaction([&](){ add(2); throw jato::error("abandon"); }), jato::error);
+    CHECK(table->count() == 1);
+
+    jato::RetryPolicy policy;
+    policy.attempts = 3;
+    int runs = 0;
+    db->transaction(policy, [&](){
+        add(3);
+        if (++runs < 3) throw jato::conflict_error("conflict", "accounts");
+    });
+    CHECK(runs == 3);
+    CHECK(table->count() == 2);
+
+    runs = 0;
+    CHECK_THROWS_AS(db->transaction(policy, [&](){
+        ++runs;
+        throw jato::conflict_error("conflict", "accounts");
+    }), jato::conflict_error);
+    CHECK(runs == 3);
+
+    CHECK(retries() == retries_before + 4);
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "snapshots read a point in time") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("items");
+    auto table = db->open_table("items");
+    table->create_field("id", jato::long_type::type);
+
+    auto add = [&](int id) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        table->add_record(move(record));
+    };
+
+    add(1);
+    auto snapshot = db->snapshot();
+    auto snapshot_items = snapshot->open_table("items");
+    add(2);
+    CHECK(table->count() == 2);
+    CHECK(snapshot_items->count() == 1);
+
+    snapshot.reset();
+    CHECK_THROWS_AS(snapshot_items->count(), jato::error);
+}
+
+TEST_CASE_METHOD(DatabaseTestFixture, "long snapshot readers are reported and aborted") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("items");
+
+    std::string reported;
+    jato::SnapshotOptions options;
+    options.warn_after_ms = 1;
+    options.abort_after_ms = 50;
+    options.on_long_reader = [&](const std::string& tablename, unsigned long) { reported = tablename; };
+
+    auto snapshot = db->snapshot(options);
+    auto items = snapshot->open_table("items");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(items->count() == 0);
+    CHECK(reported == "items");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    CHECK(snapshot->age_ms() >= 60);
+    CHECK_THROWS_AS(items->count(), jato::error);
+}
@@ -0,0 +1,157 @@
+#include "catch.hpp"
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace sys = std::tr2::sys;
+
+struct JoinTestFixture {
+
+    const sys::path testdb = "C:/tmp/test-database.edb";
+
+    JoinTestFixture() {
+        sys::remove(testdb);
+    }
+
+    ~JoinTestFixture() {
+    }
+
+    // customers 0..9 and two orders for each even customer
+    void populate(jato::interface::Database& db) {
+        db.create_table("customers");
+        auto customers = db.open_table("customers");
+        customers->create_field("id", jato::long_type::type);
+        customers->create_field("name", jato::text_type::type);
+        for (long id = 0; id < 10; ++id) {
+            auto record = jato::make_record();
+            record->set_field("id", jato::long_type(id));
+            record->set_field("name", jato::text_type("c" + std::to_string(id)));
+            customers->add_record(move(record));
+        }
+
+        db.create_table("orders");
+        auto orders = db.open_table("orders");
+        orders->create_field("customer", jato::long_type::type);
+        orders->create_field("total", jato::long_type::type);
+        for (long id = 0; id < 10; id += 2) {
+            for (long n = 1; n <= 2; ++n) {
+                auto record = jato::make_record();
+                record->set_field("customer", jato::long_type(id));
+                record->set_field("total", jato::long_type(id * 100 + n));
+                orders->add_record(move(record));
+            }
+        }
+        // an order without a customer joins nothing
+        auto orphan = jato::make_record();
+        orphan->set_field("total", jato::long_type(1));
+        orders->add_record(move(orphan));
+    }
+
+    auto joined(jato::interface::Table& outer, jato::interface::Table& inner, const jato::JoinSpec& spec,
+        jato::join_method& method) -> std::multimap<std::string, long> {
+        std::multimap<std::string, long> pairs;
+        method = outer.join(inner, spec, [&](const jato::interface::Record& customer, const jato::interface::Record& order) {
+            pairs.insert(std::make_pair(
+                boost::get<jato::text_type>(customer.get_field("name")).value,
+                boost::get<jato::long_type>(order.get_field("total")).value));
+            return true;
+        });
+        return pairs;
+    }
+
+    void check_pairs(const std::multimap<std::string, long>& pairs) {
+        REQUIRE(pairs.size() == 10);
+        CHECK(pairs.count("c0") == 2);
+        CHECK(pairs.count("c1") == 0);
+        auto c4 = pairs.find("c4")->second;
+        CHECK(c4 > 400);
+        CHECK(c4 < 500);
+        CHECK(pairs.count("c8") == 2);
+    }
+
+    auto customer_orders() -> jato::JoinSpec {
+        jato::JoinSpec spec;
+        spec.outer_fields.push_back("id");
+        spec.inner_fields.push_back("customer");
+        return spec;
+    }
+
+};
+
+TEST_CASE_METHOD(JoinTestFixture, "join through an index on the inner table") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    populate(*db);
+    auto customers = db->open_table("customers");
+    auto orders = db->open_table("orders");
+    orders->create_index("by_customer", std::vector<std::string> { "customer", "total" }, 0);
+
+    jato::join_method method;
+    check_pairs(joined(*customers, *orders, customer_orders(), method));
+    CHECK(method == jato::join_method::index_nested_loop);
+}
+
+TEST_CASE_METHOD(JoinTestFixture, "hash join without an index") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    populate(*db);
+    auto customers = db->open_table("customers");
+    auto orders = db->open_table("orders");
+
+    jato::join_method method;
+    check_pairs(joined(*customers, *orders, customer_orders(), method));
+    CHECK(method == jato::join_method::hash);
+}
+
+TEST_CASE_METHOD(JoinTestFixture, "partition a hash join that outgrows memory") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    populate(*db);
+    auto customers = db->open_table("customers");
+    auto orders = db->open_table("orders");
+
+    auto spec = customer_orders();
+    spec.memory_budget = 1;
+    jato::join_method method;
+    check_pairs(joined(*customers, *orders, spec, method));
+    CHECK(method == jato::join_method::partitioned_hash);
+}
+
+TEST_CASE_METHOD(JoinTestFixture, "stop a join early") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    populate(*db);
+    auto customers = db->open_table("customers");
+    auto orders = db->open_table("orders");
+
+    int calls = 0;
+    customers->join(*orders, customer_orders(), [&](const jato::interface::Record&, const jato::interface::Record&) {
+        return ++calls < 3;
+    });
+    CHECK(calls == 3);
+}
+
+TEST_CASE_METHOD(JoinTestFixture, "join fields must match") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    populate(*db);
+    auto customers = db->open_table("customers");
+    auto orders = db->open_table("orders");
+
+    jato::JoinSpec spec;
+    spec.outer_fields.push_back("name");
+    spec.inner_fields.push_back("customer");
+    auto ignore = [](const jato::interface::Record&, const jato::interface::Record&) { return true; };
+    CHECK_THROWS_AS(customers->join(*orders, spec, ignore), jato::error);
+    spec.outer_fields.push_back("id");
+    CHECK_THROWS_AS(customers->join(*orders, spec, ignore), jato::error);
+}
@@ -0,0 +1,115 @@
+#include "catch.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+#include <boost/uuid/uuid_generators.hpp>
+
+namespace {
+
+    template <typename J>
+    auto round_trip(const J& field) -> J {
+        auto key = jato::encode_key({ field });
+        auto values = jato::decode_key(key, { J::type });
+        REQUIRE(values.size() == 1);
+        return boost::get<J>(values[0]);
+    }
+
+    template <typename J>
+    void check_round_trip(decltype(J::value) min, decltype(J::value) max) {
+        CHECK(round_trip(J(min)).value == min);
+        CHECK(round_trip(J(max)).value == max);
+    }
+
+    template <typename J>
+    void check_order(std::vector<decltype(J::value)> values) {
+        std::sort(values.begin(), values.end());
+        for (std::size_t i = 1; i < values.size(); ++i) {
+            auto a = jato::encode_key({ J(values[i - 1]) });
+            auto b = jato::encode_key({ J(values[i]) });
+            INFO("index " << i);
+            CHECK(std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end()) == (values[i - 1] < values[i]));
+        }
+    }
+
+}
+
+TEST_CASE("encode_key round trips fixed size fields") {
+    check_round_trip<jato::bit_type>(0, 1);
+    check_round_trip<jato::ubyte_type>(0, 255);
+    check_round_trip<jato::short_type>(std::numeric_limits<std::int16_t>::min(), std::numeric_limits<std::int16_t>::max());
+    check_round_trip<jato::long_type>(std::numeric_limits<std::int32_t>::min(), std::numeric_limits<std::int32_t>::max());
+    check_round_trip<jato::currency_type>(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max());
+    check_round_trip<jato::float_type>(std::numeric_limits<float>::lowest(), std::numeric_limits<float>::max());
+    check_round_trip<jato::double_type>(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::max());
+    check_round_trip<jato::datetime_type>(-657434.0, 2958465.99999);
+    check_round_trip<jato::ulong_long_type>(0, std::numeric_limits<std::uint64_t>::max());
+    check_round_trip<jato::long_long_type>(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max());
+    check_round_trip<jato::ushort_type>(0, std::numeric_limits<std::uint16_t>::max());
+}
+
+TEST_CASE("encode_key round trips variable size fields") {
+    const std::vector<std::uint8_t> empty;
+    const std::vector<std::uint8_t> zeros { 0, 0, 1, 0, 0xff, 0 };
+    check_round_trip<jato::binary_type>(empty, zeros);
+    check_round_trip<jato::long_binary_type>(empty, zeros);
+    check_round_trip<jato::text_type>("", std::string("a\0b", 3));
+    check_round_trip<jato::long_text_type>("", std::string(1000, 'x'));
+
+    auto guid = boost::uuids::random_generator()();
+    CHECK(round_trip(jato::guid_type(guid)).value == guid);
+}
+
+TEST_CASE("encode_key preserves integer order") {
+    check_order<jato::short_type>({ -32768, -2, -1, 0, 1, 255, 256, 32767 });
+    check_order<jato::long_type>({ std::numeric_limits<std::int32_t>::min(), -65536, -1, 0, 1, 65536, std::numeric_limits<std::int32_t>::max() });
+    check_order<jato::long_long_type>({ std::numeric_limits<std::int64_t>::min(), -1, 0, 1, std::numeric_limits<std::int64_t>::max() });
+    check_order<jato::ulong_long_type>({ 0, 1, 255, 256, std::numeric_limits<std::uint64_t>::max() });
+}
+
+TEST_CASE("encode_key preserves floating point order") {
+    check_order<jato::double_type>({
+        -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::lowest(),
+        -1.5, -1.0, -std::numeric_limits<double>::min(), 0.0,
+        std::numeric_limits<double>::min(), 1.0, 1.5, std::numeric_limits<double>::max(),
+        std::numeric_limits<double>::infinity() });
+    check_order<jato::float_type>({ -100.0f, -0.5f, 0.0f, 0.25f, 3.0f });
+}
+
+TEST_CASE("encode_key preserves text order with prefixes and embedded zeros") {
+    check_order<jato::text_type>({ "", std::string("\0", 1), std::string("a\0", 2), "a", "ab", "abc", "b" });
+}
+
+TEST_CASE("encode_key orders GUIDs as ESENT indexes do") {
+    boost::uuids::uuid low = {}, high = {};
+    low.data[0] = 0xff;     // compared last
+    high.data[15] = 0x01;   // compared early
+    auto a = jato::encode_key({ jato::guid_type(low) });
+    auto b = jato::encode_key({ jato::guid_type(high) });
+    CHECK(std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end()));
+}
+
+TEST_CASE("encode_key orders tuples field by field") {
+    auto a = jato::encode_key({ jato::text_type("ab"), jato::long_type(2) });
+    auto b = jato::encode_key({ jato::text_type("ab"), jato::long_type(10) });
+    auto c = jato::encode_key({ jato::text_type("abc"), jato::long_type(-5) });
+    CHECK(std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end()));
+    CHECK(std::lexicographical_compare(b.begin(), b.end(), c.begin(), c.end()));
+
+    auto values = jato::decode_key(c, { jato::text_type::type, jato::long_type::type });
+    REQUIRE(values.size() == 2);
+    CHECK(boost::get<jato::text_type>(values[0]).value == "abc");
+    CHECK(boost::get<jato::long_type>(values[1]).value == -5);
+}
+
+TEST_CASE("decode_key rejects malformed keys") {
+    auto key = jato::encode_key({ jato::long_type(7) });
+    key.pop_back();
+    CHECK_THROWS_AS(jato::decode_key(key, { jato::long_type::type }), jato::error);
+    CHECK_THROWS_AS(jato::decode_key(jato::encode_key({ jato::text_type("x") }), { jato::long_type::type }), jato::error);
+}
@@ -0,0 +1,126 @@
+#include "catch.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace sys = std::tr2::sys;
+
+struct QueryTestFixture {
+
+    const sys::path testdb = "C:/tmp/test-database.edb";
+
+    QueryTestFixture() {
+        sys::remove(testdb);
+    }
+
+    ~QueryTestFixture() {
+    }
+
+    // people 0..99 with age id % 50 and a name, except that every tenth has no age
+    auto populate(jato::interface::Database& db) -> jato::table_ptr {
+        db.create_table("people");
+        auto table = db.open_table("people");
+        table->create_field("id", jato::long_type::type);
+        table->create_field("age", jato::long_type::type);
+        table->create_field("name", jato::text_type::type);
+        table->create_index("by_id", std::vector<std::string> { "id" }, jato::primary_index);
+        for (long id = 0; id < 100; ++id) {
+            auto record = jato::make_record();
+            record->set_field("id", jato::long_type(id));
+            if (id % 10 != 9) record->set_field("age", jato::long_type(id % 50));
+            record->set_field("name", jato::text_type("p" + std::to_string(id)));
+            table->add_record(move(record));
+        }
+        return table;
+    }
+
+    auto ids(jato::interface::Query& query) -> std::vector<long> {
+        std::vector<long> found;
+        query.foreach_record([&](jato::record_ptr record) {
+            found.push_back(boost::get<jato::long_type>(record->get_field("id")).value);
+            return true;
+        });
+        return found;
+    }
+
+};
+
+TEST_CASE_METHOD(QueryTestFixture, "filter and project a table scan") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = populate(*db);
+
+    auto query = table->query();
+    query->where(jato::Predicate { "age", jato::compare_op::equal, jato::long_type(7) })
+        .select(std::vector<std::string> { "id" });
+    CHECK(query->plan().access == jato::query_access::table_scan);
+
+    auto found = ids(*query);
+    REQUIRE(found.size() == 2);
+    CHECK(found[0] == 7);
+    CHECK(found[1] == 57);
+
+    query->foreach_record([&](jato::record_ptr record) {
+        CHECK_THROWS_AS(record->get_field("name"), jato::error);
+        return true;
+    });
+}
+
+TEST_CASE_METHOD(QueryTestFixture, "narrow a query to a primary key range") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = populate(*db);
+
+    auto query = table->query();
+    query->where(jato::Predicate { "id", jato::compare_op::greater, jato::long_type(10) })
+        .where(jato::Predicate { "id", jato::compare_op::less_equal, jato::long_type(20) })
+        .limit(5);
+    auto plan = query->plan();
+    CHECK(plan.access == jato::query_access::index_range);
+    CHECK(plan.index == "by_id");
+
+    auto found = ids(*query);
+    REQUIRE(found.size() == 5);
+    CHECK(found[0] == 11);
+    CHECK(found[4] == 15);
+}
+
+TEST_CASE_METHOD(QueryTestFixture, "read a covering index") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = populate(*db);
+    table->create_index("by_age", std::vector<std::string> { "age", "id" }, 0);
+
+    auto query = table->query();
+    query->where(jato::Predicate { "age", jato::compare_op::less, jato::long_type(2) })
+        .select(std::vector<std::string> { "id", "age" });
+    auto plan = query->plan();
+    CHECK(plan.access == jato::query_access::covering_index);
+    CHECK(plan.index == "by_age");
+
+    // in index order; records without an age are not in range
+    auto found = ids(*query);
+    REQUIRE(found.size() == 4);
+    CHECK(found[0] == 0);
+    CHECK(found[1] == 50);
+    CHECK(found[2] == 1);
+    CHECK(found[3] == 51);
+}
+
+TEST_CASE_METHOD(QueryTestFixture, "predicates must match the field type") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = populate(*db);
+
+    auto query = table->query();
+    CHECK_THROWS_AS(query->where(jato::Predicate { "age", jato::compare_op::equal, jato::long_long_type(7) }), jato::error);
+    CHECK_THROWS_AS(query->where(jato::Predicate { "height", jato::compare_op::equal, jato::long_type(7) }), jato::error);
+    CHECK_THROWS_AS(query->select(std::vector<std::string> { "height" }), jato::error);
+}
@@ -0,0 +1,93 @@
+#include "catch.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../jato/internal.h"
+
+namespace {
+
+    // waits up to ten seconds for done to hold
+    template <typename Condition>
+    auto wait_for(Condition done) -> bool {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!done()) {
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+}
+
+TEST_CASE("tasks queued behind a busy worker are taken by others") {
+    jato::scheduler pool(2);
+    const std::size_t count = 16;
+    std::atomic<std::size_t> others(0);
+    std::atomic<bool> waited(false);
+
+    // task 0 holds its worker until every task queued after it has run
+    std::vector<jato::task> tasks;
+    for (std::size_t k = 0; k < count; ++k) {
+        tasks.push_back([&, k](jato::worker_context&) {
+            if (k == 0) {
+                waited = wait_for([&](){ return others == count - 1; });
+            } else {
+                ++others;
+            }
+        });
+    }
+    pool.run(tasks);
+    CHECK(waited);
+    CHECK(others == count - 1);
+}
+
+TEST_CASE("tasks may run nested jobs") {
+    // one worker: the nested jobs only finish because their callers help
+    jato::scheduler pool(1);
+    std::atomic<int> inner(0);
+    std::vector<jato::task> outer;
+    for (int k = 0; k < 4; ++k) {
+        outer.push_back([&](jato::worker_context&) {
+            std::vector<jato::task> nested;
+            for (int i = 0; i < 8; ++i)
+                nested.push_back([&](jato::worker_context&) { ++inner; });
+            pool.run(nested);
+        });
+    }
+    pool.run(outer);
+    CHECK(inner == 32);
+}
+
+TEST_CASE("run rethrows a task's exception once every task is done") {
+    jato::scheduler pool(2);
+    std::atomic<int> finished(0);
+    std::vector<jato::task> tasks;
+    for (int k = 0; k < 8; ++k) {
+        tasks.push_back([&, k](jato::worker_context&) {
+            if (k == 3) throw std::runtime_error("task failed");
+            ++finished;
+        });
+    }
+    CHECK_THROWS_AS(pool.run(tasks), std::runtime_error);
+    CHECK(finished == 7);
+}
+
+TEST_CASE("posted tasks run without a caller waiting") {
+    jato::scheduler pool(2);
+    std::atomic<int> ran(0);
+    std::atomic<std::size_t> slot(2);
+    pool.post([&](jato::worker_context& worker) {
+        slot = worker.slot();
+        ++ran;
+    });
+    pool.post([&](jato::worker_context&) {
+        ++ran;
+        throw std::runtime_error("dropped");
+    });
+    CHECK(wait_for([&](){ return ran == 2; }));
+    CHECK(slot < 2);
+}
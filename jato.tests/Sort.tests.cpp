@@ -0,0 +1,78 @@
+#include "catch.hpp"
+
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace {
+
+    auto people_spec() -> jato::SortSpec {
+        jato::SortSpec spec;
+        spec.fields.push_back(jato::FieldDescriptor { "name", jato::text_type::type, 0 });
+        spec.fields.push_back(jato::FieldDescriptor { "age", jato::long_type::type, 0 });
+        spec.keys.push_back(jato::SortKey { "age", true });
+        return spec;
+    }
+
+    void add_person(jato::interface::Sorter& sorter, const std::string& name, long age) {
+        auto record = jato::make_record();
+        record->set_field("name", jato::text_type(name));
+        record->set_field("age", jato::long_type(age));
+        sorter.add(*record);
+    }
+
+    auto sorted_names(jato::interface::Sorter& sorter) -> std::vector<std::string> {
+        std::vector<std::string> names;
+        sorter.foreach_record([&](jato::record_ptr record) {
+            names.push_back(boost::get<jato::text_type>(record->get_field("name")).value);
+            return true;
+        });
+        return names;
+    }
+
+}
+
+TEST_CASE("sort records through a temporary table") {
+    auto session = jato::make_session();
+    auto sorter = session->make_sorter(people_spec());
+    add_person(*sorter, "Ada", 36);
+    add_person(*sorter, "Alan", 41);
+    add_person(*sorter, "Grace", 36);
+    add_person(*sorter, "Edsger", 72);
+
+    // descending by age, ties in the order added
+    auto names = sorted_names(*sorter);
+    REQUIRE(names.size() == 4);
+    CHECK(names[0] == "Edsger");
+    CHECK(names[1] == "Alan");
+    CHECK(names[2] == "Ada");
+    CHECK(names[3] == "Grace");
+
+    CHECK_THROWS_AS(add_person(*sorter, "Barbara", 80), jato::error);
+}
+
+TEST_CASE("keep the top records of a sort") {
+    auto session = jato::make_session();
+    auto spec = people_spec();
+    spec.limit = 2;
+    auto sorter = session->make_sorter(spec);
+    for (long age = 1; age <= 100; ++age)
+        add_person(*sorter, "p" + std::to_string(age), age);
+
+    auto names = sorted_names(*sorter);
+    REQUIRE(names.size() == 2);
+    CHECK(names[0] == "p100");
+    CHECK(names[1] == "p99");
+}
+
+TEST_CASE("sort keys must be short fields") {
+    auto session = jato::make_session();
+    auto spec = people_spec();
+    spec.keys[0].field = "height";
+    CHECK_THROWS_AS(session->make_sorter(spec), jato::error);
+
+    spec.fields.push_back(jato::FieldDescriptor { "notes", jato::long_text_type::type, 0 });
+    spec.keys[0].field = "notes";
+    CHECK_THROWS_AS(session->make_sorter(spec), jato::error);
+}
@@ -1,12 +1,30 @@
 #include "catch.hpp"
 
+#include <chrono>
 #include <filesystem>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <jato.h>
 
 namespace sys = std::tr2::sys;
 
+namespace {
+
+    // waits up to ten seconds for the key filter's build to stop
+    auto wait_for_key_filter(jato::interface::Table& table) -> jato::KeyFilterStats {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        auto stats = table.key_filter_stats();
+        while (!stats.ready && !stats.failed && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            stats = table.key_filter_stats();
+        }
+        return stats;
+    }
+
+}
+
 struct TableTestFixture {
 
     const sys::path testdb = "C:/tmp/test-database.edb";
@@ -28,3 +46,542 @@ TEST_CASE_METHOD(TableTestFixture, "open MSysObjects table") {
     auto db = session->open_database(testdb);
     CHECK_NOTHROW(db->open_table(sysobjects));
 }
+
+TEST_CASE_METHOD(TableTestFixture, "add and read records") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("people");
+    auto table = db->open_table("people");
+    table->create_field("name", jato::text_type::type);
+    table->create_field("age", jato::long_type::type);
+
+    auto record = jato::make_record();
+    record->set_field("name", jato::text_type("Ada"));
+    record->set_field("age", jato::long_type(36));
+    table->add_record(move(record));
+
+    int count = 0;
+    table->foreach_record([&](jato::record_ptr record) {
+        CHECK(boost::get<jato::text_type>(record->get_field("name")).value == "Ada");
+        CHECK(boost::get<jato::long_type>(record->get_field("age")).value == 36);
+        ++count;
+        return true;
+    });
+    CHECK(count == 1);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "stream long values") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("blobs");
+    auto table = db->open_table("blobs");
+    table->create_field("id", jato::long_type::type);
+    table->create_field("data", jato::long_binary_type::type);
+
+    std::vector<std::uint8_t> chunk(100000);
+    for (std::size_t i = 0; i < chunk.size(); ++i) chunk[i] = static_cast<std::uint8_t>(i);
+
+    auto record = jato::make_record();
+    record->set_field("id", jato::long_type(1));
+    table->add_record(move(record), "data", [&](jato::interface::LongValueWriter& writer) {
+        for (int i = 0; i < 10; ++i) writer.write(chunk.data(), chunk.size());
+    });
+
+    table->foreach_record({ "id" }, [&](jato::record_ptr record) {
+        CHECK_THROWS_AS(record->get_field("data"), jato::error);
+        table->read_long_value("data", [&](jato::interface::LongValueReader& reader) {
+            CHECK(reader.size() == 10 * chunk.size());
+            std::vector<std::uint8_t> buffer(4096);
+            std::uint64_t total = 0;
+            while (auto count = reader.read(buffer.data(), buffer.size())) {
+                for (std::size_t i = 0; i < count; ++i)
+                    REQUIRE(buffer[i] == static_cast<std::uint8_t>((total + i) % chunk.size()));
+                total += count;
+            }
+            CHECK(total == reader.size());
+        });
+        return true;
+    });
+
+    // an index range walk reads from its own cursor, not the table's
+    auto second = jato::make_record();
+    second->set_field("id", jato::long_type(2));
+    table->add_record(move(second), "data", [&](jato::interface::LongValueWriter& writer) {
+        writer.write(chunk.data(), 10);
+    });
+    table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+    table->foreach_record("by_id", { jato::long_type(2) }, { jato::long_type(2) }, [&](jato::record_ptr) {
+        table->read_long_value("data", [&](jato::interface::LongValueReader& reader) {
+            CHECK(reader.size() == 10);
+        });
+        return true;
+    });
+}
+
+TEST_CASE_METHOD(TableTestFixture, "compressed long text field") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("documents");
+    auto table = db->open_table("documents");
+    table->create_field("json", jato::long_text_type::type, jato::compressed_field);
+    CHECK_THROWS_AS(table->create_field("id", jato::long_type::type, jato::compressed_field), jato::error);
+
+    auto fields = table->fields();
+    REQUIRE(fields.size() == 1);
+    CHECK(fields[0].flags == jato::compressed_field);
+
+    std::string json;
+    for (int i = 0; i < 1000; ++i) json += "{\"key\":\"value\",\"count\":42},";
+
+    auto record = jato::make_record();
+    record->set_field("json", jato::long_text_type(json));
+    table->add_record(move(record));
+
+    table->foreach_record([&](jato::record_ptr record) {
+        CHECK(boost::get<jato::long_text_type>(record->get_field("json")).value == json);
+        return true;
+    });
+}
+
+TEST_CASE_METHOD(TableTestFixture, "scan numeric fields in batches") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("metrics");
+    auto table = db->open_table("metrics");
+    table->create_field("id", jato::long_type::type);
+    table->create_field("value", jato::double_type::type);
+
+    for (int i = 0; i < 1000; ++i) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(i));
+        if (i % 2 == 0) record->set_field("value", jato::double_type(i / 10.0));
+        table->add_record(move(record));
+    }
+
+    std::size_t rows = 0;
+    std::size_t selected = 0;
+    table->scan({ "id", "value" }, 256, [&](const jato::RecordBatch& batch) {
+        CHECK(batch.rows <= 256);
+        rows += batch.rows;
+        selected += jato::count_selected(jato::filter(batch, {
+            jato::Predicate { "value", jato::compare_op::greater_equal, jato::double_type(50.0) }
+        }));
+        return true;
+    });
+    CHECK(rows == 1000);
+    CHECK(selected == 250);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "aggregate grouped sums") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("orders");
+    auto table = db->open_table("orders");
+    table->create_field("customer", jato::long_type::type);
+    table->create_field("amount", jato::currency_type::type);
+
+    for (int i = 0; i < 3000; ++i) {
+        auto record = jato::make_record();
+        record->set_field("customer", jato::long_type(i % 3));
+        record->set_field("amount", jato::currency_type(i));
+        table->add_record(move(record));
+    }
+
+    jato::AggregateSpec spec;
+    spec.group_by = { "customer" };
+    spec.aggregates = {
+        jato::Aggregate { jato::aggregate_op::count, "" },
+        jato::Aggregate { jato::aggregate_op::sum, "amount" },
+        jato::Aggregate { jato::aggregate_op::max, "amount" }
+    };
+
+    for (std::size_t partitions = 1; partitions <= 4; partitions += 3) {
+        spec.partitions = partitions;
+        auto rows = table->aggregate(spec);
+        REQUIRE(rows.size() == 3);
+        for (auto& row : rows) {
+            auto customer = boost::get<jato::long_type>(*row.group[0]).value;
+            CHECK(boost::get<jato::long_long_type>(*row.values[0]).value == 1000);
+            CHECK(boost::get<jato::currency_type>(*row.values[1]).value == 1000 * 999 * 3 / 2 + 1000 * customer);
+            CHECK(boost::get<jato::currency_type>(*row.values[2]).value == 2997 + customer);
+        }
+    }
+}
+
+TEST_CASE_METHOD(TableTestFixture, "count records and index ranges") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("events");
+    auto table = db->open_table("events");
+    table->create_field("id", jato::long_type::type);
+    table->create_field("kind", jato::text_type::type);
+    table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+    table->create_index("by_kind", { "kind", "id" }, 0);
+
+    CHECK(table->count() == 0);
+
+    for (int i = 0; i < 5000; ++i) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(i));
+        record->set_field("kind", jato::text_type(i % 5 == 0 ? "error" : "info"));
+        table->add_record(move(record));
+    }
+
+    CHECK(table->count() == 5000);
+    CHECK(table->estimate_count(10000) == 5000);
+    // record positions are approximate, but not by more than a factor of two here
+    auto estimate = table->estimate_count(100);
+    CHECK(estimate >= 2500);
+    CHECK(estimate <= 10000);
+
+    CHECK(table->count("by_id", { jato::long_type(100) }, { jato::long_type(199) }) == 100);
+    CHECK(table->count("by_id", { jato::long_type(4990) }, {}) == 10);
+    CHECK(table->count("by_id", { jato::long_type(6000) }, {}) == 0);
+    CHECK(table->count("by_kind", { jato::text_type("error") }, { jato::text_type("error") }) == 1000);
+    auto infos = table->estimate_count("by_kind", { jato::text_type("info") }, { jato::text_type("info") }, 0);
+    CHECK(infos >= 2000);
+    CHECK(infos <= 8000);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "increment escrow counters") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("usage");
+    auto table = db->open_table("usage");
+    table->create_field("customer", jato::long_type::type);
+    table->create_field("calls", jato::long_long_type::type, jato::escrow_field);
+    table->create_field("errors", jato::long_type::type, jato::escrow_field);
+    table->create_index("by_customer", { "customer" }, jato::primary_index | jato::unique_index);
+
+    auto record = jato::make_record();
+    record->set_field("customer", jato::long_type(7));
+    table->add_record(move(record));
+
+    for (int i = 0; i < 100; ++i)
+        table->increment({ jato::long_type(7) }, "calls", 3);
+    CHECK(table->increment({ jato::long_type(7) }, "calls", 0) == 300);
+    CHECK(table->increment({ jato::long_type(7) }, "errors", -2) == -2);
+
+    CHECK_THROWS_AS(table->increment({ jato::long_type(8) }, "calls", 1), jato::error);
+    CHECK_THROWS_AS(table->increment({ jato::long_type(7) }, "customer", 1), jato::error);
+    CHECK_THROWS_AS(table->create_field("bad", jato::text_type::type, jato::escrow_field), jato::error);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "walk a table in resumable chunks") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("jobs");
+    auto table = db->open_table("jobs");
+    table->create_field("id", jato::long_type::type);
+    table->create_index("by_id", { "id" }, jato::primary_index);
+    for (int i = 0; i < 25; ++i) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(i));
+        table->add_record(move(record));
+    }
+
+    std::vector<std::vector<char>> positions;
+    jato::ChunkOptions options;
+    options.records_per_chunk = 10;
+    options.on_commit = [&](const std::vector<char>& position) { positions.push_back(position); };
+
+    int visited = 0;
+    table->foreach_chunked(options, [&](jato::record_ptr) { ++visited; return true; });
+    CHECK(visited == 25);
+    CHECK(positions.size() == 3);
+
+    visited = 0;
+    options.resume_from = positions[0];
+    options.on_commit = nullptr;
+    table->foreach_chunked(options, [&](jato::record_ptr) { ++visited; return true; });
+    CHECK(visited == 15);
+
+    // the record a position names can go away before the walk resumes
+    CHECK(table->delete_range({ jato::long_type(9) }, { jato::long_type(9) }) == 1);
+    visited = 0;
+    table->foreach_chunked(options, [&](jato::record_ptr) { ++visited; return true; });
+    CHECK(visited == 15);
+
+    visited = 0;
+    options.resume_from.clear();
+    table->foreach_chunked(options, [&](jato::record_ptr) { return ++visited < 12; });
+    CHECK(visited == 12);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "find records by primary key through the row cache") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("customers");
+    auto table = db->open_table("customers");
+    table->create_field("id", jato::long_type::type);
+    table->create_field("name", jato::text_type::type);
+    table->create_field("visits", jato::long_type::type, jato::escrow_field);
+    table->create_index("by_id", { "id" }, jato::primary_index);
+
+    for (int i = 0; i < 10; ++i) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(i));
+        record->set_field("name", jato::text_type("customer " + std::to_string(i)));
+        table->add_record(move(record));
+    }
+
+    CHECK_FALSE(table->find({ jato::long_type(42) }));
+    auto found = table->find({ jato::long_type(3) });
+    REQUIRE(found);
+    CHECK(boost::get<jato::text_type>(found->get_field("name")).value == "customer 3");
+
+    table->cache_rows(1 << 20);
+    auto other = db->open_table("customers");
+    table->find({ jato::long_type(3) });
+    other->find({ jato::long_type(3) });
+    auto stats = table->row_cache_stats();
+    CHECK(stats.misses == 1);
+    CHECK(stats.hits == 1);
+    CHECK(stats.rows == 1);
+
+    other->increment({ jato::long_type(3) }, "visits", 1);
+    found = table->find({ jato::long_type(3) });
+    CHECK(boost::get<jato::long_type>(found->get_field("visits")).value == 1);
+    CHECK(table->row_cache_stats().misses == 2);
+
+    table->cache_rows(0);
+    CHECK(table->row_cache_stats().rows == 0);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "the row cache keys text by the index's normalized form") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("users");
+    auto table = db->open_table("users");
+    table->create_field("name", jato::text_type::type);
+    table->create_field("logins", jato::long_type::type, jato::escrow_field);
+    table->create_index("by_name", { "name" }, jato::primary_index);
+
+    auto record = jato::make_record();
+    record->set_field("name", jato::text_type("Ada"));
+    table->add_record(move(record));
+
+    // text indexes ignore case, so both spellings name one row
+    table->cache_rows(1 << 20);
+    REQUIRE(table->find({ jato::text_type("Ada") }));
+    REQUIRE(table->find({ jato::text_type("ADA") }));
+    auto stats = table->row_cache_stats();
+    CHECK(stats.rows == 1);
+    CHECK(stats.hits == 1);
+
+    table->increment({ jato::text_type("ada") }, "logins", 1);
+    auto found = table->find({ jato::text_type("Ada") });
+    REQUIRE(found);
+    CHECK(boost::get<jato::long_type>(found->get_field("logins")).value == 1);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "answer missing keys from the key filter") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("ingest");
+    auto table = db->open_table("ingest");
+    table->create_field("id", jato::long_long_type::type);
+    table->create_index("by_id", { "id" }, jato::primary_index);
+
+    auto add = [&](std::int64_t id) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_long_type(id));
+        table->add_record(move(record));
+    };
+    for (std::int64_t i = 0; i < 1000; ++i) add(i * 2);
+
+    table->enable_key_filter(10);
+    REQUIRE(wait_for_key_filter(*table).ready);
+
+    add(5001);
+    CHECK(table->find({ jato::long_long_type(5001) }));
+    for (std::int64_t i = 0; i < 1000; ++i) {
+        CHECK(table->find({ jato::long_long_type(i * 2) }));
+        CHECK_FALSE(table->find({ jato::long_long_type(i * 2 + 1) }));
+    }
+
+    auto stats = table->key_filter_stats();
+    CHECK(stats.lookups == 2001);
+    CHECK(stats.negatives > 900);
+    CHECK_NOTHROW(table->save_key_filter());
+}
+
+TEST_CASE_METHOD(TableTestFixture, "a saved key filter goes away with its table") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+
+    auto fill = [&](std::int64_t from) -> jato::table_ptr {
+        db->create_table("ingest");
+        auto table = db->open_table("ingest");
+        table->create_field("id", jato::long_long_type::type);
+        table->create_index("by_id", { "id" }, jato::primary_index);
+        for (std::int64_t i = from; i < from + 100; ++i) {
+            auto record = jato::make_record();
+            record->set_field("id", jato::long_long_type(i));
+            table->add_record(move(record));
+        }
+        return table;
+    };
+
+    {
+        auto table = fill(0);
+        table->enable_key_filter(10);
+        REQUIRE(wait_for_key_filter(*table).ready);
+        table->save_key_filter();
+    }
+    db->delete_table("ingest");
+
+    // a table of the same name builds its own filter rather than loading the old one
+    auto table = fill(1000);
+    table->enable_key_filter(10);
+    REQUIRE(wait_for_key_filter(*table).ready);
+    CHECK(table->find({ jato::long_long_type(1050) }));
+    CHECK_FALSE(table->find({ jato::long_long_type(50) }));
+}
+
+TEST_CASE_METHOD(TableTestFixture, "delete a key range") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("events");
+    auto table = db->open_table("events");
+    table->create_field("id", jato::long_type::type);
+    table->create_field("kind", jato::long_type::type);
+    table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+    table->create_index("by_kind", { "kind" }, 0);
+    for (long id = 0; id < 3000; ++id) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        record->set_field("kind", jato::long_type(id % 3));
+        table->add_record(move(record));
+    }
+    db->create_view("events", jato::ViewSpec { "events_by_kind", { "kind" }, {} });
+    table->cache_rows(1 << 20);
+    CHECK(table->find({ jato::long_type(1500) }));
+
+    CHECK(table->delete_range({ jato::long_type(1000) }, { jato::long_type(2499) }) == 1500);
+    CHECK(table->count() == 1500);
+    CHECK(!table->find({ jato::long_type(1500) }));
+    CHECK(table->find({ jato::long_type(2500) }));
+
+    CHECK(table->delete_range("by_kind", { jato::long_type(0) }, { jato::long_type(0) }) == 500);
+    CHECK(table->count() == 1000);
+    auto view = db->open_table("events_by_kind");
+    CHECK(!view->find({ jato::long_type(0) }));
+    auto ones = view->find({ jato::long_type(1) });
+    REQUIRE(ones);
+    CHECK(boost::get<jato::long_long_type>(ones->get_field("count")).value == 500);
+
+    CHECK(table->delete_range({ jato::long_type(5000) }, {}) == 0);
+}
+
+TEST_CASE_METHOD(TableTestFixture, "truncate a table and keep its schema") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("log");
+    auto table = db->open_table("log");
+    table->create_field("id", jato::long_type::type);
+    table->create_field("hits", jato::long_type::type, jato::escrow_field);
+    table->create_field("note", jato::text_type::type);
+    table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+    table->create_index("by_note", { "note" }, jato::sparse_index);
+    for (long id = 0; id < 100; ++id) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        table->add_record(move(record));
+    }
+
+    table->truncate();
+    CHECK(table->count() == 0);
+    CHECK(table->fields().size() == 3);
+    auto indexes = table->indexes();
+    REQUIRE(indexes.size() == 2);
+
+    // the escrow field kept its default
+    auto record = jato::make_record();
+    record->set_field("id", jato::long_type(7));
+    table->add_record(move(record));
+    CHECK(table->increment({ jato::long_type(7) }, "hits", 2) == 2);
+
+    db->transaction([&]() {
+        CHECK_THROWS_AS(table->truncate(), jato::error);
+    });
+}
+
+TEST_CASE_METHOD(TableTestFixture, "upsert and merge records by primary key") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("stock");
+    auto table = db->open_table("stock");
+    table->create_field("sku", jato::long_type::type);
+    table->create_field("count", jato::long_type::type);
+    table->create_field("name", jato::text_type::type);
+    table->create_index("by_sku", { "sku" }, jato::primary_index | jato::unique_index);
+
+    auto item = [](long sku, long count) {
+        auto record = jato::make_record();
+        record->set_field("sku", jato::long_type(sku));
+        record->set_field("count", jato::long_type(count));
+        return record;
+    };
+    auto first = item(1, 5);
+    first->set_field("name", jato::text_type("bolt"));
+    CHECK(table->upsert(move(first)));
+    CHECK(!table->upsert(item(1, 8)));
+    CHECK(table->count() == 1);
+    auto found = table->find({ jato::long_type(1) });
+    REQUIRE(found);
+    CHECK(boost::get<jato::long_type>(found->get_field("count")).value == 8);
+    // fields the record did not have are kept
+    CHECK(boost::get<jato::text_type>(found->get_field("name")).value == "bolt");
+
+    auto add = [](long delta) {
+        return [delta](jato::record_ptr current) -> jato::record_ptr {
+            long count = current ? boost::get<jato::long_type>(current->get_field("count")).value : 0;
+            auto record = jato::make_record();
+            record->set_field("sku", jato::long_type(2));
+            record->set_field("count", jato::long_type(count + delta));
+            return move(record);
+        };
+    };
+    CHECK(table->merge({ jato::long_type(2) }, add(3)));
+    CHECK(table->merge({ jato::long_type(2) }, add(4)));
+    found = table->find({ jato::long_type(2) });
+    REQUIRE(found);
+    CHECK(boost::get<jato::long_type>(found->get_field("count")).value == 7);
+
+    CHECK(!table->merge({ jato::long_type(3) }, [](jato::record_ptr) { return jato::record_ptr(); }));
+    CHECK(table->count() == 2);
+
+    // the merged record must keep the key, and have it all to be inserted
+    CHECK_THROWS_AS(table->merge({ jato::long_type(1) }, add(1)), jato::error);
+    CHECK_THROWS_AS(table->merge({ jato::long_type(3) }, add(1)), jato::error);
+    CHECK_THROWS_AS(table->merge({ jato::long_type(4) }, [](jato::record_ptr) {
+        auto record = jato::make_record();
+        record->set_field("count", jato::long_type(1));
+        return record;
+    }), jato::error);
+    CHECK(table->count() == 2);
+    found = table->find({ jato::long_type(1) });
+    REQUIRE(found);
+    CHECK(boost::get<jato::long_type>(found->get_field("count")).value == 8);
+
+    db->create_table("loose");
+    auto loose = db->open_table("loose");
+    loose->create_field("sku", jato::long_type::type);
+    CHECK_THROWS_AS(loose->upsert(item(1, 1)), jato::error);
+}
@@ -0,0 +1,131 @@
+#include "catch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <jato.h>
+
+namespace sys = std::tr2::sys;
+
+struct TtlTestFixture {
+
+    const sys::path testdb = "C:/tmp/test-database.edb";
+
+    TtlTestFixture() {
+        sys::remove(testdb);
+    }
+
+    ~TtlTestFixture() {
+    }
+
+    // now plus offset_days as an OLE automation date in local time
+    auto days_from_now(double offset_days) -> jato::datetime_type {
+        auto now = std::time(nullptr);
+        std::tm local;
+        // read the local wall clock back as if it were UTC
+#ifdef _WIN32
+        localtime_s(&local, &now);
+        auto wall_clock = _mkgmtime(&local);
+#else
+        localtime_r(&now, &local);
+        auto wall_clock = timegm(&local);
+#endif
+        return jato::datetime_type(25569.0 + wall_clock / 86400.0 + offset_days);
+    }
+
+    // even ids expired a day ago, odd ones expire in a day, and every
+    // tenth never expires
+    auto create_sessions(jato::interface::Database& db) -> jato::table_ptr {
+        db.create_table("sessions");
+        auto table = db.open_table("sessions");
+        table->create_field("id", jato::long_type::type);
+        table->create_field("expires", jato::datetime_type::type);
+        table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+        for (long id = 0; id < 100; ++id) {
+            auto record = jato::make_record();
+            record->set_field("id", jato::long_type(id));
+            if (id % 10 != 0) record->set_field("expires", days_from_now(id % 2 == 0 ? -1 : 1));
+            table->add_record(move(record));
+        }
+        return table;
+    }
+
+    auto visible(jato::interface::Table& table) -> std::size_t {
+        std::size_t count = 0;
+        table.foreach_record([&](jato::record_ptr) {
+            ++count;
+            return true;
+        });
+        return count;
+    }
+
+};
+
+TEST_CASE_METHOD(TtlTestFixture, "hide expired records and sweep them away") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto table = create_sessions(*db);
+
+    jato::TtlOptions options;
+    options.interval_ms = 10;
+    options.records_per_transaction = 7;
+    db->enable_ttl("sessions", "expires", options);
+
+    // 40 records have expired, whether or not they are swept yet
+    CHECK(!table->find({ jato::long_type(2) }));
+    CHECK(table->find({ jato::long_type(3) }));
+    CHECK(table->find({ jato::long_type(10) }));
+    CHECK(visible(*table) == 60);
+    auto query = table->query();
+    query->where(jato::Predicate { "id", jato::compare_op::less, jato::long_type(20) });
+    std::size_t queried = 0;
+    query->foreach_record([&](jato::record_ptr) {
+        ++queried;
+        return true;
+    });
+    CHECK(queried == 12);
+
+    // the sparse ttl index leaves out records that never expire, so it
+    // cannot cover a query that does not rule them out
+    auto expiries = table->query();
+    expiries->select({ "expires" });
+    CHECK(expiries->plan().access == jato::query_access::table_scan);
+    std::size_t selected = 0;
+    expiries->foreach_record([&](jato::record_ptr) {
+        ++selected;
+        return true;
+    });
+    CHECK(selected == 60);
+    expiries->where(jato::Predicate { "expires", jato::compare_op::greater, days_from_now(0) });
+    CHECK(expiries->plan().index == "ttl_expires");
+
+    for (int i = 0; i < 500 && db->ttl_stats("sessions").swept < 40; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(db->ttl_stats("sessions").swept == 40);
+    CHECK(db->ttl_stats("sessions").failures == 0);
+    CHECK(table->count() == 60);
+
+    auto indexes = table->indexes();
+    auto ttl_index = std::find_if(indexes.begin(), indexes.end(),
+        [](const jato::IndexDescriptor& index) { return index.name == "ttl_expires"; });
+    REQUIRE(ttl_index != indexes.end());
+    CHECK((ttl_index->flags & jato::sparse_index) != 0);
+}
+
+TEST_CASE_METHOD(TtlTestFixture, "only expire by a datetime field") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    create_sessions(*db);
+
+    CHECK_THROWS_AS(db->enable_ttl("sessions", "id", jato::TtlOptions()), jato::error);
+    CHECK_THROWS_AS(db->enable_ttl("sessions", "missing", jato::TtlOptions()), jato::error);
+    db->enable_ttl("sessions", "expires", jato::TtlOptions());
+    db->delete_table("sessions");
+}
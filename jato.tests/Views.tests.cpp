@@ -0,0 +1,165 @@
+#include "catch.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <jato.h>
+
+namespace sys = std::tr2::sys;
+
+struct ViewsTestFixture {
+
+    const sys::path testdb = "C:/tmp/test-database.edb";
+
+    ViewsTestFixture() {
+        sys::remove(testdb);
+    }
+
+    ~ViewsTestFixture() {
+    }
+
+    auto create_orders(jato::interface::Database& db) -> jato::table_ptr {
+        db.create_table("orders");
+        auto table = db.open_table("orders");
+        table->create_field("id", jato::long_type::type);
+        table->create_field("customer", jato::long_type::type);
+        table->create_field("amount", jato::currency_type::type);
+        table->create_field("items", jato::long_type::type, jato::escrow_field);
+        table->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+        return table;
+    }
+
+    void add_order(jato::interface::Table& table, long id, long customer, std::int64_t amount) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        record->set_field("customer", jato::long_type(customer));
+        record->set_field("amount", jato::currency_type(amount));
+        record->set_field("items", jato::long_type(1));
+        table.add_record(move(record));
+    }
+
+    auto view_field(jato::interface::Table& view, long customer, const std::string& fieldname) -> std::int64_t {
+        auto record = view.find({ jato::long_type(customer) });
+        if (!record) return -1;
+        return boost::get<jato::long_long_type>(record->get_field(fieldname)).value;
+    }
+
+};
+
+TEST_CASE_METHOD(ViewsTestFixture, "maintain grouped counts and sums") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto orders = create_orders(*db);
+
+    // rows before the view is created are folded in when it is
+    for (long id = 0; id < 10; ++id) add_order(*orders, id, id % 3, 100 * id);
+    db->create_view("orders", jato::ViewSpec { "orders_by_customer", { "customer" }, { "amount", "items" } });
+    for (long id = 10; id < 20; ++id) add_order(*orders, id, id % 3, 100 * id);
+
+    auto view = db->open_table("orders_by_customer");
+    CHECK(view_field(*view, 0, "count") == 7);
+    CHECK(view_field(*view, 1, "count") == 7);
+    CHECK(view_field(*view, 2, "count") == 6);
+    // 0 + 3 + 6 + ... + 18
+    CHECK(view_field(*view, 0, "sum_amount") == 6300);
+    CHECK(view_field(*view, 0, "sum_items") == 7);
+    CHECK(view_field(*view, 3, "count") == -1);
+
+    orders->increment({ jato::long_type(4) }, "items", 5);
+    CHECK(view_field(*view, 1, "sum_items") == 12);
+    CHECK(view_field(*view, 1, "count") == 7);
+
+    auto specs = db->views("orders");
+    REQUIRE(specs.size() == 1);
+    CHECK(specs[0].name == "orders_by_customer");
+    CHECK(specs[0].sums.size() == 2);
+
+    // truncating the base empties the view with it
+    orders->truncate();
+    CHECK(view->count() == 0);
+    add_order(*orders, 0, 1, 100);
+    CHECK(view_field(*view, 1, "count") == 1);
+    CHECK(view_field(*view, 1, "sum_amount") == 100);
+}
+
+TEST_CASE_METHOD(ViewsTestFixture, "group text that differs only in case together") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    db->create_table("visits");
+    auto visits = db->open_table("visits");
+    visits->create_field("id", jato::long_type::type);
+    visits->create_field("name", jato::text_type::type);
+    visits->create_index("by_id", { "id" }, jato::primary_index | jato::unique_index);
+    auto visit = [&](long id, const std::string& name) {
+        auto record = jato::make_record();
+        record->set_field("id", jato::long_type(id));
+        record->set_field("name", jato::text_type(name));
+        visits->add_record(move(record));
+    };
+    visit(1, "Alice");
+    visit(2, "alice");
+    visit(3, "Bob");
+
+    // the backfill folds case as the view's index and later writes do
+    db->create_view("visits", jato::ViewSpec { "visits_by_name", { "name" }, {} });
+    visit(4, "ALICE");
+    auto view = db->open_table("visits_by_name");
+    CHECK(view->count() == 2);
+    auto alice = view->find({ jato::text_type("alice") });
+    REQUIRE(alice);
+    CHECK(boost::get<jato::long_long_type>(alice->get_field("count")).value == 3);
+}
+
+TEST_CASE_METHOD(ViewsTestFixture, "reject bad views and protect their base") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    create_orders(*db);
+
+    CHECK_THROWS_AS(db->create_view("orders", jato::ViewSpec { "v", {}, { "amount" } }), jato::error);
+    CHECK_THROWS_AS(db->create_view("orders", jato::ViewSpec { "v", { "nobody" }, {} }), jato::error);
+    CHECK_THROWS_AS(db->create_view("orders", jato::ViewSpec { "v", { "customer" }, { "customer", "customer" } }), jato::error);
+    CHECK_THROWS_AS(db->create_view("missing", jato::ViewSpec { "v", { "customer" }, {} }), jato::error);
+    CHECK(db->views("orders").empty());
+
+    CHECK_THROWS_AS(db->transaction([&](){
+        db->create_view("orders", jato::ViewSpec { "v", { "customer" }, {} });
+    }), jato::error);
+
+    db->create_view("orders", jato::ViewSpec { "v", { "customer" }, {} });
+    CHECK_THROWS_AS(db->rename_table("orders", "sales"), jato::error);
+
+    db->delete_table("orders");
+    CHECK(db->views("orders").empty());
+}
+
+TEST_CASE_METHOD(ViewsTestFixture, "a view waits for writes in progress to its base") {
+    auto session = jato::make_session();
+    session->create_database(testdb);
+    auto db = session->open_database(testdb);
+    auto orders = create_orders(*db);
+    add_order(*orders, 0, 1, 100);
+
+    std::future<void> created;
+    db->transaction([&](){
+        add_order(*orders, 1, 1, 200);
+        // the fill could not see this record before it commits
+        created = std::async(std::launch::async, [&](){
+            auto other_session = jato::make_session();
+            auto other = other_session->open_database(testdb);
+            other->create_view("orders", jato::ViewSpec { "orders_by_customer", { "customer" }, { "amount" } });
+        });
+        CHECK(created.wait_for(std::chrono::milliseconds(200)) == std::future_status::timeout);
+    });
+    created.get();
+
+    add_order(*orders, 2, 1, 400);
+    auto view = db->open_table("orders_by_customer");
+    CHECK(view_field(*view, 1, "count") == 3);
+    CHECK(view_field(*view, 1, "sum_amount") == 700);
+}
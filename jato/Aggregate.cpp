@@ -0,0 +1,283 @@
+#include "internal.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace jato {
+
+    using std::int64_t;
+    using std::uint64_t;
+
+    namespace {
+
+        const std::size_t min_capacity = 16;
+
+        auto is_real(field_type type) -> bool {
+            return type == double_type::type || type == datetime_type::type;
+        }
+
+        // the value of a batch cell as a 64 bit key word
+        auto cell_word(const ColumnVector& column, std::size_t row) -> uint64_t {
+            switch (column.type) {
+            case long_type::type: return static_cast<uint64_t>(static_cast<int64_t>(column.longs[row]));
+            case long_long_type::type:
+            case currency_type::type: return static_cast<uint64_t>(column.long_longs[row]);
+            default: {
+                // negative zero groups with zero
+                auto value = column.doubles[row] == 0 ? 0.0 : column.doubles[row];
+                uint64_t word;
+                std::memcpy(&word, &value, sizeof(word));
+                return word;
+            }
+            }
+        }
+
+        auto cell_integer(const ColumnVector& column, std::size_t row) -> int64_t {
+            return column.type == long_type::type ? column.longs[row] : column.long_longs[row];
+        }
+
+        auto is_null(const ColumnVector& column, std::size_t row) -> bool {
+            return (column.nulls[row / 64] >> (row % 64) & 1) != 0;
+        }
+
+        auto hash_key(const uint64_t* key, std::size_t width) -> uint64_t {
+            uint64_t hash = 0x9e3779b97f4a7c15ull;
+            for (std::size_t i = 0; i < width; ++i) {
+                hash ^= key[i] + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+                hash ^= hash >> 31;
+                hash *= 0xbf58476d1ce4e5b9ull;
+            }
+            return hash ^ (hash >> 29);
+        }
+
+        auto round_up_power_of_two(std::size_t n) -> std::size_t {
+            std::size_t capacity = min_capacity;
+            while (capacity < n) capacity *= 2;
+            return capacity;
+        }
+
+        auto make_value(field_type type, int64_t integer, double real) -> FieldValue {
+            switch (type) {
+            case long_type::type: return long_type(static_cast<std::int32_t>(integer));
+            case long_long_type::type: return long_long_type(integer);
+            case currency_type::type: return currency_type(integer);
+            case datetime_type::type: return datetime_type(real);
+            default: return double_type(real);
+            }
+        }
+
+        auto make_group_value(field_type type, uint64_t word) -> FieldValue {
+            double real;
+            std::memcpy(&real, &word, sizeof(real));
+            return make_value(type, static_cast<int64_t>(word), real);
+        }
+
+    }
+
+    auto bookmark_less(const vector<char>& a, const vector<char>& b) -> bool {
+        auto common = std::min(a.size(), b.size());
+        auto order = common == 0 ? 0 : std::memcmp(a.data(), b.data(), common);
+        return order < 0 || (order == 0 && a.size() < b.size());
+    }
+
+    aggregator::aggregator(const AggregateSpec& spec)
+        : spec(spec), width(spec.group_by.size() + 1) {
+        if (spec.group_by.size() > 63)
+            throw error("[aggregate] too many group by fields");
+
+        auto add_field = [&](const string& name) {
+            if (!name.empty() && std::find(fields.begin(), fields.end(), name) == fields.end())
+                fields.push_back(name);
+        };
+        for (auto& name : spec.group_by) add_field(name);
+        for (auto& aggregate : spec.aggregates) {
+            if (aggregate.field.empty() && aggregate.op != aggregate_op::count)
+                throw error("[aggregate] only count can omit its field");
+            add_field(aggregate.field);
+        }
+        for (auto& predicate : spec.where) add_field(predicate.field);
+
+        // keep the load factor under one half without rehashing
+        capacity = round_up_power_of_two(spec.expected_groups * 2);
+        keys.resize(capacity * width);
+        used.resize(capacity);
+        accumulators.resize(capacity * spec.aggregates.size());
+    }
+
+    auto aggregator::find_slot(const uint64_t* key) -> std::size_t {
+        if ((size + 1) * 2 > capacity) grow();
+
+        auto mask = capacity - 1;
+        for (auto slot = static_cast<std::size_t>(hash_key(key, width)) & mask;; slot = (slot + 1) & mask) {
+            auto stored = &keys[slot * width];
+            if (!used[slot]) {
+                used[slot] = 1;
+                std::copy(key, key + width, stored);
+                for (std::size_t a = 0; a < spec.aggregates.size(); ++a) {
+                    auto& acc = accumulators[slot * spec.aggregates.size() + a];
+                    acc.count = 0;
+                    acc.integer_sum = 0;
+                    acc.real_sum = 0;
+                    acc.integer_min = std::numeric_limits<int64_t>::max();
+                    acc.integer_max = std::numeric_limits<int64_t>::min();
+                    acc.real_min = std::numeric_limits<double>::infinity();
+                    acc.real_max = -std::numeric_limits<double>::infinity();
+                }
+                ++size;
+                return slot;
+            }
+            if (std::equal(key, key + width, stored)) return slot;
+        }
+    }
+
+    void aggregator::grow() {
+        auto old_keys = std::move(keys);
+        auto old_used = std::move(used);
+        auto old_accumulators = std::move(accumulators);
+        auto old_capacity = capacity;
+        auto count = spec.aggregates.size();
+
+        capacity *= 2;
+        size = 0;
+        keys.assign(capacity * width, 0);
+        used.assign(capacity, 0);
+        accumulators.resize(capacity * count);
+        for (std::size_t slot = 0; slot < old_capacity; ++slot) {
+            if (!old_used[slot]) continue;
+            auto target = find_slot(&old_keys[slot * width]);
+            std::copy(old_accumulators.begin() + slot * count, old_accumulators.begin() + (slot + 1) * count,
+                accumulators.begin() + target * count);
+        }
+    }
+
+    void aggregator::combine(accumulator& into, const accumulator& from) const {
+        into.count += from.count;
+        into.integer_sum += from.integer_sum;
+        into.real_sum += from.real_sum;
+        into.integer_min = std::min(into.integer_min, from.integer_min);
+        into.integer_max = std::max(into.integer_max, from.integer_max);
+        into.real_min = std::min(into.real_min, from.real_min);
+        into.real_max = std::max(into.real_max, from.real_max);
+    }
+
+    void aggregator::add(const RecordBatch& batch) {
+        vector<const ColumnVector*> group_columns;
+        for (auto& name : spec.group_by) group_columns.push_back(&batch.column(name));
+        vector<const ColumnVector*> value_columns;
+        for (auto& aggregate : spec.aggregates)
+            value_columns.push_back(aggregate.field.empty() ? nullptr : &batch.column(aggregate.field));
+
+        if (group_types.empty() && value_types.empty()) {
+            for (auto column : group_columns) group_types.push_back(column->type);
+            for (auto column : value_columns) value_types.push_back(column ? column->type : static_cast<field_type>(long_long_type::type));
+        }
+
+        auto selection = filter(batch, spec.where);
+        vector<uint64_t> key(width);
+        auto count = spec.aggregates.size();
+        for (std::size_t row = 0; row < batch.rows; ++row) {
+            if ((selection[row / 64] >> (row % 64) & 1) == 0) continue;
+
+            uint64_t nulls = 0;
+            for (std::size_t g = 0; g < group_columns.size(); ++g) {
+                if (is_null(*group_columns[g], row)) {
+                    nulls |= uint64_t(1) << g;
+                    key[g] = 0;
+                } else {
+                    key[g] = cell_word(*group_columns[g], row);
+                }
+            }
+            key[width - 1] = nulls;
+
+            auto slot = find_slot(key.data());
+            for (std::size_t a = 0; a < count; ++a) {
+                auto& acc = accumulators[slot * count + a];
+                auto column = value_columns[a];
+                if (!column) {
+                    ++acc.count;
+                    continue;
+                }
+                if (is_null(*column, row)) continue;
+                ++acc.count;
+                if (is_real(column->type)) {
+                    auto value = column->doubles[row];
+                    acc.real_sum += value;
+                    acc.real_min = std::min(acc.real_min, value);
+                    acc.real_max = std::max(acc.real_max, value);
+                } else {
+                    auto value = cell_integer(*column, row);
+                    acc.integer_sum += value;
+                    acc.integer_min = std::min(acc.integer_min, value);
+                    acc.integer_max = std::max(acc.integer_max, value);
+                }
+            }
+        }
+    }
+
+    void aggregator::merge(const aggregator& other) {
+        if (group_types.empty() && value_types.empty()) {
+            group_types = other.group_types;
+            value_types = other.value_types;
+        }
+        auto count = spec.aggregates.size();
+        for (std::size_t slot = 0; slot < other.capacity; ++slot) {
+            if (!other.used[slot]) continue;
+            auto target = find_slot(&other.keys[slot * width]);
+            for (std::size_t a = 0; a < count; ++a)
+                combine(accumulators[target * count + a], other.accumulators[slot * count + a]);
+        }
+    }
+
+    auto aggregator::rows() const -> vector<AggregateRow> {
+        vector<AggregateRow> result;
+        auto count = spec.aggregates.size();
+        for (std::size_t slot = 0; slot < capacity; ++slot) {
+            if (!used[slot]) continue;
+            auto key = &keys[slot * width];
+
+            AggregateRow row;
+            for (std::size_t g = 0; g < spec.group_by.size(); ++g) {
+                if (key[width - 1] >> g & 1)
+                    row.group.push_back(boost::none);
+                else
+                    row.group.push_back(make_group_value(group_types[g], key[g]));
+            }
+
+            for (std::size_t a = 0; a < count; ++a) {
+                auto& acc = accumulators[slot * count + a];
+                auto type = value_types[a];
+                auto op = spec.aggregates[a].op;
+                if (op == aggregate_op::count) {
+                    row.values.push_back(FieldValue(long_long_type(static_cast<int64_t>(acc.count))));
+                    continue;
+                }
+                if (acc.count == 0) {
+                    row.values.push_back(boost::none);
+                    continue;
+                }
+                auto real = is_real(type);
+                switch (op) {
+                case aggregate_op::sum:
+                    row.values.push_back(real ? FieldValue(double_type(acc.real_sum))
+                        : type == currency_type::type ? FieldValue(currency_type(acc.integer_sum))
+                        : FieldValue(long_long_type(acc.integer_sum)));
+                    break;
+                case aggregate_op::min:
+                    row.values.push_back(make_value(type, acc.integer_min, acc.real_min));
+                    break;
+                case aggregate_op::max:
+                    row.values.push_back(make_value(type, acc.integer_max, acc.real_max));
+                    break;
+                default:
+                    row.values.push_back(FieldValue(double_type(
+                        (real ? acc.real_sum : static_cast<double>(acc.integer_sum)) / acc.count)));
+                    break;
+                }
+            }
+            result.push_back(row);
+        }
+        return result;
+    }
+
+}
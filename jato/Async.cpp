@@ -0,0 +1,194 @@
+#include "internal.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace jato {
+
+    using std::make_unique;
+    using std::move;
+
+    namespace {
+
+        struct job {
+            function< void(interface::Database& database) > work;
+            function< void(std::exception_ptr error) > done;
+        };
+
+        // hands scan batches to the executor one at a time
+        struct batch_channel {
+            std::mutex lock;
+            std::condition_variable idle;
+            bool busy = false;
+            bool stopped = false;
+            std::exception_ptr error;
+
+            // waits until the last batch handed out has been consumed
+            void wait() {
+                std::unique_lock<std::mutex> guard(lock);
+                idle.wait(guard, [&](){ return !busy; });
+            }
+
+            void consumed(bool more, std::exception_ptr failure) {
+                std::lock_guard<std::mutex> guard(lock);
+                busy = false;
+                if (!more) stopped = true;
+                if (failure) error = failure;
+                idle.notify_one();
+            }
+        };
+
+    }
+
+    class async_database_impl : public interface::AsyncDatabase {
+    public: // interface
+        void post(function< void(interface::Database& database) > work,
+            function< void(std::exception_ptr error) > done) final override {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                jobs.push_back(job { move(work), move(done) });
+            }
+            ready.notify_one();
+        }
+
+        void scan(const string& tablename, const vector<string>& fieldnames, std::size_t batch_size,
+            function< auto(const RecordBatch& batch) -> bool > action,
+            function< void(std::exception_ptr error) > done) final override {
+            post([=](interface::Database& database) {
+                auto table = database.open_table(tablename);
+                auto channel = std::make_shared<batch_channel>();
+                table->scan(fieldnames, batch_size, [&](const RecordBatch& batch) {
+                    channel->wait();
+                    if (channel->stopped || channel->error) return false;
+                    channel->busy = true;
+                    auto copy = std::make_shared<RecordBatch>(batch);
+                    deliver([channel, copy, action](){
+                        try {
+                            channel->consumed(action(*copy), nullptr);
+                        } catch (...) {
+                            channel->consumed(false, std::current_exception());
+                        }
+                    });
+                    return true;
+                });
+                channel->wait();
+                if (channel->error) std::rethrow_exception(channel->error);
+            }, done);
+        }
+
+        auto pending() const -> std::size_t final override {
+            std::lock_guard<std::mutex> guard(lock);
+            return jobs.size() + active;
+        }
+
+    public:
+        async_database_impl(function< auto() -> database_ptr > open, const AsyncOptions& options)
+            : options(options) {
+            if (options.workers == 0)
+                throw error("[async] the pool needs at least one worker");
+
+            // each worker opens its database on its own thread
+            vector<std::exception_ptr> errors(options.workers);
+            std::size_t starting = options.workers;
+            std::condition_variable started;
+            for (std::size_t k = 0; k < options.workers; ++k) {
+                workers.push_back(std::thread([&, k, open](){
+                    database_ptr database;
+                    try {
+                        database = open();
+                    } catch (...) {
+                        errors[k] = std::current_exception();
+                    }
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        --starting;
+                        started.notify_all();
+                    }
+                    if (database) run(*database);
+                }));
+            }
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                started.wait(guard, [&](){ return starting == 0; });
+            }
+            for (auto& error : errors) {
+                if (error) {
+                    shutdown();
+                    std::rethrow_exception(error);
+                }
+            }
+        }
+
+        async_database_impl(const async_database_impl&) = delete;
+        auto operator=(const async_database_impl&) -> async_database_impl& = delete;
+
+        // queued work is finished before the workers exit
+        ~async_database_impl() {
+            shutdown();
+        }
+
+    private:
+        void run(interface::Database& database) {
+            for (;;) {
+                job next;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    ready.wait(guard, [&](){ return stopping || !jobs.empty(); });
+                    if (jobs.empty()) return;
+                    next = move(jobs.front());
+                    jobs.pop_front();
+                    ++active;
+                }
+
+                std::exception_ptr failure;
+                try {
+                    next.work(database);
+                } catch (...) {
+                    failure = std::current_exception();
+                }
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    --active;
+                }
+                if (next.done) {
+                    auto done = move(next.done);
+                    deliver([done, failure](){ done(failure); });
+                }
+            }
+        }
+
+        void deliver(function< void() > completion) {
+            if (options.executor)
+                options.executor(move(completion));
+            else
+                completion();
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (auto& worker : workers) {
+                if (worker.joinable()) worker.join();
+            }
+        }
+
+        AsyncOptions options;
+        mutable std::mutex lock;
+        std::condition_variable ready;
+        std::deque<job> jobs;
+        std::size_t active = 0;
+        bool stopping = false;
+        vector<std::thread> workers;
+    };
+
+    auto make_async_database(function< auto() -> database_ptr > open, const AsyncOptions& options) -> async_database_ptr {
+        return make_unique<async_database_impl>(open, options);
+    }
+
+}
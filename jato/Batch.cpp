@@ -0,0 +1,344 @@
+#include "jato.h"
+
+#include <bitset>
+#include <limits>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define JATO_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define JATO_TARGET_SSE42
+#define JATO_TARGET_AVX2
+#else
+#define JATO_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define JATO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace jato {
+
+    using std::uint64_t;
+
+    namespace {
+
+        enum class simd_level { scalar, sse42, avx2 };
+
+        auto detect_simd() -> simd_level {
+#if defined(JATO_X86) && defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            auto max_leaf = info[0];
+            __cpuid(info, 1);
+            bool sse42 = (info[2] & (1 << 20)) != 0;
+            bool os_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0
+                && (_xgetbv(0) & 6) == 6;
+            bool avx2 = false;
+            if (max_leaf >= 7 && os_avx) {
+                __cpuidex(info, 7, 0);
+                avx2 = (info[1] & (1 << 5)) != 0;
+            }
+            return avx2 ? simd_level::avx2 : sse42 ? simd_level::sse42 : simd_level::scalar;
+#elif defined(JATO_X86)
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? simd_level::avx2
+                : __builtin_cpu_supports("sse4.2") ? simd_level::sse42 : simd_level::scalar;
+#else
+            return simd_level::scalar;
+#endif
+        }
+
+        const simd_level simd = detect_simd();
+
+        //
+        // scalar kernels, also used for the rows after the last full word
+        //
+        template <typename T>
+        auto matches(T value, compare_op op, T operand) -> bool {
+            switch (op) {
+            case compare_op::less: return value < operand;
+            case compare_op::less_equal: return value <= operand;
+            case compare_op::equal: return value == operand;
+            case compare_op::not_equal: return value != operand;
+            case compare_op::greater_equal: return value >= operand;
+            case compare_op::greater: return value > operand;
+            }
+            return false;
+        }
+
+        template <typename T>
+        void compare_scalar(const T* values, std::size_t begin, std::size_t rows,
+            compare_op op, T operand, uint64_t* selection) {
+            for (auto row = begin; row < rows; ++row) {
+                if (!matches(values[row], op, operand))
+                    selection[row / 64] &= ~(uint64_t(1) << (row % 64));
+            }
+        }
+
+#if defined(JATO_X86)
+        // Integer compares only come in "greater than" and "equal" flavours,
+        // so the other operators are built by swapping operands or inverting.
+        struct integer_compare {
+            bool swap;      // compare operand > value instead of value > operand
+            bool equal;     // use the equality compare
+            bool invert;    // negate the result
+        };
+
+        auto integer_compare_for(compare_op op) -> integer_compare {
+            switch (op) {
+            case compare_op::less: return integer_compare { true, false, false };
+            case compare_op::less_equal: return integer_compare { false, false, true };
+            case compare_op::equal: return integer_compare { false, true, false };
+            case compare_op::not_equal: return integer_compare { false, true, true };
+            case compare_op::greater_equal: return integer_compare { true, false, true };
+            default: return integer_compare { false, false, false };
+            }
+        }
+
+        JATO_TARGET_AVX2
+        void compare_avx2(const std::int32_t* values, std::size_t rows,
+            compare_op op, std::int32_t operand, uint64_t* selection) {
+            auto how = integer_compare_for(op);
+            auto x = _mm256_set1_epi32(operand);
+            auto words = rows / 64;
+            for (std::size_t w = 0; w < words; ++w) {
+                uint64_t mask = 0;
+                for (int i = 0; i < 8; ++i) {
+                    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + w * 64 + i * 8));
+                    auto r = how.equal ? _mm256_cmpeq_epi32(v, x)
+                        : how.swap ? _mm256_cmpgt_epi32(x, v) : _mm256_cmpgt_epi32(v, x);
+                    mask |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(r))) << (i * 8);
+                }
+                selection[w] &= how.invert ? ~mask : mask;
+            }
+            compare_scalar(values, words * 64, rows, op, operand, selection);
+        }
+
+        JATO_TARGET_AVX2
+        void compare_avx2(const std::int64_t* values, std::size_t rows,
+            compare_op op, std::int64_t operand, uint64_t* selection) {
+            auto how = integer_compare_for(op);
+            auto x = _mm256_set1_epi64x(operand);
+            auto words = rows / 64;
+            for (std::size_t w = 0; w < words; ++w) {
+                uint64_t mask = 0;
+                for (int i = 0; i < 16; ++i) {
+                    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + w * 64 + i * 4));
+                    auto r = how.equal ? _mm256_cmpeq_epi64(v, x)
+                        : how.swap ? _mm256_cmpgt_epi64(x, v) : _mm256_cmpgt_epi64(v, x);
+                    mask |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(r))) << (i * 4);
+                }
+                selection[w] &= how.invert ? ~mask : mask;
+            }
+            compare_scalar(values, words * 64, rows, op, operand, selection);
+        }
+
+        JATO_TARGET_AVX2
+        auto compare4_avx2(__m256d v, __m256d x, compare_op op) -> int {
+            switch (op) {
+            case compare_op::less: return _mm256_movemask_pd(_mm256_cmp_pd(v, x, _CMP_LT_OQ));
+            case compare_op::less_equal: return _mm256_movemask_pd(_mm256_cmp_pd(v, x, _CMP_LE_OQ));
+            case compare_op::equal: return _mm256_movemask_pd(_mm256_cmp_pd(v, x, _CMP_EQ_OQ));
+            case compare_op::not_equal: return _mm256_movemask_pd(_mm256_cmp_pd(v, x, _CMP_NEQ_UQ));
+            case compare_op::greater_equal: return _mm256_movemask_pd(_mm256_cmp_pd(v, x, _CMP_GE_OQ));
+            default: return _mm256_movemask_pd(_mm256_cmp_pd(v, x, _CMP_GT_OQ));
+            }
+        }
+
+        JATO_TARGET_AVX2
+        void compare_avx2(const double* values, std::size_t rows,
+            compare_op op, double operand, uint64_t* selection) {
+            auto x = _mm256_set1_pd(operand);
+            auto words = rows / 64;
+            for (std::size_t w = 0; w < words; ++w) {
+                uint64_t mask = 0;
+                for (int i = 0; i < 16; ++i) {
+                    auto v = _mm256_loadu_pd(values + w * 64 + i * 4);
+                    mask |= uint64_t(compare4_avx2(v, x, op)) << (i * 4);
+                }
+                selection[w] &= mask;
+            }
+            compare_scalar(values, words * 64, rows, op, operand, selection);
+        }
+
+        JATO_TARGET_SSE42
+        void compare_sse42(const std::int32_t* values, std::size_t rows,
+            compare_op op, std::int32_t operand, uint64_t* selection) {
+            auto how = integer_compare_for(op);
+            auto x = _mm_set1_epi32(operand);
+            auto words = rows / 64;
+            for (std::size_t w = 0; w < words; ++w) {
+                uint64_t mask = 0;
+                for (int i = 0; i < 16; ++i) {
+                    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + w * 64 + i * 4));
+                    auto r = how.equal ? _mm_cmpeq_epi32(v, x)
+                        : how.swap ? _mm_cmpgt_epi32(x, v) : _mm_cmpgt_epi32(v, x);
+                    mask |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(r))) << (i * 4);
+                }
+                selection[w] &= how.invert ? ~mask : mask;
+            }
+            compare_scalar(values, words * 64, rows, op, operand, selection);
+        }
+
+        JATO_TARGET_SSE42
+        void compare_sse42(const std::int64_t* values, std::size_t rows,
+            compare_op op, std::int64_t operand, uint64_t* selection) {
+            auto how = integer_compare_for(op);
+            auto x = _mm_set1_epi64x(operand);
+            auto words = rows / 64;
+            for (std::size_t w = 0; w < words; ++w) {
+                uint64_t mask = 0;
+                for (int i = 0; i < 32; ++i) {
+                    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + w * 64 + i * 2));
+                    auto r = how.equal ? _mm_cmpeq_epi64(v, x)
+                        : how.swap ? _mm_cmpgt_epi64(x, v) : _mm_cmpgt_epi64(v, x);
+                    mask |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(r))) << (i * 2);
+                }
+                selection[w] &= how.invert ? ~mask : mask;
+            }
+            compare_scalar(values, words * 64, rows, op, operand, selection);
+        }
+
+        JATO_TARGET_SSE42
+        auto compare2_sse42(__m128d v, __m128d x, compare_op op) -> int {
+            switch (op) {
+            case compare_op::less: return _mm_movemask_pd(_mm_cmplt_pd(v, x));
+            case compare_op::less_equal: return _mm_movemask_pd(_mm_cmple_pd(v, x));
+            case compare_op::equal: return _mm_movemask_pd(_mm_cmpeq_pd(v, x));
+            case compare_op::not_equal: return _mm_movemask_pd(_mm_cmpneq_pd(v, x));
+            case compare_op::greater_equal: return _mm_movemask_pd(_mm_cmpge_pd(v, x));
+            default: return _mm_movemask_pd(_mm_cmpgt_pd(v, x));
+            }
+        }
+
+        JATO_TARGET_SSE42
+        void compare_sse42(const double* values, std::size_t rows,
+            compare_op op, double operand, uint64_t* selection) {
+            auto x = _mm_set1_pd(operand);
+            auto words = rows / 64;
+            for (std::size_t w = 0; w < words; ++w) {
+                uint64_t mask = 0;
+                for (int i = 0; i < 32; ++i) {
+                    auto v = _mm_loadu_pd(values + w * 64 + i * 2);
+                    mask |= uint64_t(compare2_sse42(v, x, op)) << (i * 2);
+                }
+                selection[w] &= mask;
+            }
+            compare_scalar(values, words * 64, rows, op, operand, selection);
+        }
+#endif
+
+        template <typename T>
+        void compare(const vector<T>& values, std::size_t rows, compare_op op, T operand, Selection& selection) {
+            if (values.size() < rows)
+                throw error("[filter] column is shorter than the batch");
+#if defined(JATO_X86)
+            switch (simd) {
+            case simd_level::avx2: return compare_avx2(values.data(), rows, op, operand, selection.data());
+            case simd_level::sse42: return compare_sse42(values.data(), rows, op, operand, selection.data());
+            default: break;
+            }
+#endif
+            compare_scalar(values.data(), 0, rows, op, operand, selection.data());
+        }
+
+        struct numeric_operand {
+            bool integral;
+            std::int64_t integer;
+            double real;
+        };
+
+        struct operand_of : boost::static_visitor<numeric_operand> {
+            template <typename T>
+            auto operator()(const T&) const -> numeric_operand {
+                throw error("[filter] predicate value is not numeric");
+            }
+
+            auto operator()(const bit_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const ubyte_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const short_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const ushort_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const long_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const long_long_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const currency_type& field) const -> numeric_operand { return integer(field.value); }
+            auto operator()(const float_type& field) const -> numeric_operand { return real(field.value); }
+            auto operator()(const double_type& field) const -> numeric_operand { return real(field.value); }
+            auto operator()(const datetime_type& field) const -> numeric_operand { return real(field.value); }
+
+            auto operator()(const ulong_long_type& field) const -> numeric_operand {
+                if (field.value > static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()))
+                    throw error("[filter] predicate value is out of range");
+                return integer(static_cast<std::int64_t>(field.value));
+            }
+
+            static auto integer(std::int64_t value) -> numeric_operand {
+                return numeric_operand { true, value, static_cast<double>(value) };
+            }
+
+            static auto real(double value) -> numeric_operand {
+                return numeric_operand { false, 0, value };
+            }
+        };
+
+        auto integral_operand(const Predicate& predicate) -> std::int64_t {
+            auto operand = boost::apply_visitor(operand_of(), predicate.value);
+            if (!operand.integral)
+                throw error("[filter] integer field compared with a floating point value: " + predicate.field);
+            return operand.integer;
+        }
+
+        void apply(const RecordBatch& batch, const Predicate& predicate, Selection& selection) {
+            auto& column = batch.column(predicate.field);
+            for (std::size_t w = 0; w < column.nulls.size() && w < selection.size(); ++w)
+                selection[w] &= ~column.nulls[w];
+
+            switch (column.type) {
+            case long_type::type: {
+                auto operand = integral_operand(predicate);
+                if (operand < std::numeric_limits<std::int32_t>::min() || operand > std::numeric_limits<std::int32_t>::max())
+                    throw error("[filter] predicate value is out of range: " + predicate.field);
+                compare(column.longs, batch.rows, predicate.op, static_cast<std::int32_t>(operand), selection);
+                break;
+            }
+            case long_long_type::type:
+            case currency_type::type:
+                compare(column.long_longs, batch.rows, predicate.op, integral_operand(predicate), selection);
+                break;
+            case double_type::type:
+            case datetime_type::type:
+                compare(column.doubles, batch.rows, predicate.op,
+                    boost::apply_visitor(operand_of(), predicate.value).real, selection);
+                break;
+            default:
+                throw error("[filter] unsupported field type: " + predicate.field);
+            }
+        }
+
+    }
+
+    auto RecordBatch::column(const string& name) const -> const ColumnVector& {
+        for (auto& column : columns) {
+            if (column.name == name) return column;
+        }
+        throw error("[RecordBatch] no such field: " + name);
+    }
+
+    auto filter(const RecordBatch& batch, const vector<Predicate>& predicates) -> Selection {
+        Selection selection((batch.rows + 63) / 64, ~uint64_t(0));
+        if (batch.rows % 64 != 0)
+            selection.back() = (uint64_t(1) << (batch.rows % 64)) - 1;
+        for (auto& predicate : predicates) apply(batch, predicate, selection);
+        return selection;
+    }
+
+    auto count_selected(const Selection& selection) -> std::size_t {
+        std::size_t count = 0;
+        for (auto word : selection) count += std::bitset<64>(word).count();
+        return count;
+    }
+
+    auto is_selected(const Selection& selection, std::size_t row) -> bool {
+        return row / 64 < selection.size() && (selection[row / 64] >> (row % 64) & 1) != 0;
+    }
+
+}
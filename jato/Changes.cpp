@@ -0,0 +1,463 @@
+#include "internal.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace jato {
+
+    using std::make_shared;
+    using std::make_unique;
+    using std::move;
+
+    namespace {
+
+        std::mutex hubs_lock;
+        std::map<string, std::shared_ptr<change_hub>> hubs;
+
+        //
+        // Spooled events are frames of a 32 bit length and a body, so a
+        // reader can tell an event that is still being written.
+        //
+        template <typename T>
+        void put(string& out, T value) {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void put_text(string& out, const string& text) {
+            put(out, static_cast<std::uint32_t>(text.size()));
+            out += text;
+        }
+
+        void put_record(string& out, const interface::Record* record) {
+            put(out, static_cast<std::uint8_t>(record ? 1 : 0));
+            if (!record) return;
+            string fields;
+            std::uint32_t count = 0;
+            record->foreach_field([&](const string& fieldname, const FieldValue& field){
+                auto bytes = field_bytes(field);
+                put_text(fields, fieldname);
+                put(fields, static_cast<std::uint32_t>(field_type_of(field)));
+                put(fields, static_cast<std::uint32_t>(bytes.size));
+                fields.append(static_cast<const char*>(bytes.data), bytes.size);
+                ++count;
+            });
+            put(out, count);
+            out += fields;
+        }
+
+        auto encode_event(const ChangeEvent& event) -> string {
+            string body;
+            put(body, event.sequence);
+            put(body, static_cast<std::uint8_t>(event.kind));
+            put_text(body, event.table);
+            put_record(body, event.before.get());
+            put_record(body, event.after.get());
+            string frame;
+            put(frame, static_cast<std::uint32_t>(body.size()));
+            return frame + body;
+        }
+
+        class body_reader {
+        public:
+            explicit body_reader(const string& body) : at(body.data()), end(body.data() + body.size()) {}
+
+            template <typename T>
+            auto get() -> T {
+                T value;
+                std::memcpy(&value, take(sizeof(value)), sizeof(value));
+                return value;
+            }
+
+            auto get_text() -> string {
+                auto size = get<std::uint32_t>();
+                return string(take(size), size);
+            }
+
+            auto get_record() -> std::shared_ptr<const interface::Record> {
+                if (get<std::uint8_t>() == 0) return nullptr;
+                auto record = make_record();
+                for (auto count = get<std::uint32_t>(); count > 0; --count) {
+                    auto fieldname = get_text();
+                    auto type = static_cast<field_type>(get<std::uint32_t>());
+                    auto size = get<std::uint32_t>();
+                    record->set_field(fieldname, make_field(type, take(size), size));
+                }
+                return std::shared_ptr<const interface::Record>(move(record));
+            }
+
+        private:
+            auto take(std::size_t size) -> const char* {
+                if (static_cast<std::size_t>(end - at) < size)
+                    throw error("[change spool] event is corrupt");
+                auto data = at;
+                at += size;
+                return data;
+            }
+
+            const char* at;
+            const char* end;
+        };
+
+        auto decode_event(const string& body) -> ChangeEvent {
+            body_reader reader(body);
+            ChangeEvent event;
+            event.sequence = reader.get<std::uint64_t>();
+            event.kind = static_cast<change_kind>(reader.get<std::uint8_t>());
+            event.table = reader.get_text();
+            event.before = reader.get_record();
+            event.after = reader.get_record();
+            return event;
+        }
+
+        // reads the body of the frame at offset; false if it is not all there
+        auto read_frame(std::ifstream& in, std::uint64_t offset, string& body) -> bool {
+            in.clear();
+            in.seekg(static_cast<std::streamoff>(offset));
+            std::uint32_t size = 0;
+            if (!in.read(reinterpret_cast<char*>(&size), sizeof(size))) return false;
+            body.resize(size);
+            return size == 0 || static_cast<bool>(in.read(&body[0], size));
+        }
+
+        auto frame_size(const string& body) -> std::uint64_t {
+            return sizeof(std::uint32_t) + body.size();
+        }
+
+        // Returns the length of the whole events at the start of a spool,
+        // cutting off any that a crash left half written, and leaves the
+        // last event's sequence number in last_sequence.
+        auto trim_spool(const sys::path& path, std::uint64_t& last_sequence) -> std::uint64_t {
+            if (!sys::exists(path)) return 0;
+            std::uint64_t whole = 0;
+            {
+                std::ifstream in(path.string(), std::ios::binary);
+                string body;
+                while (read_frame(in, whole, body)) {
+                    last_sequence = body_reader(body).get<std::uint64_t>();
+                    whole += frame_size(body);
+                }
+            }
+            if (whole == sys::file_size(path)) return whole;
+
+            auto trimmed = sys::path(path.string() + ".tmp");
+            {
+                std::ifstream in(path.string(), std::ios::binary);
+                std::ofstream out(trimmed.string(), std::ios::binary | std::ios::trunc);
+                vector<char> buffer(64 * 1024);
+                for (auto left = whole; left > 0;) {
+                    auto chunk = static_cast<std::size_t>(std::min<std::uint64_t>(left, buffer.size()));
+                    in.read(buffer.data(), chunk);
+                    out.write(buffer.data(), chunk);
+                    left -= chunk;
+                }
+                if (!in || !out) throw error("[subscribe_changes] cannot trim spool " + path.string());
+            }
+            sys::remove(path);
+            sys::rename(trimmed, path);
+            return whole;
+        }
+
+    }
+
+    // An append-only file whose writes can be forced to disk. Writes are
+    // not buffered, so a reader sees each one as soon as it returns.
+    class spool_file {
+    public:
+#ifdef _WIN32
+        spool_file() : handle(INVALID_HANDLE_VALUE) {}
+#else
+        spool_file() : fd(-1) {}
+#endif
+
+        spool_file(const spool_file&) = delete;
+        auto operator=(const spool_file&) -> spool_file& = delete;
+
+        ~spool_file() {
+            close();
+        }
+
+#ifdef _WIN32
+        auto open(const sys::path& path) -> bool {
+            handle = CreateFileA(path.string().c_str(), FILE_APPEND_DATA,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            return is_open();
+        }
+
+        auto is_open() const -> bool { return handle != INVALID_HANDLE_VALUE; }
+
+        auto write(const string& data) -> bool {
+            DWORD written = 0;
+            return WriteFile(handle, data.data(), static_cast<DWORD>(data.size()), &written, nullptr)
+                && written == data.size();
+        }
+
+        auto sync() -> bool {
+            return FlushFileBuffers(handle) != 0;
+        }
+
+        void close() {
+            if (!is_open()) return;
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+        }
+
+    private:
+        HANDLE handle;
+#else
+        auto open(const sys::path& path) -> bool {
+            fd = ::open(path.string().c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+            return is_open();
+        }
+
+        auto is_open() const -> bool { return fd != -1; }
+
+        auto write(const string& data) -> bool {
+            for (std::size_t done = 0; done < data.size();) {
+                auto written = ::write(fd, data.data() + done, data.size() - done);
+                if (written <= 0) return false;
+                done += static_cast<std::size_t>(written);
+            }
+            return true;
+        }
+
+        auto sync() -> bool {
+            return ::fsync(fd) == 0;
+        }
+
+        void close() {
+            if (!is_open()) return;
+            ::close(fd);
+            fd = -1;
+        }
+
+    private:
+        int fd;
+#endif
+    };
+
+    // A single producer, single consumer ring: the hub's delivery lock
+    // makes the deliverers take turns, and only one thread polls a feed.
+    struct change_subscription {
+        explicit change_subscription(std::size_t slots)
+            : ring(slots), head(0), tail(0), spilling(false), spill_offset(0), dropped(0),
+            first_sequence(0), spool_size(0) {}
+
+        vector<ChangeEvent> ring;           // a power of two slots
+        std::atomic<std::uint64_t> head;    // advanced by the deliverer
+        std::atomic<std::uint64_t> tail;    // advanced by the poller
+        std::atomic<bool> spilling;         // new events wait in the spool only
+        std::uint64_t spill_offset;         // the first spilled event, set before spilling
+        std::atomic<std::uint64_t> dropped;
+        std::uint64_t first_sequence;       // events before it were committed before the feed subscribed
+        sys::path spool_path;
+        spool_file spool;                   // open if there is a spool
+        std::uint64_t spool_size;           // whole events written, under the delivery lock
+    };
+
+    namespace {
+
+        // writes the events to the feed's spool, if it has one, and puts
+        // them in its ring or leaves them to be read back from the spool
+        void deliver_to(change_subscription& feed, const std::deque<ChangeEvent>& events) {
+            auto written = false;
+            for (auto& event : events) {
+                if (event.sequence < feed.first_sequence) continue;
+                try {
+                    auto offset = feed.spool_size;
+                    if (feed.spool.is_open()) {
+                        auto frame = encode_event(event);
+                        if (feed.spool.write(frame)) {
+                            feed.spool_size += frame.size();
+                            written = true;
+                        } else {
+                            // what follows a failed write cannot be read back
+                            feed.spool.close();
+                        }
+                    }
+                    auto head = feed.head.load(std::memory_order_relaxed);
+                    auto room = head - feed.tail.load(std::memory_order_acquire) < feed.ring.size();
+                    if (!feed.spilling && room) {
+                        feed.ring[head & (feed.ring.size() - 1)] = event;
+                        feed.head.store(head + 1, std::memory_order_release);
+                    } else if (feed.spool.is_open()) {
+                        if (!feed.spilling) {
+                            feed.spill_offset = offset;
+                            feed.spilling.store(true, std::memory_order_release);
+                        }
+                    } else {
+                        ++feed.dropped;
+                    }
+                } catch (...) {
+                    ++feed.dropped;
+                }
+            }
+            // once per batch rather than per event
+            if (written && !feed.spool.sync()) feed.spool.close();
+        }
+
+    }
+
+    change_hub::change_hub() : gate(make_shared<std::mutex>()), next_sequence(1), subscriber_count(0) {}
+
+    void change_hub::publish(ChangeEvent event) {
+        std::lock_guard<std::mutex> guard(lock);
+        event.sequence = next_sequence++;
+        try {
+            outbox.push_back(move(event));
+        } catch (...) {
+            for (auto& feed : feeds) ++feed->dropped;
+        }
+    }
+
+    void change_hub::deliver() {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> delivering(delivery, std::try_to_lock);
+                if (!delivering.owns_lock()) return;
+                std::deque<ChangeEvent> events;
+                vector<std::shared_ptr<change_subscription>> targets;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    events.swap(outbox);
+                    try {
+                        targets = feeds;
+                    } catch (...) {
+                        for (auto& feed : feeds) feed->dropped += events.size();
+                        continue;
+                    }
+                }
+                for (auto& feed : targets) deliver_to(*feed, events);
+            }
+            // events queued while delivery was busy were left to this thread
+            std::lock_guard<std::mutex> guard(lock);
+            if (outbox.empty()) return;
+        }
+    }
+
+    void change_hub::add(std::shared_ptr<change_subscription> feed, std::uint64_t spooled_sequence) {
+        std::lock_guard<std::mutex> guard(lock);
+        next_sequence = std::max(next_sequence, spooled_sequence + 1);
+        feed->first_sequence = next_sequence;
+        feeds.push_back(feed);
+        ++subscriber_count;
+    }
+
+    void change_hub::remove(const change_subscription* feed) {
+        // once this returns, nothing writes to the feed's spool
+        std::lock_guard<std::mutex> delivering(delivery);
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = std::find_if(feeds.begin(), feeds.end(),
+            [&](const std::shared_ptr<change_subscription>& f) { return f.get() == feed; });
+        if (it == feeds.end()) return;
+        feeds.erase(it);
+        --subscriber_count;
+    }
+
+    auto change_hub::end_spill(change_subscription& feed, std::uint64_t read_offset) -> bool {
+        std::lock_guard<std::mutex> delivering(delivery);
+        if (feed.spool_size != read_offset) return false;
+        feed.spilling = false;
+        return true;
+    }
+
+    class change_feed_impl : public interface::ChangeFeed {
+    public:
+        change_feed_impl(std::shared_ptr<change_hub> hub, std::shared_ptr<change_subscription> feed)
+            : hub(hub), feed(feed), reading_spool(false), read_offset(0) {}
+
+        change_feed_impl(const change_feed_impl&) = delete;
+        auto operator=(const change_feed_impl&) -> change_feed_impl& = delete;
+
+        ~change_feed_impl() {
+            hub->remove(feed.get());
+        }
+
+    public: // interface
+        auto poll(function< auto(const ChangeEvent& event) -> bool > action) -> std::size_t final override {
+            std::size_t seen = 0;
+            auto mask = feed->ring.size() - 1;
+            auto tail = feed->tail.load(std::memory_order_relaxed);
+            for (;;) {
+                for (auto head = feed->head.load(std::memory_order_acquire); tail != head; ) {
+                    auto event = move(feed->ring[tail & mask]);
+                    feed->ring[tail & mask] = ChangeEvent();
+                    feed->tail.store(++tail, std::memory_order_release);
+                    ++seen;
+                    if (!action(event)) return seen;
+                }
+                if (!feed->spilling.load(std::memory_order_acquire)) return seen;
+                // events put in the ring before the spill began come first
+                if (feed->head.load(std::memory_order_acquire) != tail) continue;
+
+                if (!reading_spool) {
+                    spool.open(feed->spool_path.string(), std::ios::binary);
+                    if (!spool) throw error("[change feed] cannot read spool " + feed->spool_path.string());
+                    read_offset = feed->spill_offset;
+                    reading_spool = true;
+                }
+                string body;
+                while (read_frame(spool, read_offset, body)) {
+                    read_offset += frame_size(body);
+                    ++seen;
+                    if (!action(decode_event(body))) return seen;
+                }
+                if (hub->end_spill(*feed, read_offset)) {
+                    spool.close();
+                    reading_spool = false;
+                }
+            }
+        }
+
+        auto dropped() const -> std::uint64_t final override {
+            return feed->dropped;
+        }
+
+    private:
+        std::shared_ptr<change_hub> hub;
+        std::shared_ptr<change_subscription> feed;
+        bool reading_spool;
+        std::ifstream spool;
+        std::uint64_t read_offset;      // the next spilled event
+    };
+
+    auto shared_change_hub(const string& dbname) -> std::shared_ptr<change_hub> {
+        std::lock_guard<std::mutex> guard(hubs_lock);
+        auto& hub = hubs[dbname];
+        if (!hub) hub = make_shared<change_hub>();
+        return hub;
+    }
+
+    auto subscribe_changes(std::shared_ptr<change_hub> hub, const ChangeFeedOptions& options) -> change_feed_ptr {
+        std::size_t slots = 1;
+        while (slots < options.capacity) slots *= 2;
+        auto feed = make_shared<change_subscription>(slots);
+        std::uint64_t last_sequence = 0;
+        if (!options.spool_path.empty()) {
+            feed->spool_path = options.spool_path;
+            feed->spool_size = trim_spool(options.spool_path, last_sequence);
+            if (!feed->spool.open(options.spool_path))
+                throw error("[subscribe_changes] cannot open spool " + options.spool_path.string());
+        }
+        hub->add(feed, last_sequence);
+        return make_unique<change_feed_impl>(hub, feed);
+    }
+
+    void replay_changes(const sys::path& spool_path, std::uint64_t after_sequence,
+        function< auto(const ChangeEvent& event) -> bool > action) {
+        std::ifstream in(spool_path.string(), std::ios::binary);
+        if (!in) throw error("[replay_changes] cannot open spool " + spool_path.string());
+        string body;
+        for (std::uint64_t offset = 0; read_frame(in, offset, body); offset += frame_size(body)) {
+            auto event = decode_event(body);
+            if (event.sequence > after_sequence && !action(event)) return;
+        }
+    }
+
+}
@@ -1,13 +1,20 @@
-#include "jato.h"
-#include "jet.h"
+#include "internal.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <random>
 #include <sstream>
+#include <thread>
 #include <utility>
 
 namespace jato {
 
     using std::function;
+    using std::map;
     using std::move;
     using std::make_shared;
     using std::make_unique;
@@ -15,52 +22,296 @@ namespace jato {
 
     namespace sys = std::tr2::sys;
 
+    auto map_exception(jet::error& ex) -> jato::error {
+        std::stringstream ss;
+        ss << "Jet Error [" << ex.origin()
+            << "] code=" << ex.code() << " (" << jet::jet_error(ex.code()) << ")";
+        return jato::error(ss.str());
+    }
+
     namespace {
 
-        auto map_exception(jet::error& ex) -> jato::error {
-            std::stringstream ss;
-            ss << "Jet Error [" << ex.origin()
-                << "] code=" << ex.code() << " (" << jet::jet_error(ex.code()) << ")";
-            return jato::error(ss.str());
+        const string default_instance_name = "jato";
+
+        // temporary tables a bulk load may have open at once
+        const unsigned long bulk_temporary_tables = 16;
+
+        struct instance_entry {
+            std::weak_ptr<jet::instance> instance;
+            unsigned long cache_size_max;
+        };
+
+        std::mutex instances_lock;
+        map<string, instance_entry> instances;
+        bool multi_instance_enabled = false;
+        std::atomic<unsigned long> bulk_instances(0);
+
+        std::mutex conflicts_lock;
+        map<std::pair<string, string>, ConflictStats> conflicts;
+
+        auto conflict_entry(const string& dbname, const string& tablename) -> ConflictStats& {
+            auto& stats = conflicts[std::make_pair(dbname, tablename)];
+            stats.table = tablename;
+            return stats;
         }
 
-        template <typename T>
-        auto jet_function(function< auto() -> T > fn) -> T {
-            try {
-                return fn();
-            } catch (jet::error& ex) {
-                throw map_exception(ex);
+        // full jitter: a uniform delay up to the capped exponential backoff
+        auto backoff_delay(const RetryPolicy& policy, unsigned attempt, std::minstd_rand& random) -> std::chrono::milliseconds {
+            unsigned long limit = policy.initial_backoff_ms;
+            for (unsigned i = 1; i < attempt && limit < policy.max_backoff_ms; ++i) limit *= 2;
+            if (limit > policy.max_backoff_ms) limit = policy.max_backoff_ms;
+            std::uniform_int_distribution<unsigned long> delay(0, limit);
+            return std::chrono::milliseconds(delay(random));
+        }
+
+        auto directory_parameter(unsigned long id, const sys::path& path) -> jet::system_parameter {
+            // ESENT requires directory paths to end with a separator
+            auto text = path.string();
+            if (text.back() != '\\' && text.back() != '/') text += '\\';
+            return jet::system_parameter { id, 0, text };
+        }
+
+        auto instance_parameters(const InstanceOptions& options) -> vector<jet::system_parameter> {
+            vector<jet::system_parameter> parameters;
+            parameters.push_back(jet::system_parameter { JET_paramCreatePathIfNotExist, 1, string() });
+            if (!options.system_path.empty())
+                parameters.push_back(directory_parameter(JET_paramSystemPath, options.system_path));
+            if (!options.log_path.empty())
+                parameters.push_back(directory_parameter(JET_paramLogFilePath, options.log_path));
+            if (!options.temp_path.empty())
+                parameters.push_back(directory_parameter(JET_paramTempPath, options.temp_path));
+            return parameters;
+        }
+
+        // The database cache is shared by every instance in the process, so
+        // the per-instance budgets are summed into the global cache ceiling.
+        void update_cache_size_max() {
+            unsigned long total = 0;
+            for (auto it = instances.begin(); it != instances.end();) {
+                if (it->second.instance.expired()) {
+                    it = instances.erase(it);
+                } else {
+                    total += it->second.cache_size_max;
+                    ++it;
+                }
             }
+            if (total != 0)
+                jet::set_system_parameter(0, JET_paramCacheSizeMax, total);
         }
 
-        void jet_action(function< void() > action) {
-            try {
-                action();
-            } catch (jet::error& ex) {
-                throw map_exception(ex);
+        // must be called with instances_lock held
+        void enable_multi_instance() {
+            if (!multi_instance_enabled) {
+                try {
+                    jet::enable_multi_instance(nullptr, 0);
+                } catch (jet::error& ex) {
+                    // someone else in this process already configured ESENT
+                    if (ex.code() != JET_errSystemParamsAlreadySet) throw;
+                }
+                multi_instance_enabled = true;
+            }
+        }
+
+        auto acquire_instance(const InstanceOptions& options) -> jet::instance_ptr {
+            auto name = options.name.empty() ? default_instance_name : options.name;
+            std::lock_guard<std::mutex> guard(instances_lock);
+
+            auto it = instances.find(name);
+            if (it != instances.end()) {
+                if (auto instance = it->second.instance.lock()) return instance;
             }
+
+            enable_multi_instance();
+            auto instance = make_shared<jet::instance>(name, instance_parameters(options));
+            instances[name] = instance_entry { instance, options.cache_size_max };
+            update_cache_size_max();
+            return instance;
+        }
+
+        // A bulk load instance is private to one load and never registered:
+        // it runs without recovery, so no log or checkpoint files are
+        // written. Sorts and partitioned joins still need temporary tables,
+        // so it keeps a few, in a temporary database next to the loaded one
+        // where it cannot collide with the temp files of other instances.
+        auto make_bulk_instance(const string& owner, const sys::path& temp_file) -> jet::instance_ptr {
+            vector<jet::system_parameter> parameters;
+            parameters.push_back(jet::system_parameter { JET_paramRecovery, 0, "Off" });
+            parameters.push_back(jet::system_parameter { JET_paramMaxTemporaryTables, bulk_temporary_tables, string() });
+            parameters.push_back(jet::system_parameter { JET_paramTempPath, 0, temp_file.string() });
+
+            std::stringstream name;
+            name << owner << ".bulk." << ++bulk_instances;
+
+            std::lock_guard<std::mutex> guard(instances_lock);
+            enable_multi_instance();
+            return make_shared<jet::instance>(name.str(), parameters);
+        }
+
+        void verify_clean_shutdown(const string& filename) {
+            auto info = jet::get_database_file_info(filename);
+            if (info.dbstate != JET_dbstateCleanShutdown)
+                throw error("[bulk_load] database was not shut down cleanly");
         }
 
     }
 
+    void count_conflict(const string& dbname, const string& tablename) {
+        std::lock_guard<std::mutex> guard(conflicts_lock);
+        ++conflict_entry(dbname, tablename).conflicts;
+    }
+
+    void count_retry(const string& dbname, const string& tablename) {
+        std::lock_guard<std::mutex> guard(conflicts_lock);
+        ++conflict_entry(dbname, tablename).retries;
+    }
+
+    auto conflict_stats(const string& dbname) -> vector<ConflictStats> {
+        std::lock_guard<std::mutex> guard(conflicts_lock);
+        vector<ConflictStats> stats;
+        for (auto& entry : conflicts) {
+            if (entry.first.first == dbname) stats.push_back(entry.second);
+        }
+        return stats;
+    }
+
+    auto snapshot_age_ms(const snapshot_state& state) -> unsigned long {
+        auto age = std::chrono::steady_clock::now() - state.started;
+        return static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::milliseconds>(age).count());
+    }
+
+    void check_snapshot(snapshot_state& state, const string& tablename) {
+        if (state.closed)
+            throw error("[snapshot] the snapshot of " + tablename + " has been closed");
+        auto& options = state.options;
+        if (options.warn_after_ms == 0 && options.abort_after_ms == 0) return;
+
+        auto age = snapshot_age_ms(state);
+        if (options.abort_after_ms != 0 && age > options.abort_after_ms) {
+            std::stringstream ss;
+            ss << "[snapshot] aborted a read of " << tablename << " after " << age << "ms";
+            throw error(ss.str());
+        }
+        if (options.warn_after_ms != 0 && age > options.warn_after_ms && !state.warned) {
+            state.warned = true;
+            if (options.on_long_reader) options.on_long_reader(tablename, age);
+        }
+    }
+
     auto make_table(jet::instance_ptr instance,
         jet::session_ptr session,
-        JET_TABLEID table_id) -> table_ptr;
+        jet::db_ptr data,
+        const string& tablename,
+        JET_TABLEID table_id,
+        snapshot_state_ptr snapshot = nullptr) -> table_ptr;
+
+    class snapshot_impl : public interface::Snapshot {
+    public: // interface
+        auto open_table(const string& tablename) -> table_ptr final override {
+            check_snapshot(*state, tablename);
+            return jet_function<table_ptr>([&](){
+                auto table_id = jet::open_table(session->id(), data->id(), tablename);
+                return make_table(instance, session, data, tablename, table_id, state);
+            });
+        }
+
+        auto age_ms() const -> unsigned long final override {
+            return snapshot_age_ms(*state);
+        }
+
+    public:
+        snapshot_impl(jet::instance_ptr instance, const string& filename, const SnapshotOptions& options)
+            : instance(instance), session(make_shared<jet::session>(instance)) {
+            session->begin();
+            data = session->open_db(filename);
+            session->begin_transaction(JET_bitTransactionReadOnly);
+            state = make_shared<snapshot_state>();
+            state->started = std::chrono::steady_clock::now();
+            state->options = options;
+            state->warned = false;
+            state->closed = false;
+        }
+
+        snapshot_impl(const snapshot_impl&) = delete;
+        auto operator=(const snapshot_impl&) -> snapshot_impl& = delete;
+
+        ~snapshot_impl() {
+            // ending the transaction also closes the tables opened in it
+            state->closed = true;
+            session->rollback();
+        }
+
+    private:
+        jet::instance_ptr instance;
+        jet::session_ptr session;
+        jet::db_ptr data;
+        snapshot_state_ptr state;
+    };
 
     class database_impl : public interface::Database {
     public: // interface
-        void transaction(function< void() > action) final override {}
+        void transaction(function< void() > action) final override {
+            jet_action([&](){
+                session->begin_transaction(0);
+            });
+            try {
+                action();
+                jet_action([&](){
+                    session->commit_transaction(0);
+                });
+            } catch (...) {
+                session->rollback();
+                throw;
+            }
+        }
+
+        void transaction(const RetryPolicy& policy, function< void() > action) final override {
+            std::minstd_rand random(static_cast<unsigned>(
+                std::hash<std::thread::id>()(std::this_thread::get_id())
+                ^ std::chrono::steady_clock::now().time_since_epoch().count()));
+            for (unsigned attempt = 1;; ++attempt) {
+                try {
+                    transaction(action);
+                    return;
+                } catch (conflict_error& ex) {
+                    if (attempt >= policy.attempts) throw;
+                    count_retry(data->name(), ex.table());
+                    std::this_thread::sleep_for(backoff_delay(policy, attempt, random));
+                }
+            }
+        }
+
+        auto conflict_stats() const -> vector<ConflictStats> final override {
+            return jato::conflict_stats(data->name());
+        }
+
+        auto snapshot() -> snapshot_ptr final override {
+            return snapshot(SnapshotOptions());
+        }
+
+        auto snapshot(const SnapshotOptions& options) -> snapshot_ptr final override {
+            return jet_function<snapshot_ptr>([&](){
+                return make_unique<snapshot_impl>(instance, data->name(), options);
+            });
+        }
 
         void create_table(const string& tablename) final override {
-            jet_action([&](){
+            table_action(data->name(), tablename, [&](){
                 auto table_id = jet::create_table(session->id(), data->id(), tablename);
                 jet::close_table(session->id(), table_id);
             });
         }
 
         void delete_table(const string& tablename) final override {
-            jet_action([&](){
+            // the sweeper's cursor would keep the table in use
+            stop_sweeper(tablename);
+            table_action(data->name(), tablename, [&](){
+                // as would a key filter build's
+                drop_key_filter(data->name(), tablename);
                 jet::delete_table(session->id(), data->id(), tablename);
+                delete_saved_key_filter(session->id(), data->id(), tablename);
+                drop_row_cache(data->name(), tablename);
+                drop_views(session->id(), data->id(), data->name(), tablename);
+                drop_ttl(data->name(), tablename);
             });
         }
 
@@ -68,13 +319,23 @@ namespace jato {
             return jet_function<table_ptr>([&](){
                 JET_TABLEID table_id = 0;
                 table_id = jet::open_table(session->id(), data->id(), tablename);
-                return make_table(instance, session, table_id);
+                return make_table(instance, session, data, tablename, table_id);
             });
         }
 
         void rename_table(const string& oldname, const string& newname) final override {
-            jet_action([&](){
+            table_action(data->name(), oldname, [&](){
+                if (!table_views(instance, data->name(), oldname)->empty())
+                    throw error("[rename_table] cannot rename a table with views: " + oldname);
+                stop_sweeper(oldname);
+                drop_key_filter(data->name(), oldname);
+                drop_key_filter(data->name(), newname);
                 jet::rename_table(session->id(), data->id(), oldname, newname);
+                delete_saved_key_filter(session->id(), data->id(), oldname);
+                delete_saved_key_filter(session->id(), data->id(), newname);
+                drop_row_cache(data->name(), oldname);
+                drop_row_cache(data->name(), newname);
+                drop_ttl(data->name(), oldname);
             });
         }
 
@@ -85,6 +346,58 @@ namespace jato {
         void with_table(const string& tablename, function<void(interface::Table& table)>) final override {
         }
 
+        void create_view(const string& tablename, const ViewSpec& spec) final override {
+            auto base = open_table(tablename);
+            table_action(data->name(), tablename, [&](){
+                jato::create_view(*session, data->id(), data->name(), *base, tablename, spec);
+            });
+        }
+
+        auto views(const string& tablename) -> vector<ViewSpec> final override {
+            return jet_function<vector<ViewSpec>>([&](){
+                vector<ViewSpec> specs;
+                for (auto& view : *table_views(instance, data->name(), tablename))
+                    specs.push_back(view.spec);
+                return specs;
+            });
+        }
+
+        auto subscribe_changes(const ChangeFeedOptions& options) -> change_feed_ptr final override {
+            return jato::subscribe_changes(shared_change_hub(data->name()), options);
+        }
+
+        void enable_ttl(const string& tablename, const string& fieldname, const TtlOptions& options) final override {
+            auto table = open_table(tablename);
+            auto fields = table->fields();
+            auto field = std::find_if(fields.begin(), fields.end(),
+                [&](const FieldDescriptor& f) { return f.name == fieldname; });
+            if (field == fields.end())
+                throw error("[enable_ttl] no such field: " + fieldname);
+            if (field->type != datetime_type::type)
+                throw error("[enable_ttl] the expiry field must be a datetime: " + fieldname);
+            auto indexname = ttl_index_name(fieldname);
+            auto indexes = table->indexes();
+            auto indexed = std::any_of(indexes.begin(), indexes.end(),
+                [&](const IndexDescriptor& index) { return index.name == indexname; });
+            if (!indexed) table->create_index(indexname, vector<string>(1, fieldname), sparse_index);
+
+            auto state = shared_ttl(data->name(), tablename);
+            {
+                std::lock_guard<std::mutex> guard(state->lock);
+                if (!state->expiry_field.empty() && state->expiry_field != fieldname)
+                    throw error("[enable_ttl] " + tablename + " already expires by " + state->expiry_field);
+                state->expiry_field = fieldname;
+            }
+            stop_sweeper(tablename);
+            sweepers.push_back(make_unique<ttl_sweeper>(instance, data->name(), tablename, fieldname, options));
+        }
+
+        auto ttl_stats(const string& tablename) -> TtlStats final override {
+            auto state = shared_ttl(data->name(), tablename);
+            TtlStats stats = { state->swept, state->sweeps, state->failures };
+            return stats;
+        }
+
     public:
         database_impl(jet::instance_ptr instance, jet::session_ptr session)
             : instance(instance), session(session) {}
@@ -94,15 +407,22 @@ namespace jato {
         }
 
     private:
+        void stop_sweeper(const string& tablename) {
+            sweepers.erase(std::remove_if(sweepers.begin(), sweepers.end(),
+                [&](const unique_ptr<ttl_sweeper>& sweeper) { return sweeper->table() == tablename; }),
+                sweepers.end());
+        }
+
         jet::instance_ptr instance;
         jet::session_ptr session;
         jet::db_ptr data;
+        vector<unique_ptr<ttl_sweeper>> sweepers;
     };
 
     class session_impl : public interface::Session {
     public:
-        session_impl() {
-            instance = make_shared<jet::instance>();
+        explicit session_impl(const InstanceOptions& options) {
+            instance = acquire_instance(options);
             session = make_shared<jet::session>(instance);
             session->begin();
         }
@@ -124,13 +444,62 @@ namespace jato {
             });
         }
 
+        auto open_async_database(const sys::path& path, const AsyncOptions& options) -> async_database_ptr final override {
+            auto instance = this->instance;
+            return make_async_database([instance, path](){
+                return jet_function<database_ptr>([&](){
+                    auto worker_session = make_shared<jet::session>(instance);
+                    worker_session->begin();
+                    auto database = make_unique<database_impl>(instance, worker_session);
+                    database->open(path);
+                    return database_ptr(move(database));
+                });
+            }, options);
+        }
+
+        auto make_sorter(const SortSpec& spec) -> sorter_ptr final override {
+            return jato::make_sorter(session, spec);
+        }
+
+        void bulk_load(const sys::path& path, function<void(interface::Database& database)> load) final override {
+            jet_action([&](){
+                auto temp_file = sys::path(path.string() + ".temp");
+                auto bulk_instance = make_bulk_instance(instance->instance_name(), temp_file);
+                auto bulk_session = make_shared<jet::session>(bulk_instance);
+                bulk_session->begin();
+                bulk_session->create_db(path, JET_bitDbRecoveryOff);
+                try {
+                    database_impl database(bulk_instance, bulk_session);
+                    database.open(path);
+                    load(database);
+                } catch (...) {
+                    // an unlogged database is unusable after a failed load
+                    bulk_session->end();
+                    bulk_instance->shutdown();
+                    sys::remove(path);
+                    sys::remove(temp_file);
+                    throw;
+                }
+                bulk_session->end();
+                bulk_instance->shutdown();
+                sys::remove(temp_file);
+                verify_clean_shutdown(path);
+            });
+        }
+
     private:
         jet::instance_ptr instance;
         jet::session_ptr session;
     };
 
     auto make_session() -> session_ptr {
-        return make_unique<session_impl>();
+        return make_session(InstanceOptions());
+    }
+
+    auto make_session(const InstanceOptions& options) -> session_ptr {
+        return jet_function<session_ptr>([&](){
+            return make_unique<session_impl>(options);
+        });
     }
 
     void drop_database(const sys::path& path) {
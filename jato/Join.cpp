@@ -0,0 +1,202 @@
+#include "internal.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+namespace jato {
+
+    using std::make_unique;
+    using std::move;
+
+    namespace {
+
+        using join_action = function< auto(const interface::Record& outer, const interface::Record& inner) -> bool >;
+
+        // collects the named fields of record in order; false if one is null
+        auto join_key(const interface::Record& record, const vector<string>& fieldnames, vector<FieldValue>& key) -> bool {
+            vector<boost::optional<FieldValue>> found(fieldnames.size());
+            record.foreach_field([&](const string& fieldname, const FieldValue& field){
+                for (std::size_t i = 0; i < fieldnames.size(); ++i)
+                    if (fieldnames[i] == fieldname) found[i] = field;
+            });
+            key.clear();
+            for (auto& field : found) {
+                if (!field) return false;
+                key.push_back(*field);
+            }
+            return true;
+        }
+
+        auto encoded_key(const vector<FieldValue>& key) -> string {
+            auto encoded = encode_key(key);
+            return string(encoded.begin(), encoded.end());
+        }
+
+        // rough heap footprint of a hashed row
+        auto row_bytes(const string& key, const interface::Record& record) -> std::size_t {
+            std::size_t bytes = key.size() + 96;
+            record.foreach_field([&](const string& fieldname, const FieldValue& field) {
+                bytes += fieldname.size() + field_bytes(field).size + 64;
+            });
+            return bytes;
+        }
+
+        // partitions use other bits of the hash than the buckets do
+        auto partition_of(const string& key, std::size_t partitions) -> std::int64_t {
+            std::uint64_t hash = std::hash<string>()(key);
+            return static_cast<std::int64_t>(((hash * 0x9e3779b97f4a7c15ULL) >> 32) % partitions);
+        }
+
+        void check_join_fields(interface::Table& outer, interface::Table& inner, const JoinSpec& spec) {
+            if (spec.outer_fields.empty() || spec.outer_fields.size() != spec.inner_fields.size())
+                throw error("[join] outer and inner join fields must pair up");
+            auto outer_fields = outer.fields();
+            auto inner_fields = inner.fields();
+            auto type_of = [](const vector<FieldDescriptor>& fields, const string& name) -> field_type {
+                auto it = std::find_if(fields.begin(), fields.end(),
+                    [&](const FieldDescriptor& field) { return field.name == name; });
+                if (it == fields.end()) throw error("[join] no such field: " + name);
+                if (is_long_value(it->type)) throw error("[join] cannot join on a long value field: " + name);
+                return it->type;
+            };
+            for (std::size_t i = 0; i < spec.outer_fields.size(); ++i) {
+                if (type_of(outer_fields, spec.outer_fields[i]) != type_of(inner_fields, spec.inner_fields[i]))
+                    throw error("[join] join fields have different types: "
+                        + spec.outer_fields[i] + " and " + spec.inner_fields[i]);
+            }
+        }
+
+        // An index whose leading fields are the inner join fields in some
+        // order; order receives the join field position of each of them.
+        auto find_join_index(interface::Table& inner, const vector<string>& fieldnames,
+            vector<std::size_t>& order) -> boost::optional<IndexDescriptor> {
+            boost::optional<IndexDescriptor> best;
+            for (auto& index : inner.indexes()) {
+                if (index.fields.size() < fieldnames.size()) continue;
+                vector<std::size_t> positions;
+                for (std::size_t i = 0; i < fieldnames.size(); ++i) {
+                    auto it = std::find(fieldnames.begin(), fieldnames.end(), index.fields[i]);
+                    if (it == fieldnames.end()) break;
+                    positions.push_back(it - fieldnames.begin());
+                }
+                if (positions.size() != fieldnames.size()) continue;
+                // the primary index reads records without a second seek
+                if (!best || (index.flags & primary_index)) {
+                    best = index;
+                    order = positions;
+                }
+            }
+            return best;
+        }
+
+        // seeks the inner index once per outer record
+        void index_nested_loop(interface::Table& outer, interface::Table& inner, const JoinSpec& spec,
+            const IndexDescriptor& index, const vector<std::size_t>& order, join_action action) {
+            vector<FieldValue> outer_key, inner_key, seek_key;
+            outer.foreach_record([&](record_ptr outer_record) {
+                if (!join_key(*outer_record, spec.outer_fields, outer_key)) return true;
+                seek_key.clear();
+                for (auto position : order) seek_key.push_back(outer_key[position]);
+                auto wanted = encoded_key(outer_key);
+                auto go_on = true;
+                inner.foreach_record(index.name, seek_key, seek_key, [&](record_ptr inner_record) {
+                    // index keys may fold case or be truncated, so compare the values
+                    if (join_key(*inner_record, spec.inner_fields, inner_key) && encoded_key(inner_key) == wanted)
+                        go_on = action(*outer_record, *inner_record);
+                    return go_on;
+                });
+                return go_on;
+            });
+        }
+
+        using hash_table = std::unordered_multimap<string, record_ptr>;
+
+        auto probe(const hash_table& built, const string& key, const interface::Record& outer, join_action& action) -> bool {
+            auto matches = built.equal_range(key);
+            for (auto it = matches.first; it != matches.second; ++it)
+                if (!action(outer, *it->second)) return false;
+            return true;
+        }
+
+        auto hash_join(jet::session_ptr session, interface::Table& outer, interface::Table& inner,
+            const JoinSpec& spec, join_action action) -> join_method {
+            hash_table built;
+            std::size_t bytes = 0, rows = 0, partitions = 0;
+            unique_ptr<sorted_run> inner_run;
+            vector<FieldValue> key;
+
+            inner.foreach_record([&](record_ptr record) {
+                if (!join_key(*record, spec.inner_fields, key)) return true;
+                auto encoded = encoded_key(key);
+                if (inner_run) {
+                    inner_run->add(*record, partition_of(encoded, partitions));
+                    return true;
+                }
+                bytes += row_bytes(encoded, *record);
+                ++rows;
+                built.emplace(move(encoded), move(record));
+                if (bytes <= spec.memory_budget) return true;
+
+                // too big: partition so that each part fits, guessing the
+                // table's size from the rows read so far
+                auto expected = std::max<std::uint64_t>(inner.estimate_count(0), 2 * rows);
+                auto total = static_cast<double>(bytes) / rows * expected;
+                partitions = static_cast<std::size_t>(std::min(2 * total / std::max<std::size_t>(spec.memory_budget, 1) + 1, 4096.0));
+                inner_run = make_unique<sorted_run>(session, inner.fields(), vector<SortKey>());
+                for (auto& row : built) inner_run->add(*row.second, partition_of(row.first, partitions));
+                built.clear();
+                return true;
+            });
+
+            if (!inner_run) {
+                outer.foreach_record([&](record_ptr record) {
+                    if (!join_key(*record, spec.outer_fields, key)) return true;
+                    return probe(built, encoded_key(key), *record, action);
+                });
+                return join_method::hash;
+            }
+
+            sorted_run outer_run(session, outer.fields(), vector<SortKey>());
+            outer.foreach_record([&](record_ptr record) {
+                if (join_key(*record, spec.outer_fields, key))
+                    outer_run.add(*record, partition_of(encoded_key(key), partitions));
+                return true;
+            });
+
+            // both runs come back ordered by partition; join them in step
+            std::int64_t inner_part = 0, outer_part = 0;
+            auto inner_record = inner_run->next(inner_part);
+            auto outer_record = outer_run.next(outer_part);
+            while (outer_record) {
+                auto part = outer_part;
+                built.clear();
+                while (inner_record && inner_part < part) inner_record = inner_run->next(inner_part);
+                while (inner_record && inner_part == part) {
+                    join_key(*inner_record, spec.inner_fields, key);
+                    built.emplace(encoded_key(key), move(inner_record));
+                    inner_record = inner_run->next(inner_part);
+                }
+                while (outer_record && outer_part == part) {
+                    join_key(*outer_record, spec.outer_fields, key);
+                    if (!probe(built, encoded_key(key), *outer_record, action)) return join_method::partitioned_hash;
+                    outer_record = outer_run.next(outer_part);
+                }
+            }
+            return join_method::partitioned_hash;
+        }
+
+    }
+
+    auto join_tables(jet::session_ptr session, interface::Table& outer, interface::Table& inner,
+        const JoinSpec& spec, function< auto(const interface::Record& outer, const interface::Record& inner) -> bool > action) -> join_method {
+        check_join_fields(outer, inner, spec);
+        vector<std::size_t> order;
+        if (auto index = find_join_index(inner, spec.inner_fields, order)) {
+            index_nested_loop(outer, inner, spec, *index, order, action);
+            return join_method::index_nested_loop;
+        }
+        return hash_join(session, outer, inner, spec, action);
+    }
+
+}
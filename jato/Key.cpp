@@ -0,0 +1,214 @@
+#include "jato.h"
+
+#include <cstring>
+#include <type_traits>
+
+namespace jato {
+
+    using std::uint8_t;
+    using std::uint64_t;
+
+    namespace {
+
+        const uint8_t escape = 0x00;
+        const uint8_t escaped_zero = 0xff;
+        const uint8_t terminator = 0x00;
+
+        // ESENT orders GUIDs as SQL Server does, by bytes 10-15, then 8-9,
+        // 6-7, 4-5 and 0-3 of the stored value
+        const std::size_t guid_order[16] = { 10, 11, 12, 13, 14, 15, 8, 9, 6, 7, 4, 5, 0, 1, 2, 3 };
+
+        template <typename U>
+        void put_big_endian(vector<uint8_t>& key, U bits) {
+            for (int shift = (sizeof(U) - 1) * 8; shift >= 0; shift -= 8)
+                key.push_back(static_cast<uint8_t>(bits >> shift));
+        }
+
+        template <typename U>
+        auto get_big_endian(const uint8_t*& p, const uint8_t* end) -> U {
+            if (end - p < static_cast<std::ptrdiff_t>(sizeof(U)))
+                throw error("[decode_key] key is truncated");
+            U bits = 0;
+            for (std::size_t i = 0; i < sizeof(U); ++i) bits = static_cast<U>((bits << 8) | *p++);
+            return bits;
+        }
+
+        // unsigned integers of the same width as T
+        template <std::size_t N> struct unsigned_of;
+        template <> struct unsigned_of<1> { using type = std::uint8_t; };
+        template <> struct unsigned_of<2> { using type = std::uint16_t; };
+        template <> struct unsigned_of<4> { using type = std::uint32_t; };
+        template <> struct unsigned_of<8> { using type = std::uint64_t; };
+
+        // how the bits of a type are made to sort as unsigned bytes
+        struct float_order {};
+        struct signed_order {};
+        struct unsigned_order {};
+
+        template <typename T>
+        struct order_of {
+            using type = typename std::conditional<std::is_floating_point<T>::value, float_order,
+                typename std::conditional<std::is_signed<T>::value, signed_order, unsigned_order>::type>::type;
+        };
+
+        // negative numbers sort in reverse, so flip every bit
+        template <typename U>
+        auto flip(U bits, U sign, float_order) -> U {
+            return (bits & sign) ? static_cast<U>(~bits) : static_cast<U>(bits | sign);
+        }
+
+        template <typename U>
+        auto flip(U bits, U sign, signed_order) -> U {
+            return static_cast<U>(bits ^ sign);
+        }
+
+        template <typename U>
+        auto flip(U bits, U, unsigned_order) -> U {
+            return bits;
+        }
+
+        template <typename U>
+        auto unflip(U bits, U sign, float_order) -> U {
+            return (bits & sign) ? static_cast<U>(bits & ~sign) : static_cast<U>(~bits);
+        }
+
+        template <typename U, typename Order>
+        auto unflip(U bits, U sign, Order order) -> U {
+            // flipping the sign bit or nothing undoes itself
+            return flip(bits, sign, order);
+        }
+
+        template <typename T>
+        auto to_ordered(T value) -> typename unsigned_of<sizeof(T)>::type {
+            using U = typename unsigned_of<sizeof(T)>::type;
+            const U sign = static_cast<U>(U(1) << (sizeof(U) * 8 - 1));
+            U bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return flip(bits, sign, typename order_of<T>::type());
+        }
+
+        template <typename T>
+        auto from_ordered(typename unsigned_of<sizeof(T)>::type bits) -> T {
+            using U = typename unsigned_of<sizeof(T)>::type;
+            const U sign = static_cast<U>(U(1) << (sizeof(U) * 8 - 1));
+            bits = unflip(bits, sign, typename order_of<T>::type());
+            T value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        void put_bytes(vector<uint8_t>& key, const uint8_t* data, std::size_t size) {
+            for (std::size_t i = 0; i < size; ++i) {
+                key.push_back(data[i]);
+                if (data[i] == escape) key.push_back(escaped_zero);
+            }
+            key.push_back(escape);
+            key.push_back(terminator);
+        }
+
+        auto get_bytes(const uint8_t*& p, const uint8_t* end) -> vector<uint8_t> {
+            vector<uint8_t> bytes;
+            for (;;) {
+                if (p == end) throw error("[decode_key] key is truncated");
+                auto byte = *p++;
+                if (byte != escape) {
+                    bytes.push_back(byte);
+                    continue;
+                }
+                if (p == end) throw error("[decode_key] key is truncated");
+                auto next = *p++;
+                if (next == terminator) return bytes;
+                if (next != escaped_zero) throw error("[decode_key] invalid escape sequence");
+                bytes.push_back(escape);
+            }
+        }
+
+        struct key_encoder : boost::static_visitor<void> {
+            explicit key_encoder(vector<uint8_t>& key) : key(key) {}
+
+            template <typename T>
+            void operator()(const T& field) const {
+                put_big_endian(key, to_ordered(field.value));
+            }
+
+            void operator()(const binary_type& field) const {
+                put_bytes(key, field.value.data(), field.value.size());
+            }
+
+            void operator()(const long_binary_type& field) const {
+                put_bytes(key, field.value.data(), field.value.size());
+            }
+
+            void operator()(const text_type& field) const {
+                put_bytes(key, reinterpret_cast<const uint8_t*>(field.value.data()), field.value.size());
+            }
+
+            void operator()(const long_text_type& field) const {
+                put_bytes(key, reinterpret_cast<const uint8_t*>(field.value.data()), field.value.size());
+            }
+
+            void operator()(const guid_type& field) const {
+                for (auto i : guid_order) key.push_back(field.value.data[i]);
+            }
+
+            vector<uint8_t>& key;
+        };
+
+        template <typename F>
+        auto decode_fixed(const uint8_t*& p, const uint8_t* end) -> FieldValue {
+            using T = decltype(F::value);
+            using U = typename unsigned_of<sizeof(T)>::type;
+            return F(from_ordered<T>(get_big_endian<U>(p, end)));
+        }
+
+        auto decode_text(const uint8_t*& p, const uint8_t* end) -> string {
+            auto bytes = get_bytes(p, end);
+            return string(bytes.begin(), bytes.end());
+        }
+
+    }
+
+    auto encode_key(const vector<FieldValue>& values) -> vector<uint8_t> {
+        vector<uint8_t> key;
+        key_encoder encoder(key);
+        for (auto& value : values) boost::apply_visitor(encoder, value);
+        return key;
+    }
+
+    auto decode_key(const vector<uint8_t>& key, const vector<field_type>& types) -> vector<FieldValue> {
+        vector<FieldValue> values;
+        auto p = key.data();
+        auto end = p + key.size();
+        for (auto type : types) {
+            switch (type) {
+            case bit_type::type: values.push_back(decode_fixed<bit_type>(p, end)); break;
+            case ubyte_type::type: values.push_back(decode_fixed<ubyte_type>(p, end)); break;
+            case short_type::type: values.push_back(decode_fixed<short_type>(p, end)); break;
+            case long_type::type: values.push_back(decode_fixed<long_type>(p, end)); break;
+            case currency_type::type: values.push_back(decode_fixed<currency_type>(p, end)); break;
+            case float_type::type: values.push_back(decode_fixed<float_type>(p, end)); break;
+            case double_type::type: values.push_back(decode_fixed<double_type>(p, end)); break;
+            case datetime_type::type: values.push_back(decode_fixed<datetime_type>(p, end)); break;
+            case binary_type::type: values.push_back(binary_type(get_bytes(p, end))); break;
+            case text_type::type: values.push_back(text_type(decode_text(p, end))); break;
+            case long_binary_type::type: values.push_back(long_binary_type(get_bytes(p, end))); break;
+            case long_text_type::type: values.push_back(long_text_type(decode_text(p, end))); break;
+            case ulong_long_type::type: values.push_back(decode_fixed<ulong_long_type>(p, end)); break;
+            case long_long_type::type: values.push_back(decode_fixed<long_long_type>(p, end)); break;
+            case ushort_type::type: values.push_back(decode_fixed<ushort_type>(p, end)); break;
+            case guid_type::type: {
+                if (end - p < 16) throw error("[decode_key] key is truncated");
+                boost::uuids::uuid guid;
+                for (auto i : guid_order) guid.data[i] = *p++;
+                values.push_back(guid_type(guid));
+                break;
+            }
+            default:
+                throw error("[decode_key] unsupported field type");
+            }
+        }
+        if (p != end) throw error("[decode_key] key has trailing bytes");
+        return values;
+    }
+
+}
@@ -0,0 +1,296 @@
+#include "internal.h"
+
+#include <algorithm>
+
+namespace jato {
+
+    namespace {
+
+        const string filter_table = "jato_key_filters";
+        const std::size_t block_words = 8;      // 512 bit blocks, one probe per word
+
+        // odd constants that spread a 32 bit hash over the probes of a block
+        const std::uint32_t salts[block_words] = {
+            0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+            0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+        };
+
+        auto hash_key(const vector<char>& key) -> std::uint64_t {
+            // FNV-1a followed by a 64 bit finalizer
+            std::uint64_t hash = 14695981039346656037ull;
+            for (auto byte : key) {
+                hash ^= static_cast<std::uint8_t>(byte);
+                hash *= 1099511628211ull;
+            }
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdull;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ull;
+            hash ^= hash >> 33;
+            return hash;
+        }
+
+        auto probe_bit(std::uint64_t hash, std::size_t word) -> std::uint64_t {
+            return std::uint64_t(1) << ((static_cast<std::uint32_t>(hash) * salts[word]) >> 26);
+        }
+
+        std::mutex filters_lock;
+        std::map<std::pair<string, string>, std::shared_ptr<key_filter_state>> filters;
+
+        // opens the side table, creating it if create is set; 0 if it does not exist
+        auto open_filter_table(JET_SESID session, JET_DBID db, bool create) -> JET_TABLEID {
+            try {
+                return jet::open_table(session, db, filter_table);
+            } catch (jet::error& ex) {
+                if (ex.code() != JET_errObjectNotFound) throw;
+            }
+            if (!create) return 0;
+
+            auto table = jet::create_table(session, db, filter_table);
+            JET_COLUMNDEF name_def = { sizeof(JET_COLUMNDEF), 0, text_type::type, 0, 0, 0, 0, 0, 0 };
+            JET_COLUMNDEF words_def = { sizeof(JET_COLUMNDEF), 0, long_binary_type::type, 0, 0, 0, 0, 0, 0 };
+            JET_COLUMNDEF clean_def = { sizeof(JET_COLUMNDEF), 0, ubyte_type::type, 0, 0, 0, 0, 0, 0 };
+            jet::add_column(session, table, "table_name", &name_def, nullptr, 0);
+            jet::add_column(session, table, "words", &words_def, nullptr, 0);
+            jet::add_column(session, table, "clean", &clean_def, nullptr, 0);
+            jet::create_index(session, table, "by_table", JET_bitIndexPrimary, string("+table_name\0\0", 13), 100);
+            return table;
+        }
+
+        // positions the side table on the row of tablename
+        auto seek_filter_row(JET_SESID session, JET_TABLEID table, const string& tablename) -> bool {
+            jet::set_current_index(session, table, string());
+            jet::make_key(session, table, tablename.data(), static_cast<unsigned long>(tablename.size()), JET_bitNewKey);
+            return jet::seek(session, table, JET_bitSeekEQ);
+        }
+
+        // clears the clean flag of the saved copy of tablename, if there is one
+        void mark_saved_stale(JET_SESID session, JET_DBID db, const string& tablename) {
+            auto table = open_filter_table(session, db, false);
+            if (table == 0) return;
+            try {
+                if (seek_filter_row(session, table, tablename)) {
+                    auto clean_id = jet::get_column_info(session, table, "clean").columnid;
+                    std::uint8_t clean = 0;
+                    jet::retrieve_column(session, table, clean_id, &clean, sizeof(clean), 0, nullptr);
+                    if (clean) {
+                        jet::prepare_update(session, table, JET_prepReplace);
+                        try {
+                            clean = 0;
+                            jet::set_column(session, table, clean_id, &clean, sizeof(clean), 0, nullptr);
+                            jet::update(session, table);
+                        } catch (...) {
+                            jet::cancel_update(session, table);
+                            throw;
+                        }
+                    }
+                }
+            } catch (...) {
+                JetCloseTable(session, table);
+                throw;
+            }
+            jet::close_table(session, table);
+        }
+
+    }
+
+    key_filter::key_filter(std::size_t blocks)
+        : block_count(std::max<std::size_t>(blocks, 1)),
+        bits(new std::atomic<std::uint64_t>[block_count * block_words]) {
+        for (std::size_t i = 0; i < block_count * block_words; ++i) bits[i] = 0;
+    }
+
+    key_filter::key_filter(const vector<std::uint64_t>& words)
+        : block_count(std::max<std::size_t>(words.size() / block_words, 1)),
+        bits(new std::atomic<std::uint64_t>[block_count * block_words]) {
+        for (std::size_t i = 0; i < block_count * block_words; ++i)
+            bits[i] = i < words.size() ? words[i] : 0;
+    }
+
+    auto key_filter::blocks_for(std::uint64_t expected_keys, unsigned bits_per_key) -> std::size_t {
+        auto bits = std::max<std::uint64_t>(expected_keys, 1024) * std::max(bits_per_key, 1u);
+        return static_cast<std::size_t>((bits + 511) / 512);
+    }
+
+    void key_filter::add(const vector<char>& key) {
+        auto hash = hash_key(key);
+        auto block = &bits[((hash >> 32) * block_count >> 32) * block_words];
+        for (std::size_t word = 0; word < block_words; ++word)
+            block[word].fetch_or(probe_bit(hash, word), std::memory_order_relaxed);
+    }
+
+    auto key_filter::may_contain(const vector<char>& key) const -> bool {
+        auto hash = hash_key(key);
+        auto block = &bits[((hash >> 32) * block_count >> 32) * block_words];
+        for (std::size_t word = 0; word < block_words; ++word) {
+            auto bit = probe_bit(hash, word);
+            if ((block[word].load(std::memory_order_relaxed) & bit) == 0) return false;
+        }
+        return true;
+    }
+
+    auto key_filter::words() const -> vector<std::uint64_t> {
+        vector<std::uint64_t> words(block_count * block_words);
+        for (std::size_t i = 0; i < words.size(); ++i) words[i] = bits[i];
+        return words;
+    }
+
+    auto key_filter::bytes() const -> std::size_t {
+        return block_count * block_words * sizeof(std::uint64_t);
+    }
+
+    key_filter_state::key_filter_state()
+        : building(false), cancelled(false), ready(false), failed(false), saved_unchecked(true),
+        lookups(0), negatives(0) {}
+
+    auto key_filter_state::current() -> std::shared_ptr<key_filter> {
+        std::lock_guard<std::mutex> guard(lock);
+        return filter;
+    }
+
+    void key_filter_state::finish_build(bool filled) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (filled) {
+            ready = true;
+        } else {
+            // find keeps seeking without the filter
+            failed = !cancelled;
+            filter.reset();
+        }
+        building = false;
+        built.notify_all();
+    }
+
+    void key_filter_state::cancel_build() {
+        std::unique_lock<std::mutex> guard(lock);
+        cancelled = true;
+        built.wait(guard, [&](){ return !building; });
+    }
+
+    auto shared_key_filter(const string& dbname, const string& tablename) -> std::shared_ptr<key_filter_state> {
+        std::lock_guard<std::mutex> guard(filters_lock);
+        auto& state = filters[std::make_pair(dbname, tablename)];
+        if (!state) state = std::make_shared<key_filter_state>();
+        return state;
+    }
+
+    void drop_key_filter(const string& dbname, const string& tablename) {
+        std::shared_ptr<key_filter_state> state;
+        {
+            std::lock_guard<std::mutex> guard(filters_lock);
+            auto found = filters.find(std::make_pair(dbname, tablename));
+            if (found == filters.end()) return;
+            state = found->second;
+            filters.erase(found);
+        }
+        // the build's cursor would keep the table in use
+        state->cancel_build();
+    }
+
+    auto load_key_filter(JET_SESID session, JET_DBID db, const string& tablename) -> std::shared_ptr<key_filter> {
+        auto table = open_filter_table(session, db, false);
+        if (table == 0) return nullptr;
+        std::shared_ptr<key_filter> loaded;
+        try {
+            if (seek_filter_row(session, table, tablename)) {
+                auto clean_id = jet::get_column_info(session, table, "clean").columnid;
+                auto words_id = jet::get_column_info(session, table, "words").columnid;
+                std::uint8_t clean = 0;
+                jet::retrieve_column(session, table, clean_id, &clean, sizeof(clean), 0, nullptr);
+                if (clean) {
+                    auto size = std::get<1>(jet::retrieve_column(session, table, words_id, nullptr, 0, 0, nullptr));
+                    vector<std::uint64_t> words(size / sizeof(std::uint64_t));
+                    jet::retrieve_column(session, table, words_id, words.data(),
+                        static_cast<unsigned long>(words.size() * sizeof(std::uint64_t)), 0, nullptr);
+                    if (!words.empty()) loaded = std::make_shared<key_filter>(words);
+                }
+            }
+        } catch (...) {
+            JetCloseTable(session, table);
+            throw;
+        }
+        jet::close_table(session, table);
+        return loaded;
+    }
+
+    void save_key_filter(JET_SESID session, JET_DBID db, const string& tablename, const key_filter* filter) {
+        auto table = open_filter_table(session, db, true);
+        try {
+            auto found = seek_filter_row(session, table, tablename);
+            jet::prepare_update(session, table, found ? JET_prepReplace : JET_prepInsert);
+            try {
+                if (!found) {
+                    jet::set_column(session, table, jet::get_column_info(session, table, "table_name").columnid,
+                        tablename.data(), static_cast<unsigned long>(tablename.size()), 0, nullptr);
+                }
+                std::uint8_t clean = filter ? 1 : 0;
+                jet::set_column(session, table, jet::get_column_info(session, table, "clean").columnid,
+                    &clean, sizeof(clean), 0, nullptr);
+                if (filter) {
+                    auto words = filter->words();
+                    jet::set_column(session, table, jet::get_column_info(session, table, "words").columnid,
+                        words.data(), static_cast<unsigned long>(words.size() * sizeof(std::uint64_t)), 0, nullptr);
+                }
+                jet::update(session, table);
+            } catch (...) {
+                jet::cancel_update(session, table);
+                throw;
+            }
+        } catch (...) {
+            JetCloseTable(session, table);
+            throw;
+        }
+        jet::close_table(session, table);
+    }
+
+    void delete_saved_key_filter(JET_SESID session, JET_DBID db, const string& tablename) {
+        auto table = open_filter_table(session, db, false);
+        if (table == 0) return;
+        try {
+            if (seek_filter_row(session, table, tablename)) jet::delete_record(session, table);
+        } catch (...) {
+            JetCloseTable(session, table);
+            throw;
+        }
+        jet::close_table(session, table);
+    }
+
+    void mark_key_filter_stale(key_filter_state& state, jet::instance_ptr instance, const string& dbname, const string& tablename) {
+        if (!state.saved_unchecked.exchange(false)) return;
+        try {
+            auto writer = std::make_shared<jet::session>(instance);
+            writer->begin();
+            auto writer_data = std::make_shared<jet::db>(writer, dbname);
+            mark_saved_stale(writer->id(), writer_data->id(), tablename);
+        } catch (...) {
+            state.saved_unchecked = true;
+            throw;
+        }
+    }
+
+    auto fill_key_filter(jet::session_ptr session, const string& dbname, const string& tablename, key_filter& filter,
+        const std::atomic<bool>& cancelled) -> bool {
+        if (cancelled) return false;
+        auto data = std::make_shared<jet::db>(session, dbname);
+        auto table = jet::open_table(session->id(), data->id(), tablename);
+        auto filled = true;
+        try {
+            vector<char> bookmark;
+            for (auto more = jet::move(session->id(), table, JET_MoveFirst, 0); more;
+                more = jet::move(session->id(), table, JET_MoveNext, 0)) {
+                if (cancelled) {
+                    filled = false;
+                    break;
+                }
+                jet::get_bookmark(session->id(), table, bookmark);
+                filter.add(bookmark);
+            }
+        } catch (...) {
+            JetCloseTable(session->id(), table);
+            throw;
+        }
+        jet::close_table(session->id(), table);
+        return filled;
+    }
+
+}
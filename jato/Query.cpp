@@ -0,0 +1,321 @@
+#include "internal.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace jato {
+
+    using std::make_unique;
+    using std::move;
+
+    namespace {
+
+        template <typename T>
+        auto matches(T value, compare_op op, T operand) -> bool {
+            switch (op) {
+            case compare_op::less: return value < operand;
+            case compare_op::less_equal: return value <= operand;
+            case compare_op::equal: return value == operand;
+            case compare_op::not_equal: return value != operand;
+            case compare_op::greater_equal: return value >= operand;
+            case compare_op::greater: return value > operand;
+            default: return false;
+            }
+        }
+
+        template <typename T>
+        auto matches_fixed(const char* value, std::size_t size, const string& operand, compare_op op) -> bool {
+            if (size != sizeof(T) || operand.size() != sizeof(T)) return false;
+            T a, b;
+            std::memcpy(&a, value, sizeof(a));
+            std::memcpy(&b, operand.data(), sizeof(b));
+            return matches(a, op, b);
+        }
+
+        auto matches_bytes(const char* value, std::size_t size, const string& operand, compare_op op) -> bool {
+            auto common = std::min(size, operand.size());
+            auto order = common == 0 ? 0 : std::memcmp(value, operand.data(), common);
+            if (order == 0) order = size < operand.size() ? -1 : size > operand.size() ? 1 : 0;
+            return matches(order, op, 0);
+        }
+
+        // compares a column value with an operand of the column's type, both as stored
+        auto matches_raw(field_type type, const char* value, std::size_t size, const string& operand, compare_op op) -> bool {
+            switch (type) {
+            case bit_type::type:
+            case ubyte_type::type: return matches_fixed<std::uint8_t>(value, size, operand, op);
+            case short_type::type: return matches_fixed<std::int16_t>(value, size, operand, op);
+            case ushort_type::type: return matches_fixed<std::uint16_t>(value, size, operand, op);
+            case long_type::type: return matches_fixed<std::int32_t>(value, size, operand, op);
+            case long_long_type::type:
+            case currency_type::type: return matches_fixed<std::int64_t>(value, size, operand, op);
+            case ulong_long_type::type: return matches_fixed<std::uint64_t>(value, size, operand, op);
+            case float_type::type: return matches_fixed<float>(value, size, operand, op);
+            case double_type::type:
+            case datetime_type::type: return matches_fixed<double>(value, size, operand, op);
+            default: return matches_bytes(value, size, operand, op);
+            }
+        }
+
+        // Fixed size values keep their order in an index and can be read
+        // back from it. Text is normalized (case folded) in index keys, so
+        // it can only narrow a range by equality and is never read from one.
+        auto is_ordered_in_index(field_type type) -> bool {
+            switch (type) {
+            case text_type::type:
+            case binary_type::type:
+            case long_text_type::type:
+            case long_binary_type::type:
+            case guid_type::type:
+                return false;
+            default:
+                return true;
+            }
+        }
+
+        auto is_lower_bound(compare_op op) -> bool {
+            return op == compare_op::greater || op == compare_op::greater_equal;
+        }
+
+        auto is_upper_bound(compare_op op) -> bool {
+            return op == compare_op::less || op == compare_op::less_equal;
+        }
+
+        // a retrieved column value, null until read
+        struct slot {
+            const column* source;
+            vector<char> buffer;
+            unsigned long size;
+            bool null;
+        };
+
+        auto is_expired(const slot& value, double now) -> bool {
+            double expiry = 0;
+            if (value.null || value.size != sizeof(expiry)) return false;
+            std::memcpy(&expiry, value.buffer.data(), sizeof(expiry));
+            return expiry <= now;
+        }
+
+        struct bound_predicate {
+            std::size_t slot;
+            compare_op op;
+            string operand;
+        };
+
+    }
+
+    class query_impl : public interface::Query {
+    public:
+        explicit query_impl(query_source source)
+            : source(move(source)), max_rows(std::numeric_limits<std::size_t>::max()) {}
+
+    public: // interface
+        auto where(const Predicate& predicate) -> interface::Query& final override {
+            auto& target = find_column(predicate.field);
+            if (is_long_value(target.type))
+                throw error("[query] cannot compare a long value field: " + predicate.field);
+            if (field_type_of(predicate.value) != target.type)
+                throw error("[query] predicate value does not have the type of " + predicate.field);
+            predicates.push_back(predicate);
+            return *this;
+        }
+
+        auto select(const vector<string>& fieldnames) -> interface::Query& final override {
+            for (auto& fieldname : fieldnames) find_column(fieldname);
+            selected = fieldnames;
+            return *this;
+        }
+
+        auto limit(std::size_t count) -> interface::Query& final override {
+            max_rows = count;
+            return *this;
+        }
+
+        auto plan() -> QueryPlan final override {
+            return choose_plan();
+        }
+
+        void foreach_record(function< auto(record_ptr) -> bool > action) final override {
+            auto chosen = choose_plan();
+            if (max_rows == 0) return;
+            slots.clear();
+            jet_action([&](){
+                // predicate columns come first so rows can be dropped before the rest is read
+                vector<bound_predicate> bounds;
+                for (auto& predicate : predicates) {
+                    auto bytes = field_bytes(predicate.value);
+                    auto operand = string(static_cast<const char*>(bytes.data), bytes.size);
+                    bounds.push_back(bound_predicate { slot_of(predicate.field), predicate.op, operand });
+                }
+                auto hides_expired = !source.expiry_field.empty();
+                auto expiry = hides_expired ? slot_of(source.expiry_field) : 0;
+                auto now = datetime_now();
+                auto predicate_slots = slots.size();
+                vector<std::size_t> output;
+                for (auto& fieldname : output_fields()) output.push_back(slot_of(fieldname));
+
+                JET_GRBIT bits = chosen.access == query_access::covering_index ? JET_bitRetrieveFromIndex : 0;
+                source.check_snapshot();
+                cursor_copy cursor(source.session->id(), source.table_id);
+                if (!enter_range(cursor, chosen.index, chosen.lo, chosen.hi)) return;
+                std::size_t emitted = 0;
+                do {
+                    source.check_snapshot();
+                    fetch(cursor, 0, predicate_slots, bits);
+                    auto selected_row = std::all_of(bounds.begin(), bounds.end(), [&](const bound_predicate& bound) {
+                        auto& value = slots[bound.slot];
+                        return !value.null && matches_raw(value.source->type,
+                            value.buffer.data(), value.size, bound.operand, bound.op);
+                    });
+                    if (!selected_row || (hides_expired && is_expired(slots[expiry], now))) continue;
+
+                    fetch(cursor, predicate_slots, slots.size(), bits);
+                    auto record = make_record();
+                    for (auto i : output) {
+                        auto& value = slots[i];
+                        if (!value.null)
+                            record->set_field(value.source->name, make_field(value.source->type, value.buffer.data(), value.size));
+                    }
+                    if (!action(move(record)) || ++emitted == max_rows) break;
+                } while (jet::move(cursor.session, cursor.id, JET_MoveNext, 0));
+            });
+        }
+
+    private:
+        auto find_column(const string& fieldname) const -> const column& {
+            auto it = source.columns.find(fieldname);
+            if (it == source.columns.end())
+                throw error("[query] no such field: " + fieldname);
+            return it->second;
+        }
+
+        auto output_fields() const -> vector<string> {
+            if (!selected.empty()) return selected;
+            vector<string> all;
+            for (auto& column : source.columns) all.push_back(column.first);
+            return all;
+        }
+
+        auto find_predicate(const string& fieldname, function< auto(compare_op) -> bool > accept) const -> const Predicate* {
+            for (auto& predicate : predicates)
+                if (predicate.field == fieldname && accept(predicate.op)) return &predicate;
+            return nullptr;
+        }
+
+        // Narrows plan to the key range of index that the predicates allow:
+        // equal values on its leading fields, then bounds on the next one.
+        // Returns how many key columns were constrained, equalities counting
+        // double.
+        auto narrow(const IndexDescriptor& index, QueryPlan& plan) const -> int {
+            std::size_t i = 0;
+            for (; i < index.fields.size(); ++i) {
+                auto equal = find_predicate(index.fields[i], [](compare_op op) { return op == compare_op::equal; });
+                if (!equal) break;
+                plan.lo.push_back(equal->value);
+            }
+            plan.hi = plan.lo;
+            auto score = static_cast<int>(2 * plan.lo.size());
+            if (i < index.fields.size() && is_ordered_in_index(find_column(index.fields[i]).type)) {
+                if (auto lower = find_predicate(index.fields[i], is_lower_bound)) {
+                    plan.lo.push_back(lower->value);
+                    ++score;
+                }
+                if (auto upper = find_predicate(index.fields[i], is_upper_bound)) {
+                    plan.hi.push_back(upper->value);
+                    ++score;
+                }
+            }
+            return score;
+        }
+
+        auto covers(const IndexDescriptor& index) const -> bool {
+            auto needed = output_fields();
+            for (auto& predicate : predicates) needed.push_back(predicate.field);
+            if (!source.expiry_field.empty()) needed.push_back(source.expiry_field);
+            return std::all_of(needed.begin(), needed.end(), [&](const string& fieldname) {
+                return is_ordered_in_index(find_column(fieldname).type)
+                    && std::find(index.fields.begin(), index.fields.end(), fieldname) != index.fields.end();
+            });
+        }
+
+        // A sparse index leaves out records whose key fields are all null,
+        // so it only holds every match when a predicate, which no null
+        // satisfies, is on one of its fields.
+        auto holds_every_match(const IndexDescriptor& index) const -> bool {
+            if ((index.flags & sparse_index) == 0) return true;
+            return std::any_of(predicates.begin(), predicates.end(), [&](const Predicate& predicate) {
+                return std::find(index.fields.begin(), index.fields.end(), predicate.field) != index.fields.end();
+            });
+        }
+
+        // The narrowest range wins; a range on the primary index reads
+        // records in place and a covering index does not read them at all.
+        auto choose_plan() const -> QueryPlan {
+            QueryPlan best = { query_access::table_scan, string(), vector<FieldValue>(), vector<FieldValue>() };
+            auto best_rank = 0;
+            for (auto& index : source.indexes) {
+                if (!holds_every_match(index)) continue;
+                QueryPlan candidate = { query_access::index_range, index.name, vector<FieldValue>(), vector<FieldValue>() };
+                auto score = narrow(index, candidate);
+                auto primary = (index.flags & primary_index) != 0;
+                auto covering = !primary && covers(index);
+                if (score == 0 && !covering) continue;
+                if (covering) candidate.access = query_access::covering_index;
+                auto rank = 4 * score + (covering ? 2 : 0) + (primary ? 1 : 0);
+                if (rank > best_rank) {
+                    best = candidate;
+                    best_rank = rank;
+                }
+            }
+            return best;
+        }
+
+        auto slot_of(const string& fieldname) -> std::size_t {
+            for (std::size_t i = 0; i < slots.size(); ++i)
+                if (slots[i].source->name == fieldname) return i;
+            slots.push_back(slot { &find_column(fieldname), vector<char>(64), 0, true });
+            return slots.size() - 1;
+        }
+
+        // reads slots [first, last) of the current row in one call
+        void fetch(const cursor_copy& cursor, std::size_t first, std::size_t last, JET_GRBIT bits) {
+            if (first == last) return;
+            requests.resize(last - first);
+            for (auto i = first; i < last; ++i) {
+                auto& request = requests[i - first];
+                request = JET_RETRIEVECOLUMN();
+                request.columnid = slots[i].source->id;
+                request.pvData = slots[i].buffer.data();
+                request.cbData = static_cast<unsigned long>(slots[i].buffer.size());
+                request.grbit = bits;
+                request.itagSequence = 1;
+            }
+            jet::retrieve_columns(cursor.session, cursor.id, requests.data(), static_cast<unsigned long>(requests.size()));
+            for (auto i = first; i < last; ++i) {
+                auto& request = requests[i - first];
+                auto& value = slots[i];
+                value.null = request.err == JET_wrnColumnNull;
+                value.size = request.cbActual;
+                if (request.err == JET_wrnBufferTruncated) {
+                    value.buffer.resize(request.cbActual);
+                    auto result = jet::retrieve_column(cursor.session, cursor.id, request.columnid,
+                        value.buffer.data(), static_cast<unsigned long>(value.buffer.size()), bits, nullptr);
+                    value.size = std::get<1>(result);
+                }
+            }
+        }
+
+        query_source source;
+        vector<Predicate> predicates;
+        vector<string> selected;
+        std::size_t max_rows;
+        vector<slot> slots;
+        vector<JET_RETRIEVECOLUMN> requests;
+    };
+
+    auto make_query(query_source source) -> query_ptr {
+        return make_unique<query_impl>(move(source));
+    }
+
+}
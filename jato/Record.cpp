@@ -0,0 +1,120 @@
+#include "internal.h"
+
+#include <cstring>
+
+namespace jato {
+
+    using std::make_unique;
+
+    namespace {
+
+        struct type_of : boost::static_visitor<field_type> {
+            template <typename T>
+            auto operator()(const T& field) const -> field_type {
+                return T::type;
+            }
+        };
+
+        struct bytes_of : boost::static_visitor<field_data> {
+            template <typename T>
+            auto operator()(const T& field) const -> field_data {
+                return field_data { &field.value, sizeof(field.value) };
+            }
+
+            auto operator()(const binary_type& field) const -> field_data {
+                return bytes(field.value);
+            }
+
+            auto operator()(const long_binary_type& field) const -> field_data {
+                return bytes(field.value);
+            }
+
+            auto operator()(const text_type& field) const -> field_data {
+                return bytes(field.value);
+            }
+
+            auto operator()(const long_text_type& field) const -> field_data {
+                return bytes(field.value);
+            }
+
+            auto operator()(const guid_type& field) const -> field_data {
+                return field_data { field.value.data, static_cast<unsigned long>(field.value.size()) };
+            }
+
+            template <typename C>
+            static auto bytes(const C& value) -> field_data {
+                return field_data { value.data(), static_cast<unsigned long>(value.size()) };
+            }
+        };
+
+        template <typename F>
+        auto fixed_field(const void* data, unsigned long size) -> FieldValue {
+            decltype(F::value) value;
+            if (size != sizeof(value))
+                throw error("[make_field] column size does not match field type");
+            std::memcpy(&value, data, sizeof(value));
+            return F(value);
+        }
+
+    }
+
+    auto is_long_value(field_type type) -> bool {
+        return type == long_binary_type::type || type == long_text_type::type;
+    }
+
+    auto field_type_of(const FieldValue& value) -> field_type {
+        return boost::apply_visitor(type_of(), value);
+    }
+
+    auto field_bytes(const FieldValue& value) -> field_data {
+        return boost::apply_visitor(bytes_of(), value);
+    }
+
+    auto make_field(field_type type, const void* data, unsigned long size) -> FieldValue {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        auto chars = static_cast<const char*>(data);
+        switch (type) {
+        case bit_type::type: return fixed_field<bit_type>(data, size);
+        case ubyte_type::type: return fixed_field<ubyte_type>(data, size);
+        case short_type::type: return fixed_field<short_type>(data, size);
+        case long_type::type: return fixed_field<long_type>(data, size);
+        case currency_type::type: return fixed_field<currency_type>(data, size);
+        case float_type::type: return fixed_field<float_type>(data, size);
+        case double_type::type: return fixed_field<double_type>(data, size);
+        case datetime_type::type: return fixed_field<datetime_type>(data, size);
+        case binary_type::type: return binary_type(vector<std::uint8_t>(bytes, bytes + size));
+        case text_type::type: return text_type(string(chars, size));
+        case long_binary_type::type: return long_binary_type(vector<std::uint8_t>(bytes, bytes + size));
+        case long_text_type::type: return long_text_type(string(chars, size));
+        case ulong_long_type::type: return fixed_field<ulong_long_type>(data, size);
+        case long_long_type::type: return fixed_field<long_long_type>(data, size);
+        case guid_type::type: return fixed_field<guid_type>(data, size);
+        case ushort_type::type: return fixed_field<ushort_type>(data, size);
+        default: throw error("[make_field] unsupported column type");
+        }
+    }
+
+    void record_impl::set_field(const string& fieldname, FieldValue field) {
+        auto it = fields.find(fieldname);
+        if (it == fields.end())
+            fields.insert(std::make_pair(fieldname, field));
+        else
+            it->second = field;
+    }
+
+    auto record_impl::get_field(const string& fieldname) const -> FieldValue {
+        auto it = fields.find(fieldname);
+        if (it == fields.end())
+            throw error("[get_field] no such field: " + fieldname);
+        return it->second;
+    }
+
+    void record_impl::foreach_field(function< void(const string& fieldname, const FieldValue& field) > action) const {
+        for (auto& field : fields) action(field.first, field.second);
+    }
+
+    auto make_record() -> record_ptr {
+        return make_unique<record_impl>();
+    }
+
+}
@@ -0,0 +1,125 @@
+#include "internal.h"
+
+#include <functional>
+#include <utility>
+
+namespace jato {
+
+    namespace {
+
+        std::mutex caches_lock;
+        std::map<std::pair<string, string>, std::shared_ptr<row_cache>> caches;
+
+        // rough heap footprint of a cached row
+        auto row_bytes(const string& key, const record_impl& record) -> std::size_t {
+            std::size_t bytes = 2 * key.size() + 96;
+            record.foreach_field([&](const string& fieldname, const FieldValue& field) {
+                bytes += fieldname.size() + field_bytes(field).size + 64;
+            });
+            return bytes;
+        }
+
+    }
+
+    row_cache::row_cache() : budget(0), hits(0), misses(0), evictions(0) {}
+
+    void row_cache::configure(std::size_t byte_budget) {
+        budget = byte_budget;
+        for (auto& target : shards) {
+            std::lock_guard<std::mutex> guard(target.lock);
+            evict(target, byte_budget / shard_count);
+        }
+    }
+
+    auto row_cache::lookup(const string& key) -> row {
+        auto& target = shard_of(key);
+        std::lock_guard<std::mutex> guard(target.lock);
+        auto found = target.index.find(key);
+        if (found == target.index.end()) {
+            ++misses;
+            return nullptr;
+        }
+        target.lru.splice(target.lru.begin(), target.lru, found->second);
+        ++hits;
+        return found->second->second;
+    }
+
+    auto row_cache::generation(const string& key) -> std::uint64_t {
+        auto& target = shard_of(key);
+        std::lock_guard<std::mutex> guard(target.lock);
+        return target.generation;
+    }
+
+    void row_cache::insert(const string& key, row value, std::uint64_t generation) {
+        auto shard_budget = budget / shard_count;
+        auto bytes = row_bytes(key, *value);
+        if (bytes > shard_budget) return;
+
+        auto& target = shard_of(key);
+        std::lock_guard<std::mutex> guard(target.lock);
+        if (target.generation != generation || target.index.count(key) != 0) return;
+        target.lru.push_front(std::make_pair(key, value));
+        target.index[key] = target.lru.begin();
+        target.bytes += bytes;
+        evict(target, shard_budget);
+    }
+
+    void row_cache::invalidate(const string& key) {
+        auto& target = shard_of(key);
+        std::lock_guard<std::mutex> guard(target.lock);
+        ++target.generation;
+        auto found = target.index.find(key);
+        if (found == target.index.end()) return;
+        target.bytes -= row_bytes(key, *found->second->second);
+        target.lru.erase(found->second);
+        target.index.erase(found);
+    }
+
+    void row_cache::clear() {
+        for (auto& target : shards) {
+            std::lock_guard<std::mutex> guard(target.lock);
+            ++target.generation;
+            target.lru.clear();
+            target.index.clear();
+            target.bytes = 0;
+        }
+    }
+
+    auto row_cache::stats() const -> RowCacheStats {
+        RowCacheStats result = { hits, misses, evictions, 0, 0 };
+        for (auto& target : shards) {
+            std::lock_guard<std::mutex> guard(target.lock);
+            result.rows += target.index.size();
+            result.bytes += target.bytes;
+        }
+        return result;
+    }
+
+    auto row_cache::shard_of(const string& key) -> shard& {
+        return shards[std::hash<string>()(key) % shard_count];
+    }
+
+    // must be called with target.lock held
+    void row_cache::evict(shard& target, std::size_t shard_budget) {
+        while (target.bytes > shard_budget && !target.lru.empty()) {
+            auto& oldest = target.lru.back();
+            target.bytes -= row_bytes(oldest.first, *oldest.second);
+            target.index.erase(oldest.first);
+            target.lru.pop_back();
+            ++evictions;
+        }
+    }
+
+    auto shared_row_cache(const string& dbname, const string& tablename) -> std::shared_ptr<row_cache> {
+        std::lock_guard<std::mutex> guard(caches_lock);
+        auto& cache = caches[std::make_pair(dbname, tablename)];
+        if (!cache) cache = std::make_shared<row_cache>();
+        return cache;
+    }
+
+    void drop_row_cache(const string& dbname, const string& tablename) {
+        std::lock_guard<std::mutex> guard(caches_lock);
+        caches.erase(std::make_pair(dbname, tablename));
+    }
+
+}
@@ -0,0 +1,230 @@
+#include "internal.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace jato {
+
+    using std::make_unique;
+
+    namespace {
+
+        std::once_flag shared_once;
+        scheduler* shared_scheduler = nullptr;
+
+#ifdef _WIN32
+        // spreads workers round-robin over the NUMA nodes so that each
+        // keeps its cache pages near the cores it runs on
+        void place_on_numa_node(std::size_t worker) {
+            ULONG highest = 0;
+            if (!GetNumaHighestNodeNumber(&highest) || highest == 0) return;
+            auto node = static_cast<USHORT>(worker % (highest + 1));
+            GROUP_AFFINITY affinity = {};
+            if (GetNumaNodeProcessorMaskEx(node, &affinity) && affinity.Mask != 0)
+                SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+        }
+#else
+        void place_on_numa_node(std::size_t) {}
+#endif
+
+        // counts a level of nested run while a worker runs a task
+        class nesting {
+        public:
+            explicit nesting(std::size_t& depth) : depth(depth) { ++depth; }
+            ~nesting() { --depth; }
+
+            nesting(const nesting&) = delete;
+            auto operator=(const nesting&) -> nesting& = delete;
+
+        private:
+            std::size_t& depth;
+        };
+
+    }
+
+    auto worker_context::session(const jet::instance_ptr& instance) -> jet::session_ptr {
+        if (!slot_session || slot_session->owner() != instance) {
+            slot_session = std::make_shared<jet::session>(instance);
+            slot_session->begin();
+        }
+        return slot_session;
+    }
+
+    struct scheduler::job {
+        const vector<task>* tasks;
+        vector<task> posted;                    // the task of a posted job
+        jet::session_ptr outside_session;       // for threads outside the pool
+        std::mutex lock;
+        std::condition_variable done;
+        std::size_t remaining;
+        std::exception_ptr error;
+        bool detached;                          // deleted by its last task
+    };
+
+    auto scheduler::shared() -> scheduler& {
+        std::call_once(shared_once, [](){
+            shared_scheduler = new scheduler(std::max(1u, std::thread::hardware_concurrency()));
+        });
+        return *shared_scheduler;
+    }
+
+    scheduler::scheduler(std::size_t workers) {
+        for (std::size_t k = 0; k < workers; ++k) {
+            queues.push_back(make_unique<queue>());
+            sessions.push_back(make_unique<worker_sessions>());
+        }
+        std::lock_guard<std::mutex> guard(idle_lock);
+        for (std::size_t k = 0; k < workers; ++k) {
+            threads.push_back(std::thread([this, k](){
+                // wait for the slot table to be filled in
+                { std::lock_guard<std::mutex> started(idle_lock); }
+                work(k);
+            }));
+            slots[threads.back().get_id()] = k;
+        }
+    }
+
+    scheduler::~scheduler() {
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            stopping = true;
+        }
+        idle.notify_all();
+        for (auto& thread : threads) thread.join();
+    }
+
+    void scheduler::run(const vector<task>& tasks) {
+        if (tasks.empty()) return;
+
+        job current;
+        current.tasks = &tasks;
+        current.remaining = tasks.size();
+        current.detached = false;
+
+        // a worker calling run starts the spread at its own queue
+        auto slot = current_slot();
+        enqueue(current, slot < workers() ? slot : 0);
+
+        queued_task next;
+        while (take_from(current, next)) execute(next, slot);
+
+        std::unique_lock<std::mutex> guard(current.lock);
+        current.done.wait(guard, [&](){ return current.remaining == 0; });
+        if (current.error) std::rethrow_exception(current.error);
+    }
+
+    void scheduler::post(task work) {
+        auto posted = new job;
+        posted->posted.push_back(move(work));
+        posted->tasks = &posted->posted;
+        posted->remaining = 1;
+        posted->detached = true;
+        auto slot = current_slot();
+        enqueue(*posted, slot < workers() ? slot : 0);
+    }
+
+    // spreads the job's tasks over the queues, starting at first
+    void scheduler::enqueue(job& owner, std::size_t first) {
+        auto count = owner.tasks->size();
+        for (std::size_t i = 0; i < count; ++i) {
+            auto& target = *queues[(first + i) % workers()];
+            std::lock_guard<std::mutex> guard(target.lock);
+            target.tasks.push_back(queued_task { &owner, i });
+        }
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            queued += count;
+        }
+        idle.notify_all();
+    }
+
+    void scheduler::work(std::size_t worker) {
+        place_on_numa_node(worker);
+        for (;;) {
+            queued_task next;
+            if (take(worker, next)) {
+                execute(next, worker);
+                continue;
+            }
+            // an idle worker holds no sessions, so instances can shut down
+            sessions[worker]->levels.clear();
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle.wait(guard, [&](){ return stopping || queued > 0; });
+            if (stopping && queued == 0) return;
+        }
+    }
+
+    // the newest task of the worker's own queue, or else the oldest of another's
+    auto scheduler::take(std::size_t worker, queued_task& next) -> bool {
+        for (std::size_t i = 0; i < workers(); ++i) {
+            auto& source = *queues[(worker + i) % workers()];
+            std::unique_lock<std::mutex> guard(source.lock);
+            if (source.tasks.empty()) continue;
+            if (i == 0) {
+                next = source.tasks.back();
+                source.tasks.pop_back();
+            } else {
+                next = source.tasks.front();
+                source.tasks.pop_front();
+            }
+            guard.unlock();
+            std::lock_guard<std::mutex> counted(idle_lock);
+            --queued;
+            return true;
+        }
+        return false;
+    }
+
+    // any queued task of the given job; callers of run only help their own job
+    auto scheduler::take_from(job& owner, queued_task& next) -> bool {
+        for (auto& source : queues) {
+            std::unique_lock<std::mutex> guard(source->lock);
+            auto found = std::find_if(source->tasks.begin(), source->tasks.end(),
+                [&](const queued_task& candidate){ return candidate.owner == &owner; });
+            if (found == source->tasks.end()) continue;
+            next = *found;
+            source->tasks.erase(found);
+            guard.unlock();
+            std::lock_guard<std::mutex> counted(idle_lock);
+            --queued;
+            return true;
+        }
+        return false;
+    }
+
+    void scheduler::execute(const queued_task& next, std::size_t slot) {
+        auto& owner = *next.owner;
+        try {
+            if (slot < workers()) {
+                // a task that runs a nested job is still using its session
+                auto& worker = *sessions[slot];
+                if (worker.levels.size() == worker.depth) worker.levels.emplace_back();
+                worker_context context(slot, worker.levels[worker.depth]);
+                nesting level(worker.depth);
+                (*owner.tasks)[next.index](context);
+            } else {
+                worker_context context(slot, owner.outside_session);
+                (*owner.tasks)[next.index](context);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(owner.lock);
+            if (!owner.error) owner.error = std::current_exception();
+        }
+        // notify while holding the lock: the job lives on the stack of run
+        std::unique_lock<std::mutex> guard(owner.lock);
+        if (--owner.remaining != 0) return;
+        if (!owner.detached) {
+            owner.done.notify_all();
+            return;
+        }
+        guard.unlock();
+        delete &owner;
+    }
+
+    // worker threads use their own slot; every other thread uses the last one
+    auto scheduler::current_slot() const -> std::size_t {
+        auto found = slots.find(std::this_thread::get_id());
+        return found == slots.end() ? workers() : found->second;
+    }
+
+}
@@ -0,0 +1,218 @@
+#include "internal.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace jato {
+
+    using std::make_unique;
+    using std::move;
+
+    namespace {
+
+        void check_spec(const SortSpec& spec) {
+            if (spec.keys.empty())
+                throw error("[make_sorter] no sort keys");
+            for (auto& key : spec.keys) {
+                auto it = std::find_if(spec.fields.begin(), spec.fields.end(),
+                    [&](const FieldDescriptor& field) { return field.name == key.field; });
+                if (it == spec.fields.end())
+                    throw error("[make_sorter] sort key is not a field: " + key.field);
+                if (is_long_value(it->type))
+                    throw error("[make_sorter] cannot sort on a long value field: " + key.field);
+            }
+        }
+
+        auto copy_record(const interface::Record& record) -> record_ptr {
+            auto copy = make_record();
+            record.foreach_field([&](const string& fieldname, const FieldValue& field){
+                copy->set_field(fieldname, field);
+            });
+            return copy;
+        }
+
+        // A record with its key in encode_key order. Missing fields sort
+        // first and descending segments have their bytes inverted, which
+        // is the order ESENT gives the temporary table's key columns.
+        struct ranked {
+            vector<std::uint8_t> key;
+            std::uint64_t sequence;
+            record_ptr record;
+        };
+
+        auto operator<(const ranked& a, const ranked& b) -> bool {
+            if (a.key != b.key) return a.key < b.key;
+            return a.sequence < b.sequence;
+        }
+
+        auto rank_key(const vector<SortKey>& keys, const interface::Record& record) -> vector<std::uint8_t> {
+            vector<std::uint8_t> ranked_key;
+            for (auto& key : keys) {
+                vector<std::uint8_t> segment(1, 0);
+                record.foreach_field([&](const string& fieldname, const FieldValue& field){
+                    if (fieldname != key.field) return;
+                    auto encoded = encode_key(vector<FieldValue>(1, field));
+                    segment[0] = 1;
+                    segment.insert(segment.end(), encoded.begin(), encoded.end());
+                });
+                if (key.descending)
+                    for (auto& byte : segment) byte = static_cast<std::uint8_t>(~byte);
+                ranked_key.insert(ranked_key.end(), segment.begin(), segment.end());
+            }
+            return ranked_key;
+        }
+
+    }
+
+    // the first limit records, kept in a max heap so the worst one goes first
+    class top_sorter_impl : public interface::Sorter {
+    public:
+        explicit top_sorter_impl(const SortSpec& spec) : keys(spec.keys), limit(spec.limit) {}
+
+    public: // interface
+        void add(const interface::Record& record) final override {
+            if (done) throw error("[sorter] records were already read");
+            ranked entry { rank_key(keys, record), next_sequence++, nullptr };
+            if (best.size() == limit) {
+                if (!(entry < best.front())) return;
+                std::pop_heap(best.begin(), best.end());
+                best.pop_back();
+            }
+            entry.record = copy_record(record);
+            best.push_back(move(entry));
+            std::push_heap(best.begin(), best.end());
+        }
+
+        void foreach_record(function< auto(record_ptr) -> bool > action) final override {
+            if (done) throw error("[sorter] records were already read");
+            done = true;
+            std::sort_heap(best.begin(), best.end());
+            for (auto& entry : best)
+                if (!action(move(entry.record))) break;
+            best.clear();
+        }
+
+    private:
+        vector<SortKey> keys;
+        std::size_t limit;
+        std::uint64_t next_sequence = 0;
+        vector<ranked> best;
+        bool done = false;
+    };
+
+    // The group and the sort keys are the temporary table's key columns,
+    // followed by a sequence number that keeps equal keys unique.
+    sorted_run::sorted_run(jet::session_ptr session, const vector<FieldDescriptor>& fields, const vector<SortKey>& keys)
+        : session(session), table_id(0), group_id(0), sequence_id(0), next_sequence(0), reading(false), buffer(4096) {
+        JET_COLUMNDEF group_def = { sizeof(JET_COLUMNDEF), 0, long_long_type::type, 0, 0, 0, 0, 0, JET_bitColumnTTKey };
+        vector<JET_COLUMNDEF> column_defs(1, group_def);
+        for (auto& key : keys) {
+            auto& field = *std::find_if(fields.begin(), fields.end(),
+                [&](const FieldDescriptor& f) { return f.name == key.field; });
+            JET_GRBIT bits = JET_bitColumnTTKey;
+            if (key.descending) bits |= JET_bitColumnTTDescending;
+            // text keys are stored as binary so they sort bytewise, as in encode_key
+            auto type = field.type == text_type::type ? binary_type::type : field.type;
+            JET_COLUMNDEF column_def = { sizeof(JET_COLUMNDEF), 0, type, 0, 0, 0, 0, 0, bits };
+            column_defs.push_back(column_def);
+            columns.push_back(column { field.name, 0, field.type, bits });
+        }
+        JET_COLUMNDEF sequence_def = { sizeof(JET_COLUMNDEF), 0, long_long_type::type, 0, 0, 0, 0, 0, JET_bitColumnTTKey };
+        column_defs.push_back(sequence_def);
+        for (auto& field : fields) {
+            auto is_key = std::any_of(keys.begin(), keys.end(),
+                [&](const SortKey& key) { return key.field == field.name; });
+            if (is_key) continue;
+            JET_COLUMNDEF column_def = { sizeof(JET_COLUMNDEF), 0, field.type, 0, 0, 0, 0, 0, 0 };
+            column_defs.push_back(column_def);
+            columns.push_back(column { field.name, 0, field.type, 0 });
+        }
+
+        vector<JET_COLUMNID> ids(column_defs.size());
+        table_id = jet::open_temp_table(session->id(), column_defs.data(),
+            static_cast<unsigned long>(column_defs.size()), JET_bitTTForwardOnly, ids.data());
+        group_id = ids[0];
+        sequence_id = ids[keys.size() + 1];
+        for (std::size_t i = 0; i < columns.size(); ++i)
+            columns[i].id = ids[i < keys.size() ? i + 1 : i + 2];
+    }
+
+    sorted_run::~sorted_run() {
+        JetCloseTable(session->id(), table_id);
+    }
+
+    void sorted_run::add(const interface::Record& record, std::int64_t group) {
+        if (reading) throw error("[sorter] records were already read");
+        jet::prepare_update(session->id(), table_id, JET_prepInsert);
+        record.foreach_field([&](const string& fieldname, const FieldValue& field){
+            auto target = std::find_if(columns.begin(), columns.end(),
+                [&](const column& c) { return c.name == fieldname; });
+            if (target == columns.end())
+                throw error("[sorter] no such field: " + fieldname);
+            auto bytes = field_bytes(field);
+            JET_GRBIT bits = bytes.size == 0 ? JET_bitSetZeroLength : 0;
+            jet::set_column(session->id(), table_id, target->id, bytes.data, bytes.size, bits, nullptr);
+        });
+        auto sequence = next_sequence++;
+        jet::set_column(session->id(), table_id, group_id, &group, sizeof(group), 0, nullptr);
+        jet::set_column(session->id(), table_id, sequence_id, &sequence, sizeof(sequence), 0, nullptr);
+        jet::update(session->id(), table_id);
+    }
+
+    auto sorted_run::next(std::int64_t& group) -> record_ptr {
+        // moving to the first record ends the insert phase and merges the runs
+        auto more = jet::move(session->id(), table_id, reading ? JET_MoveNext : JET_MoveFirst, 0);
+        reading = true;
+        if (!more) return nullptr;
+
+        jet::retrieve_column(session->id(), table_id, group_id, &group, sizeof(group), 0, nullptr);
+        auto record = make_record();
+        for (auto& c : columns) {
+            auto result = jet::retrieve_column(session->id(), table_id, c.id,
+                buffer.data(), static_cast<unsigned long>(buffer.size()), 0, nullptr);
+            if (std::get<0>(result) == JET_wrnColumnNull) continue;
+            if (std::get<0>(result) == JET_wrnBufferTruncated) {
+                buffer.resize(std::get<1>(result));
+                result = jet::retrieve_column(session->id(), table_id, c.id,
+                    buffer.data(), static_cast<unsigned long>(buffer.size()), 0, nullptr);
+            }
+            record->set_field(c.name, make_field(c.type, buffer.data(), std::get<1>(result)));
+        }
+        return record;
+    }
+
+    class temp_sorter_impl : public interface::Sorter {
+    public:
+        temp_sorter_impl(jet::session_ptr session, const SortSpec& spec) : run(session, spec.fields, spec.keys) {}
+
+    public: // interface
+        void add(const interface::Record& record) final override {
+            jet_action([&](){
+                run.add(record, 0);
+            });
+        }
+
+        void foreach_record(function< auto(record_ptr) -> bool > action) final override {
+            if (done) throw error("[sorter] records were already read");
+            done = true;
+            jet_action([&](){
+                std::int64_t group = 0;
+                while (auto record = run.next(group))
+                    if (!action(move(record))) break;
+            });
+        }
+
+    private:
+        sorted_run run;
+        bool done = false;
+    };
+
+    auto make_sorter(jet::session_ptr session, const SortSpec& spec) -> sorter_ptr {
+        check_spec(spec);
+        if (spec.limit > 0) return make_unique<top_sorter_impl>(spec);
+        return jet_function<sorter_ptr>([&](){
+            return sorter_ptr(make_unique<temp_sorter_impl>(session, spec));
+        });
+    }
+
+}
@@ -1,60 +1,1437 @@
-#include "jato.h"
-#include "jet.h"
+#include "internal.h"
 
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
+#include <istream>
+#include <limits>
 #include <memory>
+#include <ostream>
+#include <thread>
 #include <utility>
 
 namespace jato {
 
     using std::make_unique;
+    using std::map;
+    using std::move;
+
+    namespace {
+
+        // largest piece handed to a single JetSetColumn/JetRetrieveColumn
+        const unsigned long max_long_value_piece = 1ul << 30;
+
+        // buffer size used when streaming to or from iostreams
+        const std::size_t long_value_chunk_size = 64 * 1024;
+
+        // rows per batch when a scan feeds an aggregation
+        const std::size_t aggregate_batch_size = 1024;
+
+        // records per transaction a range delete starts out with
+        const unsigned long delete_batch_size = 1024;
+
+        // the key description JetCreateIndex takes, e.g. "+a\0-b\0\0"
+        auto index_key(const jet::index_info& index) -> string {
+            string key;
+            for (std::size_t i = 0; i < index.columns.size(); ++i) {
+                key += index.descending[i] ? '-' : '+';
+                key += index.columns[i];
+                key += '\0';
+            }
+            key += '\0';
+            return key;
+        }
+
+        // the expiry column of a table with a TTL and the time to compare
+        // it with; target is null if there is no TTL
+        struct expiry_check {
+            const column* target;
+            double now;
+        };
+
+        // Samples a value and estimates its order-0 entropy. Data that is
+        // already dense (compressed media, encrypted blobs) is stored as is,
+        // which saves the engine a compression attempt that cannot pay off.
+        auto compression_bits(const void* data, std::size_t size) -> JET_GRBIT {
+            const std::size_t window = 512;
+            const std::size_t windows = 8;
+            const double incompressible = 7.5;   // bits per byte
+
+            auto bytes = static_cast<const std::uint8_t*>(data);
+            std::size_t histogram[256] = { 0 };
+            std::size_t sampled = 0;
+            if (size <= window * windows) {
+                for (std::size_t i = 0; i < size; ++i) ++histogram[bytes[i]];
+                sampled = size;
+            } else {
+                auto stride = (size - window) / (windows - 1);
+                for (std::size_t w = 0; w < windows; ++w) {
+                    auto start = bytes + w * stride;
+                    for (std::size_t i = 0; i < window; ++i) ++histogram[start[i]];
+                }
+                sampled = window * windows;
+            }
+            if (sampled == 0) return 0;
+
+            double entropy = 0;
+            for (auto count : histogram) {
+                if (count == 0) continue;
+                auto p = static_cast<double>(count) / sampled;
+                entropy -= p * std::log(p) / std::log(2.0);
+            }
+            return entropy > incompressible ? JET_bitSetUncompressed : JET_bitSetCompressed;
+        }
+
+        auto is_compressed(const column& column) -> bool {
+            return (column.bits & JET_bitColumnCompressed) != 0;
+        }
+
+        auto is_escrow(const column& column) -> bool {
+            return (column.bits & JET_bitColumnEscrowUpdate) != 0;
+        }
+
+        // points a JET_RETRIEVECOLUMN at a row of a batch column
+        void bind_row(JET_RETRIEVECOLUMN& retrieve, ColumnVector& column, std::size_t row) {
+            switch (column.type) {
+            case long_type::type:
+                retrieve.pvData = &column.longs[row];
+                retrieve.cbData = sizeof(std::int32_t);
+                break;
+            case long_long_type::type:
+            case currency_type::type:
+                retrieve.pvData = &column.long_longs[row];
+                retrieve.cbData = sizeof(std::int64_t);
+                break;
+            default:
+                retrieve.pvData = &column.doubles[row];
+                retrieve.cbData = sizeof(double);
+                break;
+            }
+        }
+
+        auto make_column_vector(const column& column, std::size_t batch_size) -> ColumnVector {
+            ColumnVector vector;
+            vector.name = column.name;
+            vector.type = column.type;
+            switch (column.type) {
+            case long_type::type: vector.longs.resize(batch_size); break;
+            case long_long_type::type:
+            case currency_type::type: vector.long_longs.resize(batch_size); break;
+            case double_type::type:
+            case datetime_type::type: vector.doubles.resize(batch_size); break;
+            default: throw error("[scan] unsupported batch field type: " + column.name);
+            }
+            vector.nulls.resize((batch_size + 63) / 64);
+            return vector;
+        }
+
+        auto fraction(const JET_RECPOS& position) -> double {
+            return position.centriesTotal == 0 ? 0.0
+                : static_cast<double>(position.centriesLT) / position.centriesTotal;
+        }
+
+        class long_value_reader : public interface::LongValueReader {
+        public: // interface
+            auto size() const -> std::uint64_t final override {
+                return total;
+            }
+
+            auto read(void* buffer, std::size_t count) -> std::size_t final override {
+                auto remaining = total - offset;
+                auto piece = static_cast<unsigned long>(
+                    std::min<std::uint64_t>(std::min<std::uint64_t>(count, remaining), max_long_value_piece));
+                if (piece == 0) return 0;
+
+                // JET_RETINFO offsets are 32 bit
+                if (offset > std::numeric_limits<unsigned long>::max())
+                    throw error("[read_long_value] offset is beyond what ESENT can address");
+                JET_RETINFO retinfo = { sizeof(JET_RETINFO), static_cast<unsigned long>(offset), 1, 0 };
+                jet::retrieve_column(session, table, column, buffer, piece, 0, &retinfo);
+                offset += piece;
+                return piece;
+            }
+
+            auto read(std::ostream& sink) -> std::uint64_t final override {
+                vector<char> buffer(long_value_chunk_size);
+                std::uint64_t copied = 0;
+                while (auto count = read(buffer.data(), buffer.size())) {
+                    sink.write(buffer.data(), count);
+                    copied += count;
+                }
+                return copied;
+            }
+
+        public:
+            long_value_reader(JET_SESID session, JET_TABLEID table, JET_COLUMNID column)
+                : session(session), table(table), column(column) {
+                auto result = jet::retrieve_column(session, table, column, nullptr, 0, 0, nullptr);
+                total = std::get<0>(result) == JET_wrnColumnNull ? 0 : std::get<1>(result);
+            }
+
+        private:
+            JET_SESID session;
+            JET_TABLEID table;
+            JET_COLUMNID column;
+            std::uint64_t total = 0;
+            std::uint64_t offset = 0;
+        };
+
+        // points read_long_value at the cursor a walk is on until it ends
+        class reading_cursor {
+        public:
+            reading_cursor(JET_TABLEID& reading, JET_TABLEID cursor) : reading(reading), saved(reading) {
+                reading = cursor;
+            }
+            ~reading_cursor() { reading = saved; }
+
+            reading_cursor(const reading_cursor&) = delete;
+            auto operator=(const reading_cursor&) -> reading_cursor& = delete;
+
+        private:
+            JET_TABLEID& reading;
+            JET_TABLEID saved;
+        };
+
+        class long_value_writer : public interface::LongValueWriter {
+        public: // interface
+            void write(const void* data, std::size_t count) final override {
+                auto bytes = static_cast<const char*>(data);
+                while (count > 0) {
+                    auto piece = static_cast<unsigned long>(std::min<std::size_t>(count, max_long_value_piece));
+                    auto bits = compressed ? compression_bits(bytes, piece) : 0;
+                    jet::set_column(session, table, column, bytes, piece, JET_bitSetAppendLV | bits, nullptr);
+                    bytes += piece;
+                    count -= piece;
+                }
+            }
+
+            auto write(std::istream& source) -> std::uint64_t final override {
+                vector<char> buffer(long_value_chunk_size);
+                std::uint64_t copied = 0;
+                while (source.read(buffer.data(), buffer.size()) || source.gcount() > 0) {
+                    auto count = static_cast<std::size_t>(source.gcount());
+                    write(buffer.data(), count);
+                    copied += count;
+                }
+                return copied;
+            }
+
+        public:
+            long_value_writer(JET_SESID session, JET_TABLEID table, const jato::column& column)
+                : session(session), table(table), column(column.id), compressed(is_compressed(column)) {}
+
+        private:
+            JET_SESID session;
+            JET_TABLEID table;
+            JET_COLUMNID column;
+            bool compressed;
+        };
+
+    }
+
+    void make_index_key(JET_SESID session, JET_TABLEID table, const vector<FieldValue>& values, JET_GRBIT last_bits) {
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            auto bytes = field_bytes(values[i]);
+            JET_GRBIT bits = i == 0 ? JET_bitNewKey : 0;
+            if (bytes.size == 0) bits |= JET_bitKeyDataZeroLength;
+            if (i + 1 == values.size()) bits |= last_bits;
+            jet::make_key(session, table, bytes.data, bytes.size, bits);
+        }
+    }
+
+    auto enter_range(const cursor_copy& cursor, const string& indexname,
+        const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> bool {
+        jet::set_current_index(cursor.session, cursor.id, indexname);
+        if (lo.empty()) {
+            if (!jet::move(cursor.session, cursor.id, JET_MoveFirst, 0)) return false;
+        } else {
+            make_index_key(cursor.session, cursor.id, lo, 0);
+            if (!jet::seek(cursor.session, cursor.id, JET_bitSeekGE)) return false;
+        }
+        if (hi.empty()) return true;
+        make_index_key(cursor.session, cursor.id, hi, JET_bitFullColumnEndLimit);
+        return jet::set_index_range(cursor.session, cursor.id, JET_bitRangeUpperLimit | JET_bitRangeInclusive);
+    }
 
     class table_impl : public interface::Table {
     public: // interface
         void create_field(const string& name, field_type type) final override {
+            create_field(name, type, 0);
+        }
 
+        void create_field(const string& name, field_type type, field_flags flags) final override {
+            JET_GRBIT bits = 0;
+            if (flags & compressed_field) {
+                if (!is_long_value(type))
+                    throw error("[create_field] only long value fields can be compressed: " + name);
+                bits |= JET_bitColumnCompressed;
+            }
+            // escrow columns must be fixed and have a default to apply deltas to
+            std::int64_t zero = 0;
+            unsigned long zero_size = 0;
+            if (flags & escrow_field) {
+                if (type != long_type::type && type != long_long_type::type)
+                    throw error("[create_field] escrow fields must be long or long long: " + name);
+                bits |= JET_bitColumnFixed | JET_bitColumnEscrowUpdate;
+                zero_size = type == long_type::type ? sizeof(std::int32_t) : sizeof(std::int64_t);
+            }
+            table_action([&](){
+                JET_COLUMNDEF column_def = { sizeof(JET_COLUMNDEF), 0, type, 0, 0, 0, 0, 0, bits };
+                jet::add_column(session->id(), table_id, name, &column_def, zero_size ? &zero : nullptr, zero_size);
+                columns.clear();
+            });
         }
 
         void delete_field(const string& name) final override {
-
+            table_action([&](){
+                jet::delete_column(session->id(), table_id, name);
+                columns.clear();
+            });
         }
 
         void rename_field(const string& oldname, const string& newname) final override {
-
+            table_action([&](){
+                jet::rename_column(session->id(), table_id, oldname, newname);
+                columns.clear();
+            });
         }
 
         //auto create_record() const->record_ptr final override {
         //}
 
         void add_record(record_ptr record) final override {
+            insert(*record, [](){});
+        }
 
+        void add_record(record_ptr record, const string& fieldname,
+            function< void(interface::LongValueWriter& writer) > write) final override {
+            insert(*record, [&](){
+                long_value_writer writer(session->id(), table_id, long_value_column(fieldname));
+                write(writer);
+            });
         }
 
         auto fields() const -> vector<FieldDescriptor> final override {
-            return vector<FieldDescriptor>();
+            return table_function<vector<FieldDescriptor>>([&](){
+                vector<FieldDescriptor> descriptors;
+                for (auto& column : table_columns()) {
+                    field_flags flags = is_compressed(column.second) ? compressed_field : 0;
+                    if (is_escrow(column.second)) flags |= escrow_field;
+                    descriptors.push_back(FieldDescriptor { column.second.name, column.second.type, flags });
+                }
+                return descriptors;
+            });
+        }
+
+        void create_index(const string& name, const vector<string>& fieldnames, index_flags flags) final override {
+            if (fieldnames.empty())
+                throw error("[create_index] an index needs at least one field: " + name);
+            // "+field1\0+field2\0\0"
+            string key;
+            for (auto& fieldname : fieldnames) {
+                key += '+';
+                key += fieldname;
+                key += '\0';
+            }
+            key += '\0';
+
+            JET_GRBIT bits = 0;
+            if (flags & primary_index) bits |= JET_bitIndexPrimary;
+            if (flags & unique_index) bits |= JET_bitIndexUnique;
+            if (flags & sparse_index) bits |= JET_bitIndexIgnoreAllNull;
+            table_action([&](){
+                jet::create_index(session->id(), table_id, name, bits, key, 100);
+            });
+        }
+
+        auto indexes() const -> vector<IndexDescriptor> final override {
+            return table_function<vector<IndexDescriptor>>([&](){
+                vector<IndexDescriptor> descriptors;
+                for (auto& index : jet::get_index_list(session->id(), table_id)) {
+                    index_flags flags = 0;
+                    if (index.bits & JET_bitIndexPrimary) flags |= primary_index;
+                    if (index.bits & JET_bitIndexUnique) flags |= unique_index;
+                    if (index.bits & JET_bitIndexIgnoreAllNull) flags |= sparse_index;
+                    descriptors.push_back(IndexDescriptor { index.name, index.columns, flags });
+                }
+                return descriptors;
+            });
+        }
+
+        auto find(const vector<FieldValue>& key) -> record_ptr final override {
+            check_snapshot();
+            // reads inside a transaction may see uncommitted writes, and a
+            // snapshot sees an older version, so neither uses the cache
+            auto check = table_function<expiry_check>([&](){ return expiry(); });
+            auto cached = cache->enabled() && !snapshot && session->transaction_depth() == 0;
+            return table_function<record_ptr>([&]() -> record_ptr {
+                // a primary key normalizes to the bookmark of its record, the
+                // same bytes for every spelling the index treats as equal
+                vector<char> normalized;
+                if (cached || filters->ready) normalized = normalized_key(key);
+                string cache_key(normalized.begin(), normalized.end());
+                if (cached) {
+                    if (auto hit = cache->lookup(cache_key)) {
+                        if (expired(check, *hit)) return nullptr;
+                        return make_unique<record_impl>(*hit);
+                    }
+                }
+
+                auto generation = cached ? cache->generation(cache_key) : 0;
+                vector<const column*> retrieved;
+                for (auto& column : table_columns()) retrieved.push_back(&column.second);
+
+                cursor_copy cursor(session->id(), table_id);
+                jet::set_current_index(cursor.session, cursor.id, string());
+                make_index_key(cursor.session, cursor.id, key, 0);
+                if (filters->ready) {
+                    ++filters->lookups;
+                    if (!filters->current()->may_contain(normalized)) {
+                        ++filters->negatives;
+                        return nullptr;
+                    }
+                }
+                if (!jet::seek(cursor.session, cursor.id, JET_bitSeekEQ)) return nullptr;
+                vector<char> buffer(4096);
+                auto record = read_record(cursor.id, retrieved, buffer);
+                if (cached) {
+                    auto& found = static_cast<const record_impl&>(*record);
+                    cache->insert(cache_key, std::make_shared<const record_impl>(found), generation);
+                }
+                if (expired(check, *record)) return nullptr;
+                return record;
+            });
+        }
+
+        void enable_key_filter(unsigned bits_per_key) final override {
+            table_action([&](){
+                std::lock_guard<std::mutex> guard(filters->lock);
+                if (filters->filter) return;
+                if (auto loaded = load_key_filter(session->id(), data->id(), tablename)) {
+                    filters->filter = loaded;
+                    filters->saved_unchecked = true;
+                    filters->ready = true;
+                    filters->failed = false;
+                    return;
+                }
+
+                // room for the table to double before false positives climb
+                auto expected = 2 * estimate_count(0);
+                auto filter = std::make_shared<key_filter>(key_filter::blocks_for(expected, bits_per_key));
+                filters->filter = filter;
+                filters->building = true;
+                filters->cancelled = false;
+                filters->failed = false;
+                auto state = filters;
+                auto owner = instance;
+                auto dbname = data->name();
+                auto name = tablename;
+                scheduler::shared().post([state, filter, owner, dbname, name](worker_context& worker){
+                    auto filled = false;
+                    try {
+                        filled = fill_key_filter(worker.session(owner), dbname, name, *filter, state->cancelled);
+                    } catch (...) {
+                        // reported through key_filter_stats
+                    }
+                    state->finish_build(filled);
+                });
+            });
+        }
+
+        void save_key_filter() final override {
+            table_action([&](){
+                std::lock_guard<std::mutex> guard(filters->lock);
+                if (!filters->filter || !filters->ready)
+                    throw error("[save_key_filter] the key filter of " + tablename + " is not ready");
+                filters->saved_unchecked = true;
+                jato::save_key_filter(session->id(), data->id(), tablename, filters->filter.get());
+            });
+        }
+
+        auto key_filter_stats() const -> KeyFilterStats final override {
+            auto filter = filters->current();
+            KeyFilterStats stats = { filters->ready, filter ? filter->bytes() : 0, filters->lookups, filters->negatives,
+                filters->failed };
+            return stats;
+        }
+
+        void cache_rows(std::size_t byte_budget) final override {
+            cache->configure(byte_budget);
+        }
+
+        auto row_cache_stats() const -> RowCacheStats final override {
+            return cache->stats();
+        }
+
+        auto increment(const vector<FieldValue>& key, const string& fieldname, std::int64_t delta) -> std::int64_t final override {
+            std::int64_t result = 0;
+            table_action([&](){
+                auto& found = find_column(fieldname);
+                if (!is_escrow(found))
+                    throw error("[increment] not an escrow field: " + fieldname);
+                bool narrow = found.type == long_type::type;
+                if (narrow && (delta < std::numeric_limits<std::int32_t>::min() || delta > std::numeric_limits<std::int32_t>::max()))
+                    throw error("[increment] delta out of range for long field: " + fieldname);
+
+                session->begin_transaction(0);
+                invalidate_cached(key);
+                try {
+                    cursor_copy cursor(session->id(), table_id);
+                    jet::set_current_index(cursor.session, cursor.id, string());
+                    make_index_key(cursor.session, cursor.id, key, 0);
+                    if (!jet::seek(cursor.session, cursor.id, JET_bitSeekEQ))
+                        throw error("[increment] no record with that key in " + tablename);
+                    std::shared_ptr<const interface::Record> before;
+                    if (changes->active()) before = read_whole_record(cursor.id);
+
+                    if (narrow) {
+                        std::int32_t delta32 = static_cast<std::int32_t>(delta), old = 0;
+                        jet::escrow_update(cursor.session, cursor.id, found.id,
+                            &delta32, sizeof(delta32), &old, sizeof(old), 0);
+                        result = std::int32_t(std::uint32_t(old) + std::uint32_t(delta32));
+                    } else {
+                        std::int64_t old = 0;
+                        jet::escrow_update(cursor.session, cursor.id, found.id,
+                            &delta, sizeof(delta), &old, sizeof(old), 0);
+                        result = std::int64_t(std::uint64_t(old) + std::uint64_t(delta));
+                    }
+                    add_to_view_sums(cursor, fieldname, delta);
+                    if (before) publish_on_commit(change_kind::updated, before, read_whole_record(cursor.id));
+                    session->commit_transaction(JET_bitCommitLazyFlush);
+                } catch (...) {
+                    session->rollback();
+                    throw;
+                }
+            });
+            return result;
+        }
+
+        auto delete_range(const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> std::uint64_t final override {
+            return delete_range(string(), lo, hi);
+        }
+
+        auto delete_range(const string& indexname,
+            const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> std::uint64_t final override {
+            std::uint64_t deleted = 0;
+            auto chunk = delete_batch_size;
+            erase_plan plan;
+            table_action([&](){
+                plan = plan_erase();
+            });
+            for (auto more = true; more;) {
+                try {
+                    table_action([&](){
+                        deleted += delete_batch(plan, indexname, lo, hi, chunk, more);
+                    });
+                } catch (version_store_error&) {
+                    if (chunk == 1) throw;
+                    chunk /= 2;
+                    more = true;
+                }
+            }
+            return deleted;
+        }
+
+        void truncate() final override {
+            if (session->transaction_depth() != 0)
+                throw error("[truncate] cannot truncate a table inside a transaction");
+            table_action([&](){
+                auto column_list = jet::get_column_list(session->id(), table_id);
+                auto index_list = jet::get_index_list(session->id(), table_id);
+                vector<JET_COLUMNCREATE> column_creates;
+                for (auto& info : column_list) {
+                    JET_COLUMNCREATE create = { sizeof(JET_COLUMNCREATE), const_cast<char*>(info.name.c_str()),
+                        info.type, info.max_size, info.bits,
+                        info.default_value.empty() ? nullptr : info.default_value.data(),
+                        static_cast<unsigned long>(info.default_value.size()), info.code_page, 0, 0 };
+                    column_creates.push_back(create);
+                }
+                vector<string> keys;
+                for (auto& info : index_list) keys.push_back(index_key(info));
+                vector<JET_INDEXCREATE> index_creates;
+                for (std::size_t i = 0; i < index_list.size(); ++i) {
+                    JET_INDEXCREATE create = { sizeof(JET_INDEXCREATE), const_cast<char*>(index_list[i].name.c_str()),
+                        const_cast<char*>(keys[i].data()), static_cast<unsigned long>(keys[i].size()),
+                        index_list[i].bits, 100, 0, 0, nullptr, 0, 0 };
+                    index_creates.push_back(create);
+                }
+                JET_TABLECREATE table_create = { sizeof(JET_TABLECREATE), const_cast<char*>(tablename.c_str()), nullptr,
+                    0, 0, column_creates.data(), static_cast<unsigned long>(column_creates.size()),
+                    index_creates.data(), static_cast<unsigned long>(index_creates.size()), 0, 0, 0 };
+
+                // deleting the table needs it closed here too
+                close_key_cursor();
+                jet::close_table(session->id(), table_id);
+                table_id = JET_tableidNil;
+                // holds off view writers until the views are emptied too
+                auto views = current_views();
+                session->begin_transaction(0);
+                try {
+                    jet::delete_table(session->id(), data->id(), tablename);
+                    jet::create_table_column_index(session->id(), data->id(), &table_create);
+                    jet::close_table(session->id(), table_create.tableid);
+                    empty_views(*views);
+                    publish_on_commit(change_kind::truncated, nullptr, nullptr);
+                    session->commit_transaction(0);
+                } catch (...) {
+                    session->rollback();
+                    // the old table is back; a failed reopen must not hide why
+                    try {
+                        table_id = jet::open_table(session->id(), data->id(), tablename);
+                    } catch (jet::error&) {
+                    }
+                    throw;
+                }
+                table_id = jet::open_table(session->id(), data->id(), tablename);
+                columns.clear();
+                cache->clear();
+                for (auto& view : *views) shared_row_cache(data->name(), view.spec.name)->clear();
+            });
+        }
+
+        auto upsert(record_ptr record) -> bool final override {
+            vector<FieldValue> key;
+            table_action([&](){
+                key = primary_key_of(*record, "[upsert]");
+            });
+            auto written = write_by_key(key, false, [&](record_ptr) -> const interface::Record* {
+                return record.get();
+            });
+            return *written == change_kind::inserted;
+        }
+
+        auto merge(const vector<FieldValue>& key, function< auto(record_ptr current) -> record_ptr > merge) -> bool final override {
+            record_ptr merged;
+            auto written = write_by_key(key, true, [&](record_ptr current) -> const interface::Record* {
+                auto inserting = !current;
+                merged = merge(move(current));
+                if (merged) check_merged_key(key, *merged, inserting);
+                return merged.get();
+            });
+            return written.is_initialized();
+        }
+
+        auto count() -> std::uint64_t final override {
+            return count(string(), vector<FieldValue>(), vector<FieldValue>());
+        }
+
+        auto count(const string& indexname,
+            const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> std::uint64_t final override {
+            check_snapshot();
+            return table_function<std::uint64_t>([&](){
+                cursor_copy cursor(session->id(), table_id);
+                if (!enter_range(cursor, indexname, lo, hi)) return std::uint64_t(0);
+                return std::uint64_t(jet::index_record_count(cursor.session, cursor.id, 0));
+            });
+        }
+
+        auto estimate_count(unsigned long exact_limit) -> std::uint64_t final override {
+            return estimate_count(string(), vector<FieldValue>(), vector<FieldValue>(), exact_limit);
+        }
+
+        auto estimate_count(const string& indexname,
+            const vector<FieldValue>& lo, const vector<FieldValue>& hi, unsigned long exact_limit) -> std::uint64_t final override {
+            check_snapshot();
+            return table_function<std::uint64_t>([&](){
+                cursor_copy cursor(session->id(), table_id);
+                if (!enter_range(cursor, indexname, lo, hi)) return std::uint64_t(0);
+                // counting moves the cursor, so the first entry is read before
+                auto first = jet::get_record_position(cursor.session, cursor.id);
+                if (exact_limit != 0) {
+                    auto exact = jet::index_record_count(cursor.session, cursor.id, exact_limit);
+                    if (exact < exact_limit) return std::uint64_t(exact);
+                }
+
+                // the fraction of the index between the first and last entry
+                if (hi.empty()) {
+                    jet::move(cursor.session, cursor.id, JET_MoveLast, 0);
+                } else {
+                    make_index_key(cursor.session, cursor.id, hi, JET_bitFullColumnEndLimit);
+                    jet::seek(cursor.session, cursor.id, JET_bitSeekLE);
+                }
+                auto last = jet::get_record_position(cursor.session, cursor.id);
+                auto entries = (fraction(last) - fraction(first)) * last.centriesTotal + 1;
+                return std::uint64_t(entries < 1 ? 1 : entries + 0.5);
+            });
         }
 
         void foreach_record(function< auto(record_ptr) -> bool > action) final override {
+            table_action([&](){
+                vector<const column*> retrieved;
+                for (auto& column : table_columns()) retrieved.push_back(&column.second);
+                scan(retrieved, action);
+            });
+        }
+
+        void foreach_record(const vector<string>& fieldnames, function< auto(record_ptr) -> bool > action) final override {
+            table_action([&](){
+                vector<const column*> retrieved;
+                for (auto& fieldname : fieldnames) retrieved.push_back(&find_column(fieldname));
+                scan(retrieved, action);
+            });
+        }
+
+        void foreach_record(const string& indexname, const vector<FieldValue>& lo,
+            const vector<FieldValue>& hi, function< auto(record_ptr) -> bool > action) final override {
+            check_snapshot();
+            table_action([&](){
+                vector<const column*> retrieved;
+                for (auto& column : table_columns()) retrieved.push_back(&column.second);
+                cursor_copy cursor(session->id(), table_id);
+                if (!enter_range(cursor, indexname, lo, hi)) return;
+                reading_cursor reading(reading_id, cursor.id);
+                auto check = expiry();
+                vector<char> buffer(4096);
+                do {
+                    if (expired(check, cursor.id)) continue;
+                    if (!action(read_record(cursor.id, retrieved, buffer))) break;
+                } while (jet::move(cursor.session, cursor.id, JET_MoveNext, 0));
+            });
+        }
 
+        auto join(interface::Table& inner, const JoinSpec& spec,
+            function< auto(const interface::Record& outer, const interface::Record& inner) -> bool > action) -> join_method final override {
+            return table_function<join_method>([&](){
+                return join_tables(session, *this, inner, spec, action);
+            });
+        }
+
+        auto query() -> query_ptr final override {
+            query_source source;
+            source.session = session;
+            source.table_id = table_id;
+            auto state = snapshot;
+            auto name = tablename;
+            source.check_snapshot = [state, name](){
+                if (state) jato::check_snapshot(*state, name);
+            };
+            source.indexes = indexes();
+            source.expiry_field = ttl->field();
+            table_action([&](){
+                source.columns = table_columns();
+            });
+            return make_query(move(source));
+        }
+
+        void foreach_chunked(const ChunkOptions& options, function< auto(record_ptr) -> bool > action) final override {
+            if (options.records_per_chunk == 0)
+                throw error("[foreach_chunked] chunks must hold at least one record");
+            vector<const column*> retrieved;
+            table_action([&](){
+                for (auto& column : table_columns()) retrieved.push_back(&column.second);
+            });
+
+            auto chunk = options.records_per_chunk;
+            auto position = options.resume_from;
+            for (auto finished = false; !finished;) {
+                vector<char> last;
+                try {
+                    table_action([&](){
+                        finished = walk_chunk(retrieved, position, chunk, last, action);
+                    });
+                } catch (version_store_error&) {
+                    if (chunk == 1) throw;
+                    chunk /= 2;
+                    continue;
+                }
+                chunk = chunk > options.records_per_chunk / 2 ? options.records_per_chunk : chunk * 2;
+                if (!last.empty()) {
+                    position = move(last);
+                    if (options.on_commit) options.on_commit(position);
+                }
+            }
+        }
+
+        void scan(const vector<string>& fieldnames, std::size_t batch_size,
+            function< auto(const RecordBatch& batch) -> bool > action) final override {
+            table_action([&](){
+                scan_range(fieldnames, batch_size, nullptr, nullptr, action);
+            });
+        }
+
+        auto aggregate(const AggregateSpec& spec) -> vector<AggregateRow> final override {
+            return table_function<vector<AggregateRow>>([&](){
+                aggregator total(spec);
+                auto add = [](aggregator& partial) {
+                    return [&partial](const RecordBatch& batch) {
+                        partial.add(batch);
+                        return true;
+                    };
+                };
+                // a snapshot's transaction belongs to its one session
+                if (spec.partitions <= 1 || snapshot) {
+                    scan_range(total.scanned_fields(), aggregate_batch_size, nullptr, nullptr, add(total));
+                    return total.rows();
+                }
+
+                // partition k covers [bounds[k - 1], bounds[k]), open at both ends
+                auto bounds = partition_bounds(spec.partitions);
+                auto partitions = bounds.size() + 1;
+                vector<unique_ptr<aggregator>> partials;
+                vector<task> tasks;
+                for (std::size_t k = 0; k < partitions; ++k) {
+                    partials.push_back(make_unique<aggregator>(spec));
+                    tasks.push_back([&, k](worker_context& worker){
+                        auto from = k == 0 ? nullptr : &bounds[k - 1];
+                        auto to = k == bounds.size() ? nullptr : &bounds[k];
+                        with_worker_cursor(worker, [&](table_impl& cursor){
+                            cursor.scan_range(total.scanned_fields(), aggregate_batch_size, from, to, add(*partials[k]));
+                        });
+                    });
+                }
+                scheduler::shared().run(tasks);
+
+                for (auto& partial : partials) total.merge(*partial);
+                return total.rows();
+            });
+        }
+
+        void read_long_value(const string& fieldname,
+            function< void(interface::LongValueReader& reader) > read) final override {
+            check_snapshot();
+            table_action([&](){
+                long_value_reader reader(session->id(), reading_id == 0 ? table_id : reading_id,
+                    long_value_column(fieldname).id);
+                read(reader);
+            });
         }
 
     public:
-        table_impl(jet::instance_ptr instance, jet::session_ptr session, JET_TABLEID table_id)
-            : instance(instance), session(session), table_id(table_id) {}
+        table_impl(jet::instance_ptr instance, jet::session_ptr session, jet::db_ptr data,
+            const string& tablename, JET_TABLEID table_id, snapshot_state_ptr snapshot)
+            : instance(instance), session(session), data(data), tablename(tablename), table_id(table_id), key_cursor(0), reading_id(0),
+            snapshot(snapshot), cache(shared_row_cache(data->name(), tablename)),
+            filters(shared_key_filter(data->name(), tablename)),
+            changes(shared_change_hub(data->name())),
+            ttl(shared_ttl(data->name(), tablename)) {}
+
+        ~table_impl() {
+            try {
+                for (auto& view : view_cursors) jet::close_table(session->id(), view.second);
+                close_key_cursor();
+                jet::close_table(session->id(), table_id);
+            } catch (jet::error&) {
+                // TODO: log it?
+            }
+        }
 
         auto id() const -> JET_TABLEID { return table_id; }
 
+        // Deletes expired records in transactions of up to
+        // records_per_transaction, until there are none left or slice_ms
+        // has passed. Returns how many it deleted.
+        auto sweep_expired(const string& fieldname, const TtlOptions& options) -> std::uint64_t {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.slice_ms);
+            auto per_transaction = std::max<unsigned long>(options.records_per_transaction, 1);
+            auto indexname = ttl_index_name(fieldname);
+            std::uint64_t deleted = 0;
+            table_action([&](){
+                auto plan = plan_erase();
+                for (auto more = true; more && std::chrono::steady_clock::now() < deadline;) {
+                    // the index leaves out records without an expiry
+                    auto now = vector<FieldValue>(1, datetime_type(datetime_now()));
+                    deleted += delete_batch(plan, indexname, vector<FieldValue>(), now, per_transaction, more);
+                }
+            });
+            return deleted;
+        }
+
     private:
+        auto table_columns() const -> const map<string, column>& {
+            if (columns.empty()) {
+                for (auto& info : jet::get_column_list(session->id(), table_id)) {
+                    columns.insert(std::make_pair(info.name, column { info.name, info.id, info.type, info.bits }));
+                }
+            }
+            return columns;
+        }
+
+        auto find_column(const string& fieldname) const -> const column& {
+            auto& all = table_columns();
+            auto it = all.find(fieldname);
+            if (it == all.end())
+                throw error("[table] no such field: " + fieldname);
+            return it->second;
+        }
+
+        auto long_value_column(const string& fieldname) const -> const column& {
+            auto& found = find_column(fieldname);
+            if (!is_long_value(found.type))
+                throw error("[table] not a long value field: " + fieldname);
+            return found;
+        }
+
+        void set_fields(const interface::Record& record) {
+            set_fields(table_id, record);
+        }
+
+        void set_fields(JET_TABLEID cursor, const interface::Record& record) {
+            record.foreach_field([&](const string& fieldname, const FieldValue& field){
+                auto& target = find_column(fieldname);
+                auto bytes = field_bytes(field);
+                // a zero length value must be flagged, or ESENT stores a null
+                JET_GRBIT bits = bytes.size == 0 ? JET_bitSetZeroLength : 0;
+                if (is_compressed(target)) bits |= compression_bits(bytes.data, bytes.size);
+                jet::set_column(session->id(), cursor, target.id, bytes.data, bytes.size, bits, nullptr);
+            });
+        }
+
+        // jet_action and jet_function for this table: write conflicts are
+        // counted against it and carry its name
+        void table_action(function< void() > action) const {
+            jato::table_action(data->name(), tablename, action);
+        }
+
+        template <typename T>
+        auto table_function(function< auto() -> T > fn) const -> T {
+            return jato::table_function<T>(data->name(), tablename, fn);
+        }
+
+        void insert(const interface::Record& record, function< void() > streams) {
+            table_action([&](){
+                insert_record(record, streams);
+            });
+        }
+
+        // the body of insert, leaving jet errors such as a duplicate key
+        // to the caller
+        void insert_record(const interface::Record& record, function< void() > streams) {
+            mark_key_filter_stale();
+            // the record, the views over it and its change event go together
+            auto views = current_views();
+            auto captured = changes->active();
+            auto grouped = !views->empty() || captured;
+            if (grouped) session->begin_transaction(0);
+            vector<char> bookmark;
+            try {
+                jet::prepare_update(session->id(), table_id, JET_prepInsert);
+                try {
+                    set_fields(record);
+                    streams();
+                    jet::update(session->id(), table_id, bookmark);
+                } catch (...) {
+                    jet::cancel_update(session->id(), table_id);
+                    throw;
+                }
+                count_in_views(*views, record, 1);
+                if (captured) {
+                    // read back, so that defaults and streamed long values are in it
+                    cursor_copy cursor(session->id(), table_id);
+                    jet::goto_bookmark(cursor.session, cursor.id, bookmark);
+                    publish_on_commit(change_kind::inserted, nullptr, read_whole_record(cursor.id));
+                }
+                if (grouped) session->commit_transaction(JET_bitCommitLazyFlush);
+            } catch (...) {
+                if (grouped) session->rollback();
+                throw;
+            }
+
+            // The key goes in once the insert commits. A filter enabled
+            // after that is built by a scan that sees the record.
+            auto state = filters;
+            session->at_transaction_end([state, bookmark](){
+                if (auto filter = state->current()) filter->add(bookmark);
+            });
+        }
+
+        // The primary key of a record to be written; it must have a value
+        // for each key field.
+        auto primary_key_of(const interface::Record& record, const string& origin) -> vector<FieldValue> {
+            auto& fieldnames = primary_key_fields();
+            if (fieldnames.empty())
+                throw error(origin + " " + tablename + " has no primary index");
+            vector<boost::optional<FieldValue>> found(fieldnames.size());
+            record.foreach_field([&](const string& fieldname, const FieldValue& field){
+                for (std::size_t i = 0; i < fieldnames.size(); ++i)
+                    if (fieldnames[i] == fieldname) found[i] = field;
+            });
+            vector<FieldValue> key;
+            for (std::size_t i = 0; i < found.size(); ++i) {
+                if (!found[i]) throw error(origin + " the record has no value for key field " + fieldnames[i]);
+                key.push_back(*found[i]);
+            }
+            return key;
+        }
+
+        // A merged record must keep the key it was merged for: the key
+        // fields it has must match key, and one to insert needs them all.
+        void check_merged_key(const vector<FieldValue>& key, const interface::Record& merged, bool inserting) {
+            auto& fieldnames = primary_key_fields();
+            auto merged_key = inserting ? primary_key_of(merged, "[merge]") : key;
+            if (!inserting) {
+                merged.foreach_field([&](const string& fieldname, const FieldValue& field){
+                    for (std::size_t i = 0; i < fieldnames.size() && i < merged_key.size(); ++i)
+                        if (fieldnames[i] == fieldname) merged_key[i] = field;
+                });
+            }
+            if (merged_key.size() > key.size()) merged_key.erase(merged_key.begin() + key.size(), merged_key.end());
+            if (normalized_key(merged_key) != normalized_key(key))
+                throw error("[merge] the merged record changes the primary key of " + tablename);
+        }
+
+        // empty until the table has a primary index
+        auto primary_key_fields() -> const vector<string>& {
+            if (key_fields.empty()) {
+                for (auto& index : indexes())
+                    if (index.flags & primary_index) key_fields = index.fields;
+            }
+            return key_fields;
+        }
+
+        // One seek on the primary index, then change is called with the
+        // record found (if the caller wants it) and the record it returns
+        // replaces the fields it has or is inserted. A key that another
+        // session inserted after the seek sends the write round again,
+        // once, in a new transaction.
+        auto write_by_key(const vector<FieldValue>& key, bool wants_current,
+            function< auto(record_ptr current) -> const interface::Record* > change) -> boost::optional<change_kind> {
+            boost::optional<change_kind> written;
+            table_action([&](){
+                for (auto attempt = 0;; ++attempt) {
+                    session->begin_transaction(0);
+                    try {
+                        written = write_once(key, wants_current, change);
+                        session->commit_transaction(JET_bitCommitLazyFlush);
+                        return;
+                    } catch (jet::error& ex) {
+                        session->rollback();
+                        if (ex.code() != JET_errKeyDuplicate) throw;
+                        // an outer transaction keeps seeing the key as missing
+                        if (attempt > 0 || session->transaction_depth() > 0)
+                            throw conflict_error("[write_by_key] another session inserted the key", string());
+                    } catch (...) {
+                        session->rollback();
+                        throw;
+                    }
+                }
+            });
+            return written;
+        }
+
+        auto write_once(const vector<FieldValue>& key, bool wants_current,
+            function< auto(record_ptr current) -> const interface::Record* >& change) -> boost::optional<change_kind> {
+            auto views = current_views();
+            auto captured = changes->active();
+            auto keeps_images = !views->empty() || captured;
+
+            cursor_copy cursor(session->id(), table_id);
+            jet::set_current_index(cursor.session, cursor.id, string());
+            make_index_key(cursor.session, cursor.id, key, 0);
+            auto found = jet::seek(cursor.session, cursor.id, JET_bitSeekEQ);
+            record_ptr current;
+            std::shared_ptr<const interface::Record> before;
+            if (found && (wants_current || keeps_images)) {
+                vector<const column*> retrieved;
+                for (auto& column : table_columns()) retrieved.push_back(&column.second);
+                vector<char> buffer(4096);
+                current = read_record(cursor.id, retrieved, buffer);
+                if (keeps_images) before = std::make_shared<record_impl>(static_cast<const record_impl&>(*current));
+            }
+
+            auto replacement = change(move(current));
+            if (!replacement) return boost::none;
+            if (!found) {
+                insert_record(*replacement, [](){});
+                return change_kind::inserted;
+            }
+
+            jet::prepare_update(cursor.session, cursor.id, JET_prepReplace);
+            try {
+                set_fields(cursor.id, *replacement);
+                jet::update(cursor.session, cursor.id);
+            } catch (...) {
+                jet::cancel_update(cursor.session, cursor.id);
+                throw;
+            }
+            invalidate_cached(key);
+            if (keeps_images) {
+                auto after = read_whole_record(cursor.id);
+                count_in_views(*views, *before, -1);
+                count_in_views(*views, *after, 1);
+                if (captured) publish_on_commit(change_kind::updated, before, after);
+            }
+            return change_kind::updated;
+        }
+
+        auto expiry() -> expiry_check {
+            expiry_check check = { nullptr, 0 };
+            auto fieldname = ttl->field();
+            if (fieldname.empty()) return check;
+            check.target = &find_column(fieldname);
+            check.now = datetime_now();
+            return check;
+        }
+
+        auto expired(const expiry_check& check, JET_TABLEID cursor) -> bool {
+            if (!check.target) return false;
+            double value = 0;
+            auto result = jet::retrieve_column(session->id(), cursor, check.target->id, &value, sizeof(value), 0, nullptr);
+            return std::get<0>(result) != JET_wrnColumnNull && value <= check.now;
+        }
+
+        auto expired(const expiry_check& check, const interface::Record& record) -> bool {
+            auto past = false;
+            if (check.target) {
+                record.foreach_field([&](const string& fieldname, const FieldValue& field){
+                    if (fieldname == check.target->name) past = boost::get<datetime_type>(field).value <= check.now;
+                });
+            }
+            return past;
+        }
+
+        // what deleting a record has to keep up to date, worked out once
+        // for a run of deletes
+        struct erase_plan {
+            view_list views;
+            vector<string> primary_fields;      // empty unless rows are cached
+            bool captured;
+        };
+
+        auto plan_erase() -> erase_plan {
+            erase_plan plan = { current_views(), vector<string>(), changes->active() };
+            if (cache->enabled()) plan.primary_fields = primary_key_fields();
+            return plan;
+        }
+
+        // Deletes the record under cursor in the session's transaction and
+        // takes it out of the views, the row cache and the change feeds.
+        // The key filter keeps its key, which only costs a seek.
+        void erase_current(JET_TABLEID cursor, const erase_plan& plan) {
+            std::shared_ptr<const interface::Record> before;
+            if (!plan.views->empty() || !plan.primary_fields.empty() || plan.captured)
+                before = read_whole_record(cursor);
+            jet::delete_record(session->id(), cursor);
+            if (!before) return;
+            count_in_views(*plan.views, *before, -1);
+            if (!plan.primary_fields.empty()) {
+                vector<FieldValue> key;
+                for (auto& fieldname : plan.primary_fields) key.push_back(before->get_field(fieldname));
+                invalidate_cached(key);
+            }
+            if (plan.captured) publish_on_commit(change_kind::deleted, before, nullptr);
+        }
+
+        // Deletes up to limit records from the start of a key range in one
+        // transaction, leaving more false once the range is empty.
+        auto delete_batch(const erase_plan& plan, const string& indexname, const vector<FieldValue>& lo,
+            const vector<FieldValue>& hi, unsigned long limit, bool& more) -> unsigned long {
+            unsigned long batch = 0;
+            session->begin_transaction(0);
+            try {
+                cursor_copy cursor(session->id(), table_id);
+                more = enter_range(cursor, indexname, lo, hi);
+                for (; more && batch < limit; ++batch) {
+                    erase_current(cursor.id, plan);
+                    more = jet::move(cursor.session, cursor.id, JET_MoveNext, 0);
+                }
+                session->commit_transaction(JET_bitCommitLazyFlush);
+            } catch (...) {
+                session->rollback();
+                throw;
+            }
+            return batch;
+        }
+
+        // a truncated table no longer counts toward its views; runs in
+        // the truncating transaction
+        void empty_views(const vector<view_def>& views) {
+            for (auto& view : views) {
+                auto cursor = view_cursor(view.spec.name);
+                for (auto more = jet::move(session->id(), cursor, JET_MoveFirst, 0); more;) {
+                    jet::delete_record(session->id(), cursor);
+                    more = jet::move(session->id(), cursor, JET_MoveNext, 0);
+                }
+            }
+        }
+
+        auto read_whole_record(JET_TABLEID cursor) -> std::shared_ptr<const interface::Record> {
+            vector<const column*> retrieved;
+            for (auto& column : table_columns()) retrieved.push_back(&column.second);
+            vector<char> buffer(4096);
+            return std::shared_ptr<const interface::Record>(read_record(cursor, retrieved, buffer));
+        }
+
+        void publish_on_commit(change_kind kind, std::shared_ptr<const interface::Record> before,
+            std::shared_ptr<const interface::Record> after) {
+            auto hub = changes;
+            ChangeEvent event = { 0, tablename, kind, before, after };
+            session->at_commit(hub->commit_gate(), [hub, event](){ hub->publish(event); });
+            session->at_transaction_end([hub](){ hub->deliver(); });
+        }
+
+        // the views to keep up to date in a write; see views_for_write
+        auto current_views() -> view_list {
+            return views_for_write(*session, instance, data->name(), tablename);
+        }
+
+        auto view_cursor(const string& viewname) -> JET_TABLEID {
+            auto it = view_cursors.find(viewname);
+            if (it != view_cursors.end()) return it->second;
+            auto cursor = jet::open_table(session->id(), data->id(), viewname);
+            view_cursors.insert(std::make_pair(viewname, cursor));
+            return cursor;
+        }
+
+        // counts a record into (sign 1) or out of (sign -1) each view
+        void count_in_views(const vector<view_def>& views, const interface::Record& record, std::int64_t sign) {
+            vector<FieldValue> group;
+            vector<std::int64_t> sums;
+            for (auto& view : views) {
+                if (!view_group(record, view.spec, group, sums)) continue;
+                for (auto& sum : sums) sum *= sign;
+                apply_view_delta(instance, *session, data->name(), view_cursor(view.spec.name), view, group, sign, sums);
+            }
+        }
+
+        // passes an increment of the record on cursor on to the views summing fieldname
+        void add_to_view_sums(const cursor_copy& cursor, const string& fieldname, std::int64_t delta) {
+            auto views = current_views();
+            vector<char> buffer(256);
+            vector<FieldValue> group;
+            vector<std::int64_t> sums;
+            for (auto& view : *views) {
+                auto summed = std::find(view.spec.sums.begin(), view.spec.sums.end(), fieldname);
+                if (summed == view.spec.sums.end()) continue;
+                vector<const column*> retrieved;
+                for (auto& groupname : view.spec.group_by) retrieved.push_back(&find_column(groupname));
+                if (!view_group(*read_record(cursor.id, retrieved, buffer), view.spec, group, sums)) continue;
+                sums[summed - view.spec.sums.begin()] = delta;
+                apply_view_delta(instance, *session, data->name(), view_cursor(view.spec.name), view, group, 0, sums);
+            }
+        }
+
+        void mark_key_filter_stale() {
+            jato::mark_key_filter_stale(*filters, instance, data->name(), tablename);
+        }
+
+        // Scans the records whose bookmarks fall in [from, to); a null bound
+        // leaves that end of the table open.
+        void scan_range(const vector<string>& fieldnames, std::size_t batch_size,
+            const vector<char>* from, const vector<char>* to,
+            function< auto(const RecordBatch& batch) -> bool > action) {
+            if (batch_size == 0)
+                throw error("[scan] batch size must be positive");
+
+            RecordBatch batch;
+            batch.rows = 0;
+            vector<JET_RETRIEVECOLUMN> retrieve(fieldnames.size());
+            vector<JET_COLUMNID> ids;
+            for (auto& fieldname : fieldnames) {
+                auto& found = find_column(fieldname);
+                batch.columns.push_back(make_column_vector(found, batch_size));
+                ids.push_back(found.id);
+            }
+
+            check_snapshot();
+            auto more = true;
+            if (from)
+                jet::goto_bookmark(session->id(), table_id, *from);
+            else
+                more = jet::move(session->id(), table_id, JET_MoveFirst, 0);
+
+            vector<char> bookmark;
+            for (; more; more = jet::move(session->id(), table_id, JET_MoveNext, 0)) {
+                if (to) {
+                    jet::get_bookmark(session->id(), table_id, bookmark);
+                    if (!bookmark_less(bookmark, *to)) break;
+                }
+
+                auto row = batch.rows;
+                for (std::size_t i = 0; i < retrieve.size(); ++i) {
+                    retrieve[i] = JET_RETRIEVECOLUMN();
+                    retrieve[i].columnid = ids[i];
+                    retrieve[i].itagSequence = 1;
+                    bind_row(retrieve[i], batch.columns[i], row);
+                }
+                jet::retrieve_columns(session->id(), table_id, retrieve.data(), static_cast<unsigned long>(retrieve.size()));
+                for (std::size_t i = 0; i < retrieve.size(); ++i) {
+                    if (retrieve[i].err == JET_wrnColumnNull)
+                        batch.columns[i].nulls[row / 64] |= std::uint64_t(1) << (row % 64);
+                }
+
+                if (++batch.rows == batch_size) {
+                    check_snapshot();
+                    if (!action(batch)) return;
+                    batch.rows = 0;
+                    for (auto& column : batch.columns)
+                        std::fill(column.nulls.begin(), column.nulls.end(), 0);
+                }
+            }
+            if (batch.rows > 0) {
+                check_snapshot();
+                action(batch);
+            }
+        }
+
+        // Bookmarks at evenly spaced record positions, in index order and
+        // without duplicates, so small tables get fewer partitions.
+        auto partition_bounds(std::size_t partitions) -> vector<vector<char>> {
+            vector<vector<char>> bounds;
+            cursor_copy cursor(session->id(), table_id);
+            if (!jet::move(cursor.session, cursor.id, JET_MoveFirst, 0)) return bounds;
+            for (std::size_t k = 1; k < partitions; ++k) {
+                jet::goto_position(cursor.session, cursor.id,
+                    static_cast<unsigned long>(k), static_cast<unsigned long>(partitions));
+                auto bookmark = jet::get_bookmark(cursor.session, cursor.id);
+                if (bounds.empty() || bookmark_less(bounds.back(), bookmark))
+                    bounds.push_back(bookmark);
+            }
+            return bounds;
+        }
+
+        // ESENT sessions must not be shared between threads, so a task opens
+        // the table again on the session of its scheduler slot.
+        void with_worker_cursor(worker_context& worker, function< void(table_impl& cursor) > action) {
+            auto worker_session = worker.session(instance);
+            auto worker_data = std::make_shared<jet::db>(worker_session, data->name());
+            auto worker_table_id = jet::open_table(worker_session->id(), worker_data->id(), tablename);
+            table_impl cursor(instance, worker_session, worker_data, tablename, worker_table_id, nullptr);
+            action(cursor);
+        }
+
+        // Drops the cached row with the given primary key once the
+        // outermost transaction ends. Inserts need no invalidation: only
+        // rows that exist are cached and primary keys are unique.
+        void invalidate_cached(const vector<FieldValue>& key) {
+            if (!cache->enabled()) return;
+            auto normalized = normalized_key(key);
+            auto cache_key = string(normalized.begin(), normalized.end());
+            auto target = cache;
+            session->at_transaction_end([target, cache_key](){ target->invalidate(cache_key); });
+        }
+
+        // The primary index's normalized form of key, which is the bookmark
+        // of its record. It is built on a cursor of its own, duplicated on
+        // first use, so that it moves no other cursor.
+        auto normalized_key(const vector<FieldValue>& key) -> vector<char> {
+            if (key_cursor == 0) {
+                key_cursor = jet::dup_cursor(session->id(), table_id, 0);
+                jet::set_current_index(session->id(), key_cursor, string());
+            }
+            make_index_key(session->id(), key_cursor, key, 0);
+            vector<char> normalized;
+            jet::retrieve_key(session->id(), key_cursor, normalized, JET_bitRetrieveCopy);
+            return normalized;
+        }
+
+        void close_key_cursor() {
+            if (key_cursor == 0) return;
+            auto cursor = key_cursor;
+            key_cursor = 0;
+            jet::close_table(session->id(), cursor);
+        }
+
+        void check_snapshot() {
+            if (snapshot) jato::check_snapshot(*snapshot, tablename);
+        }
+
+        auto read_record(const vector<const column*>& retrieved, vector<char>& buffer) -> record_ptr {
+            return read_record(table_id, retrieved, buffer);
+        }
+
+        auto read_record(JET_TABLEID cursor, const vector<const column*>& retrieved, vector<char>& buffer) -> record_ptr {
+            auto record = make_record();
+            for (auto column : retrieved) {
+                auto result = jet::retrieve_column(session->id(), cursor, column->id,
+                    buffer.data(), static_cast<unsigned long>(buffer.size()), 0, nullptr);
+                if (std::get<0>(result) == JET_wrnColumnNull) continue;
+                if (std::get<0>(result) == JET_wrnBufferTruncated) {
+                    buffer.resize(std::get<1>(result));
+                    result = jet::retrieve_column(session->id(), cursor, column->id,
+                        buffer.data(), static_cast<unsigned long>(buffer.size()), 0, nullptr);
+                }
+                record->set_field(column->name, make_field(column->type, buffer.data(), std::get<1>(result)));
+            }
+            return record;
+        }
+
+        // Runs action over up to chunk records after position (from the
+        // first record if it is empty) in one transaction, leaving the
+        // bookmark of the last record done in last. True once the walk
+        // is over.
+        auto walk_chunk(const vector<const column*>& retrieved, const vector<char>& position,
+            unsigned long chunk, vector<char>& last, function< auto(record_ptr) -> bool > action) -> bool {
+            vector<char> buffer(4096);
+            auto check = expiry();
+            auto finished = false;
+            // positioned inside the transaction, so that the chunk's first
+            // record is read from the same snapshot as the rest
+            session->begin_transaction(0);
+            try {
+                auto more = true;
+                if (position.empty()) {
+                    more = jet::move(session->id(), table_id, JET_MoveFirst, 0);
+                } else {
+                    // the position is a bookmark, the record's key in the primary
+                    // index; seeking past it works even if the record is gone
+                    jet::set_current_index(session->id(), table_id, string());
+                    jet::make_key(session->id(), table_id, position.data(), static_cast<unsigned long>(position.size()), JET_bitNormalizedKey);
+                    more = jet::seek(session->id(), table_id, JET_bitSeekGT);
+                }
+                finished = !more;
+                for (unsigned long done = 0; more && done < chunk; ++done) {
+                    auto go_on = expired(check, table_id) || action(read_record(retrieved, buffer));
+                    jet::get_bookmark(session->id(), table_id, last);
+                    if (!go_on) {
+                        finished = true;
+                        break;
+                    }
+                    more = jet::move(session->id(), table_id, JET_MoveNext, 0);
+                    finished = !more;
+                }
+                // on_commit reports the position as done, so it must survive a crash
+                session->commit_transaction(0);
+            } catch (...) {
+                session->rollback();
+                last.clear();
+                throw;
+            }
+            return finished;
+        }
+
+        void scan(const vector<const column*>& retrieved, function< auto(record_ptr) -> bool > action) {
+            vector<char> buffer(4096);
+            auto check = expiry();
+            for (auto more = jet::move(session->id(), table_id, JET_MoveFirst, 0); more;
+                more = jet::move(session->id(), table_id, JET_MoveNext, 0)) {
+                check_snapshot();
+                if (expired(check, table_id)) continue;
+                if (!action(read_record(retrieved, buffer))) break;
+            }
+        }
+
         jet::instance_ptr instance;
         jet::session_ptr session;
+        jet::db_ptr data;   // keeps the database open while the cursor is open
+        string tablename;
         JET_TABLEID table_id;
+        JET_TABLEID key_cursor;     // on the primary index, for normalized_key
+        JET_TABLEID reading_id;     // the cursor of an index range walk, for read_long_value; 0 for table_id
+        mutable map<string, column> columns;    // loaded on first use
+        vector<string> key_fields;              // of the primary index, loaded on first use
+        snapshot_state_ptr snapshot;    // null unless opened from a snapshot
+        std::shared_ptr<row_cache> cache;
+        std::shared_ptr<key_filter_state> filters;
+        map<string, JET_TABLEID> view_cursors;      // views over this table, opened on first write
+        std::shared_ptr<change_hub> changes;
+        std::shared_ptr<ttl_state> ttl;
     };
 
     auto make_table(jet::instance_ptr instance,
         jet::session_ptr session,
-        JET_TABLEID table_id
+        jet::db_ptr data,
+        const string& tablename,
+        JET_TABLEID table_id,
+        snapshot_state_ptr snapshot
     ) -> table_ptr {
-        return make_unique<table_impl>(instance, session, table_id);
+        return make_unique<table_impl>(instance, session, data, tablename, table_id, snapshot);
+    }
+
+    auto sweep_expired(jet::instance_ptr instance, jet::session_ptr session, jet::db_ptr data,
+        const string& tablename, const string& fieldname, const TtlOptions& options) -> std::uint64_t {
+        auto table_id = jet::open_table(session->id(), data->id(), tablename);
+        table_impl table(instance, session, data, tablename, table_id, nullptr);
+        return table.sweep_expired(fieldname, options);
     }
 
-}
\ No newline at end of file
+}
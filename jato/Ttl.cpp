@@ -0,0 +1,117 @@
+#include "internal.h"
+
+#include <chrono>
+#include <ctime>
+#include <utility>
+
+namespace jato {
+
+    namespace {
+
+        std::mutex states_lock;
+        std::map<std::pair<string, string>, std::shared_ptr<ttl_state>> states;
+
+        // days from 1970-01-01 to a proleptic Gregorian date
+        auto days_from_civil(long year, long month, long day) -> long {
+            year -= month <= 2 ? 1 : 0;
+            auto era = (year >= 0 ? year : year - 399) / 400;
+            auto year_of_era = year - era * 400;
+            auto day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+            auto day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+            return era * 146097 + day_of_era - 719468;
+        }
+
+        // OLE automation dates count days from 1899-12-30
+        const double unix_epoch_days = 25569.0;
+
+    }
+
+    ttl_state::ttl_state() : swept(0), sweeps(0), failures(0) {}
+
+    auto ttl_state::field() -> string {
+        std::lock_guard<std::mutex> guard(lock);
+        return expiry_field;
+    }
+
+    auto shared_ttl(const string& dbname, const string& tablename) -> std::shared_ptr<ttl_state> {
+        std::lock_guard<std::mutex> guard(states_lock);
+        auto& state = states[std::make_pair(dbname, tablename)];
+        if (!state) state = std::make_shared<ttl_state>();
+        return state;
+    }
+
+    void drop_ttl(const string& dbname, const string& tablename) {
+        std::lock_guard<std::mutex> guard(states_lock);
+        auto found = states.find(std::make_pair(dbname, tablename));
+        if (found == states.end()) return;
+        // cursors still holding the state stop hiding records too
+        std::lock_guard<std::mutex> state_guard(found->second->lock);
+        found->second->expiry_field.clear();
+        states.erase(found);
+    }
+
+    // OLE dates carry no time zone and are read as wall clock time, so
+    // now is taken in the local time zone
+    auto datetime_now() -> double {
+        using namespace std::chrono;
+        auto now = system_clock::now();
+        auto seconds = system_clock::to_time_t(now);
+        auto ms = duration_cast<milliseconds>(now.time_since_epoch()).count() % 1000;
+        std::tm local;
+#ifdef _WIN32
+        localtime_s(&local, &seconds);
+#else
+        localtime_r(&seconds, &local);
+#endif
+        auto days = days_from_civil(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+        auto time_of_day = local.tm_hour * 3600.0 + local.tm_min * 60.0 + local.tm_sec + ms / 1000.0;
+        return unix_epoch_days + days + time_of_day / 86400.0;
+    }
+
+    auto ttl_index_name(const string& fieldname) -> string {
+        return "ttl_" + fieldname;
+    }
+
+    ttl_sweeper::ttl_sweeper(jet::instance_ptr instance, const string& dbname, const string& tablename,
+        const string& fieldname, const TtlOptions& options)
+        : instance(instance), dbname(dbname), tablename(tablename), fieldname(fieldname), options(options),
+        state(shared_ttl(dbname, tablename)), stopping(false) {
+        worker = std::thread([this](){ run(); });
+    }
+
+    ttl_sweeper::~ttl_sweeper() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    void ttl_sweeper::run() {
+        jet::session_ptr session;
+        jet::db_ptr data;
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping) {
+            guard.unlock();
+            try {
+                if (!session) {
+                    session = std::make_shared<jet::session>(instance);
+                    session->begin();
+                    data = std::make_shared<jet::db>(session, dbname);
+                }
+                state->swept += sweep_expired(instance, session, data, tablename, fieldname, options);
+                ++state->sweeps;
+            } catch (...) {
+                // conflicts and the like are left to the next sweep, but
+                // counted so that a sweeper that always fails shows up
+                ++state->failures;
+                session.reset();
+                data.reset();
+            }
+            guard.lock();
+            wake.wait_for(guard, std::chrono::milliseconds(options.interval_ms), [this](){ return stopping; });
+        }
+    }
+
+}
@@ -0,0 +1,443 @@
+#include "internal.h"
+
+#include <algorithm>
+
+namespace jato {
+
+    namespace {
+
+        const string view_table = "jato_views";
+
+        std::mutex views_lock;
+        std::map<std::pair<string, string>, view_list> views;
+
+        // the writes in progress to a base table, which create_view waits
+        // out before it reads the table, and holds off while it fills
+        struct view_writers {
+            std::mutex lock;
+            std::condition_variable changed;
+            std::size_t active = 0;
+            bool building = false;
+        };
+
+        std::map<std::pair<string, string>, std::shared_ptr<view_writers>> writers;
+
+        auto shared_writers(const string& dbname, const string& tablename) -> std::shared_ptr<view_writers> {
+            std::lock_guard<std::mutex> guard(views_lock);
+            auto& state = writers[std::make_pair(dbname, tablename)];
+            if (!state) state = std::make_shared<view_writers>();
+            return state;
+        }
+
+        // a write in progress, for as long as it is kept
+        class held_views {
+        public:
+            explicit held_views(std::shared_ptr<view_writers> state) : state(state) {
+                std::unique_lock<std::mutex> guard(state->lock);
+                state->changed.wait(guard, [&](){ return !state->building; });
+                ++state->active;
+            }
+
+            held_views(const held_views&) = delete;
+            auto operator=(const held_views&) -> held_views& = delete;
+
+            ~held_views() {
+                std::lock_guard<std::mutex> guard(state->lock);
+                if (--state->active == 0) state->changed.notify_all();
+            }
+
+            view_list views;
+
+        private:
+            std::shared_ptr<view_writers> state;
+        };
+
+        // create_view's hold on a base table: writes wait until it is released
+        class building_view {
+        public:
+            explicit building_view(std::shared_ptr<view_writers> state) : state(state) {
+                std::unique_lock<std::mutex> guard(state->lock);
+                state->changed.wait(guard, [&](){ return !state->building; });
+                state->building = true;
+                state->changed.wait(guard, [&](){ return state->active == 0; });
+            }
+
+            building_view(const building_view&) = delete;
+            auto operator=(const building_view&) -> building_view& = delete;
+
+            ~building_view() {
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->building = false;
+                state->changed.notify_all();
+            }
+
+        private:
+            std::shared_ptr<view_writers> state;
+        };
+
+        // opens the side table, creating it if create is set; 0 if it does not exist
+        auto open_view_table(JET_SESID session, JET_DBID db, bool create) -> JET_TABLEID {
+            try {
+                return jet::open_table(session, db, view_table);
+            } catch (jet::error& ex) {
+                if (ex.code() != JET_errObjectNotFound) throw;
+            }
+            if (!create) return 0;
+
+            auto table = jet::create_table(session, db, view_table);
+            JET_COLUMNDEF name_def = { sizeof(JET_COLUMNDEF), 0, text_type::type, 0, 0, 0, 0, 0, 0 };
+            JET_COLUMNDEF list_def = { sizeof(JET_COLUMNDEF), 0, long_text_type::type, 0, 0, 0, 0, 0, 0 };
+            jet::add_column(session, table, "view_name", &name_def, nullptr, 0);
+            jet::add_column(session, table, "base_table", &name_def, nullptr, 0);
+            jet::add_column(session, table, "group_by", &list_def, nullptr, 0);
+            jet::add_column(session, table, "sums", &list_def, nullptr, 0);
+            jet::create_index(session, table, "by_view", JET_bitIndexPrimary, string("+view_name\0\0", 12), 100);
+            return table;
+        }
+
+        auto column_id(JET_SESID session, JET_TABLEID table, const string& columnname) -> JET_COLUMNID {
+            return jet::get_column_info(session, table, columnname).columnid;
+        }
+
+        auto read_text(JET_SESID session, JET_TABLEID table, const string& columnname) -> string {
+            auto id = column_id(session, table, columnname);
+            auto size = std::get<1>(jet::retrieve_column(session, table, id, nullptr, 0, 0, nullptr));
+            string text(size, '\0');
+            if (size != 0) jet::retrieve_column(session, table, id, &text[0], size, 0, nullptr);
+            return text;
+        }
+
+        void write_text(JET_SESID session, JET_TABLEID table, const string& columnname, const string& text) {
+            jet::set_column(session, table, column_id(session, table, columnname),
+                text.data(), static_cast<unsigned long>(text.size()), text.empty() ? JET_bitSetZeroLength : 0, nullptr);
+        }
+
+        // field names end with a nul each
+        auto join_names(const vector<string>& names) -> string {
+            string joined;
+            for (auto& name : names) {
+                joined += name;
+                joined += '\0';
+            }
+            return joined;
+        }
+
+        auto split_names(const string& joined) -> vector<string> {
+            vector<string> names;
+            for (std::size_t start = 0; start < joined.size();) {
+                auto end = joined.find('\0', start);
+                if (end == string::npos) end = joined.size();
+                names.push_back(joined.substr(start, end - start));
+                start = end + 1;
+            }
+            return names;
+        }
+
+        auto sum_column(const string& fieldname) -> string {
+            return "sum_" + fieldname;
+        }
+
+        // the view's column ids, which stay put while its table exists
+        void resolve_columns(JET_SESID session, JET_DBID db, view_def& view) {
+            auto table = jet::open_table(session, db, view.spec.name);
+            try {
+                for (auto& fieldname : view.spec.group_by) view.group_ids.push_back(column_id(session, table, fieldname));
+                view.count_id = column_id(session, table, "count");
+                for (auto& fieldname : view.spec.sums) view.sum_ids.push_back(column_id(session, table, sum_column(fieldname)));
+            } catch (...) {
+                JetCloseTable(session, table);
+                throw;
+            }
+            jet::close_table(session, table);
+        }
+
+        auto load_views(JET_SESID session, JET_DBID db, const string& tablename) -> vector<view_def> {
+            vector<view_def> loaded;
+            auto table = open_view_table(session, db, false);
+            if (table == 0) return loaded;
+            try {
+                for (auto more = jet::move(session, table, JET_MoveFirst, 0); more;
+                    more = jet::move(session, table, JET_MoveNext, 0)) {
+                    if (read_text(session, table, "base_table") != tablename) continue;
+                    view_def view;
+                    view.base = tablename;
+                    view.spec.name = read_text(session, table, "view_name");
+                    view.spec.group_by = split_names(read_text(session, table, "group_by"));
+                    view.spec.sums = split_names(read_text(session, table, "sums"));
+                    loaded.push_back(view);
+                }
+            } catch (...) {
+                JetCloseTable(session, table);
+                throw;
+            }
+            jet::close_table(session, table);
+            for (auto& view : loaded) resolve_columns(session, db, view);
+            return loaded;
+        }
+
+        void forget_views(const string& dbname, const string& tablename) {
+            std::lock_guard<std::mutex> guard(views_lock);
+            views.erase(std::make_pair(dbname, tablename));
+        }
+
+        void check_view(const vector<FieldDescriptor>& fields, const ViewSpec& spec) {
+            if (spec.name.empty() || spec.group_by.empty())
+                throw error("[create_view] a view needs a name and at least one group field");
+            auto type_of = [&](const string& fieldname) -> field_type {
+                auto it = std::find_if(fields.begin(), fields.end(),
+                    [&](const FieldDescriptor& field) { return field.name == fieldname; });
+                if (it == fields.end()) throw error("[create_view] no such field: " + fieldname);
+                return it->type;
+            };
+            for (auto& fieldname : spec.group_by) {
+                if (is_long_value(type_of(fieldname)))
+                    throw error("[create_view] cannot group by a long value field: " + fieldname);
+            }
+            for (auto it = spec.sums.begin(); it != spec.sums.end(); ++it) {
+                auto& fieldname = *it;
+                if (std::find(spec.sums.begin(), it, fieldname) != it)
+                    throw error("[create_view] field is summed twice: " + fieldname);
+                auto type = type_of(fieldname);
+                if (type != long_type::type && type != long_long_type::type && type != currency_type::type)
+                    throw error("[create_view] only long, long long and currency fields can be summed: " + fieldname);
+            }
+        }
+
+        auto sum_value(const FieldValue& value) -> std::int64_t {
+            switch (field_type_of(value)) {
+            case long_type::type: return boost::get<long_type>(value).value;
+            case long_long_type::type: return boost::get<long_long_type>(value).value;
+            case currency_type::type: return boost::get<currency_type>(value).value;
+            default: return 0;
+            }
+        }
+
+        void insert_group(JET_SESID session, JET_TABLEID table, const view_def& view, const vector<FieldValue>& group,
+            std::int64_t count, const vector<std::int64_t>& sums, vector<char>& bookmark) {
+            jet::prepare_update(session, table, JET_prepInsert);
+            try {
+                for (std::size_t i = 0; i < group.size(); ++i) {
+                    auto bytes = field_bytes(group[i]);
+                    jet::set_column(session, table, view.group_ids[i], bytes.data, bytes.size,
+                        bytes.size == 0 ? JET_bitSetZeroLength : 0, nullptr);
+                }
+                jet::set_column(session, table, view.count_id, &count, sizeof(count), 0, nullptr);
+                for (std::size_t i = 0; i < sums.size(); ++i)
+                    jet::set_column(session, table, view.sum_ids[i], &sums[i], sizeof(sums[i]), 0, nullptr);
+                jet::update(session, table, bookmark);
+            } catch (...) {
+                jet::cancel_update(session, table);
+                throw;
+            }
+        }
+
+    }
+
+    auto view_group(const interface::Record& record, const ViewSpec& spec,
+        vector<FieldValue>& group, vector<std::int64_t>& sums) -> bool {
+        vector<boost::optional<FieldValue>> found(spec.group_by.size());
+        sums.assign(spec.sums.size(), 0);
+        record.foreach_field([&](const string& fieldname, const FieldValue& field){
+            for (std::size_t i = 0; i < spec.group_by.size(); ++i)
+                if (spec.group_by[i] == fieldname) found[i] = field;
+            for (std::size_t i = 0; i < spec.sums.size(); ++i)
+                if (spec.sums[i] == fieldname) sums[i] = sum_value(field);
+        });
+        group.clear();
+        for (auto& field : found) {
+            if (!field) return false;
+            group.push_back(*field);
+        }
+        return true;
+    }
+
+    auto table_views(jet::instance_ptr instance, const string& dbname, const string& tablename) -> view_list {
+        auto key = std::make_pair(dbname, tablename);
+        {
+            std::lock_guard<std::mutex> guard(views_lock);
+            auto it = views.find(key);
+            if (it != views.end()) return it->second;
+        }
+        // outside any caller's transaction, whose snapshot could predate a view
+        auto reader = std::make_shared<jet::session>(instance);
+        reader->begin();
+        auto reader_data = std::make_shared<jet::db>(reader, dbname);
+        auto loaded = std::make_shared<const vector<view_def>>(load_views(reader->id(), reader_data->id(), tablename));
+        std::lock_guard<std::mutex> guard(views_lock);
+        return views.insert(std::make_pair(key, loaded)).first->second;
+    }
+
+    auto views_for_write(jet::session& session, jet::instance_ptr instance, const string& dbname, const string& tablename) -> view_list {
+        auto held = std::make_shared<held_views>(shared_writers(dbname, tablename));
+        held->views = table_views(instance, dbname, tablename);
+        if (session.transaction_depth() > 0) session.at_transaction_end([held](){});
+        return view_list(held, held->views.get());
+    }
+
+    void create_view(jet::session& session, JET_DBID db, const string& dbname,
+        interface::Table& base, const string& basename, const ViewSpec& spec) {
+        if (session.transaction_depth() != 0)
+            throw error("[create_view] cannot create a view inside a transaction");
+        auto fields = base.fields();
+        check_view(fields, spec);
+        auto sid = session.id();
+
+        // the fill's snapshot then holds every committed write, and later
+        // writes see the new view
+        building_view building(shared_writers(dbname, basename));
+
+        session.begin_transaction(0);
+        try {
+            // escrow columns are fixed with a default to apply deltas to
+            std::int64_t zero = 0;
+            auto table = jet::create_table(sid, db, spec.name);
+            try {
+                string key;
+                for (auto& fieldname : spec.group_by) {
+                    auto field = *std::find_if(fields.begin(), fields.end(),
+                        [&](const FieldDescriptor& f) { return f.name == fieldname; });
+                    JET_COLUMNDEF column_def = { sizeof(JET_COLUMNDEF), 0, field.type, 0, 0, 0, 0, 0, 0 };
+                    jet::add_column(sid, table, fieldname, &column_def, nullptr, 0);
+                    key += '+' + fieldname + '\0';
+                }
+                key += '\0';
+                JET_COLUMNDEF count_def = { sizeof(JET_COLUMNDEF), 0, long_long_type::type, 0, 0, 0, 0, 0,
+                    JET_bitColumnFixed | JET_bitColumnEscrowUpdate | JET_bitColumnDeleteOnZero };
+                jet::add_column(sid, table, "count", &count_def, &zero, sizeof(zero));
+                for (auto& fieldname : spec.sums) {
+                    JET_COLUMNDEF sum_def = { sizeof(JET_COLUMNDEF), 0, long_long_type::type, 0, 0, 0, 0, 0,
+                        JET_bitColumnFixed | JET_bitColumnEscrowUpdate };
+                    jet::add_column(sid, table, sum_column(fieldname), &sum_def, &zero, sizeof(zero));
+                }
+                jet::create_index(sid, table, "by_group", JET_bitIndexPrimary | JET_bitIndexUnique, key, 100);
+
+                view_def view;
+                view.base = basename;
+                view.spec = spec;
+                jet::close_table(sid, table);
+                table = 0;
+                resolve_columns(sid, db, view);
+
+                // totals of the records already there, grouped as by_group
+                // will, by normalized key: text that differs only in case is
+                // one group
+                table = jet::open_table(sid, db, spec.name);
+                vector<string> fieldnames(spec.group_by);
+                fieldnames.insert(fieldnames.end(), spec.sums.begin(), spec.sums.end());
+                std::map<string, std::pair<vector<FieldValue>, vector<std::int64_t>>> totals;
+                vector<FieldValue> group;
+                vector<std::int64_t> sums;
+                base.foreach_record(fieldnames, [&](record_ptr record) {
+                    if (!view_group(*record, spec, group, sums)) return true;
+                    make_index_key(sid, table, group, 0);
+                    vector<char> normalized;
+                    jet::retrieve_key(sid, table, normalized, JET_bitRetrieveCopy);
+                    auto& total = totals[string(normalized.begin(), normalized.end())];
+                    if (total.second.empty()) {
+                        total.first = group;
+                        total.second.assign(spec.sums.size() + 1, 0);
+                    }
+                    ++total.second[0];
+                    for (std::size_t i = 0; i < sums.size(); ++i) total.second[i + 1] += sums[i];
+                    return true;
+                });
+
+                vector<char> bookmark;
+                for (auto& total : totals) {
+                    insert_group(sid, table, view, total.second.first, total.second.second[0],
+                        vector<std::int64_t>(total.second.second.begin() + 1, total.second.second.end()), bookmark);
+                }
+                jet::close_table(sid, table);
+                table = 0;
+
+                auto definitions = open_view_table(sid, db, true);
+                try {
+                    jet::prepare_update(sid, definitions, JET_prepInsert);
+                    write_text(sid, definitions, "view_name", spec.name);
+                    write_text(sid, definitions, "base_table", basename);
+                    write_text(sid, definitions, "group_by", join_names(spec.group_by));
+                    write_text(sid, definitions, "sums", join_names(spec.sums));
+                    jet::update(sid, definitions);
+                } catch (...) {
+                    jet::cancel_update(sid, definitions);
+                    JetCloseTable(sid, definitions);
+                    throw;
+                }
+                jet::close_table(sid, definitions);
+            } catch (...) {
+                if (table != 0) JetCloseTable(sid, table);
+                throw;
+            }
+            session.commit_transaction(0);
+        } catch (...) {
+            session.rollback();
+            throw;
+        }
+        forget_views(dbname, basename);
+    }
+
+    void drop_views(JET_SESID session, JET_DBID db, const string& dbname, const string& tablename) {
+        forget_views(dbname, tablename);
+        auto table = open_view_table(session, db, false);
+        if (table == 0) return;
+        try {
+            for (auto more = jet::move(session, table, JET_MoveFirst, 0); more;
+                more = jet::move(session, table, JET_MoveNext, 0)) {
+                auto base = read_text(session, table, "base_table");
+                if (base != tablename && read_text(session, table, "view_name") != tablename) continue;
+                forget_views(dbname, base);
+                jet::delete_record(session, table);
+            }
+        } catch (...) {
+            JetCloseTable(session, table);
+            throw;
+        }
+        jet::close_table(session, table);
+    }
+
+    void apply_view_delta(jet::instance_ptr instance, jet::session& session, const string& dbname,
+        JET_TABLEID cursor, const view_def& view, const vector<FieldValue>& group,
+        std::int64_t count_delta, const vector<std::int64_t>& sum_deltas) {
+        auto& name = view.spec.name;
+        auto sid = session.id();
+        auto cache = shared_row_cache(dbname, name);
+        if (cache->enabled()) {
+            // the view's cache is keyed, like every row cache, by normalized key
+            make_index_key(sid, cursor, group, 0);
+            vector<char> normalized;
+            jet::retrieve_key(sid, cursor, normalized, JET_bitRetrieveCopy);
+            auto cache_key = string(normalized.begin(), normalized.end());
+            session.at_transaction_end([cache, cache_key](){ cache->invalidate(cache_key); });
+        }
+
+        make_index_key(sid, cursor, group, 0);
+        if (jet::seek(sid, cursor, JET_bitSeekEQ)) {
+            for (std::size_t i = 0; i < sum_deltas.size(); ++i) {
+                auto delta = sum_deltas[i];
+                if (delta != 0) jet::escrow_update(sid, cursor, view.sum_ids[i], &delta, sizeof(delta), nullptr, 0, 0);
+            }
+            if (count_delta != 0) jet::escrow_update(sid, cursor, view.count_id, &count_delta, sizeof(count_delta), nullptr, 0, 0);
+            return;
+        }
+        if (count_delta <= 0)
+            throw error("[view] " + name + " has no group to take records from");
+
+        // a new group: the view's key filter learns of it as an insert would
+        auto filters = shared_key_filter(dbname, name);
+        mark_key_filter_stale(*filters, instance, dbname, name);
+        vector<char> bookmark;
+        try {
+            insert_group(sid, cursor, view, group, count_delta, sum_deltas, bookmark);
+        } catch (jet::error& ex) {
+            // Another session committed the group after this transaction
+            // began, so it cannot be seen here; only a fresh transaction
+            // can add to it.
+            if (ex.code() != JET_errKeyDuplicate) throw;
+            throw conflict_error("[view] another session added the group to " + name, string());
+        }
+        session.at_transaction_end([filters, bookmark](){
+            if (auto filter = filters->current()) filter->add(bookmark);
+        });
+    }
+
+}
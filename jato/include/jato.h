@@ -3,12 +3,16 @@
 #include <array>
 #include <filesystem>
 #include <functional>
+#include <future>
+#include <iosfwd>
 #include <memory>
 #include <stdexcept>
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <boost/optional.hpp>
 #include <boost/variant.hpp>
 #include <boost/uuid/uuid.hpp>
 
@@ -27,11 +31,53 @@ namespace jato {
         explicit error(const char* what) : runtime_error(what) {}
     };
 
+    // Another session wrote the same record first. Rolling back the
+    // outermost transaction and running it again can succeed.
+    class conflict_error : public error {
+    public:
+        conflict_error(const string& what, const string& table) : error(what), tablename(table) {}
+
+        auto table() const -> const string& { return tablename; }
+
+    private:
+        string tablename;
+    };
+
+    // A transaction changed more records than the version store can hold.
+    // Committing in smaller pieces can succeed.
+    class version_store_error : public error {
+    public:
+        explicit version_store_error(const string& what) : error(what) {}
+    };
+
     using field_type = unsigned long;
+    using field_flags = unsigned long;
+
+    // long values are compressed by the engine and decompressed on read
+    const field_flags compressed_field = 0x1;
+
+    // long_type or long_long_type counters, starting at zero, that concurrent
+    // sessions can increment without conflicting with each other
+    const field_flags escrow_field = 0x2;
+
+    using index_flags = unsigned long;
+
+    // the clustered index; it can only be created while the table is empty
+    const index_flags primary_index = 0x1;
+    const index_flags unique_index = 0x2;
+    // leaves out records whose indexed fields are all null
+    const index_flags sparse_index = 0x4;
 
     struct FieldDescriptor {
         string name;
         field_type type;
+        field_flags flags;
+    };
+
+    struct IndexDescriptor {
+        string name;
+        vector<string> fields;
+        index_flags flags;
     };
 
     struct TableDescriptor {
@@ -90,41 +136,449 @@ namespace jato {
         ushort_type
     >;
 
+    // Encodes a tuple of field values as a byte string whose memcmp order is
+    // the tuple's key order: integers compare by value, floating point by
+    // IEEE total order (negative zero sorts below zero), text and binary
+    // bytewise, and GUIDs in ESENT's index order (bytes 10-15, 8-9, 6-7,
+    // 4-5, then 0-3). Variable length values are escaped and terminated
+    // so that every segment is self-delimiting and prefixes sort first.
+    auto encode_key(const vector<FieldValue>& values) -> vector<std::uint8_t>;
+    auto decode_key(const vector<std::uint8_t>& key, const vector<field_type>& types) -> vector<FieldValue>;
+
+    // A block of rows stored column by column, filled by Table::scan. Each
+    // column uses the vector that matches its type: long_type in longs,
+    // long_long_type and currency_type in long_longs, double_type and
+    // datetime_type in doubles. Nulls are a bitmap, one bit per row.
+    struct ColumnVector {
+        string name;
+        field_type type;
+        vector<std::int32_t> longs;
+        vector<std::int64_t> long_longs;
+        vector<double> doubles;
+        vector<std::uint64_t> nulls;
+    };
+
+    struct RecordBatch {
+        std::size_t rows;
+        vector<ColumnVector> columns;
+
+        auto column(const string& name) const -> const ColumnVector&;
+    };
+
+    // bit n of word n / 64 is set when row n is selected
+    using Selection = vector<std::uint64_t>;
+
+    enum class compare_op { less, less_equal, equal, not_equal, greater_equal, greater };
+
+    struct Predicate {
+        string field;
+        compare_op op;
+        FieldValue value;
+    };
+
+    // Evaluates the conjunction of the predicates over a batch. Null values
+    // never match. Uses AVX2 or SSE4.2 kernels when the processor has them.
+    auto filter(const RecordBatch& batch, const vector<Predicate>& predicates) -> Selection;
+    auto count_selected(const Selection& selection) -> std::size_t;
+    auto is_selected(const Selection& selection, std::size_t row) -> bool;
+
+    enum class aggregate_op { count, sum, min, max, avg };
+
+    struct Aggregate {
+        aggregate_op op;
+        string field;       // empty for count counts rows, otherwise non-null values
+    };
+
+    // Aggregates are computed from scan batches without building records.
+    // Group and aggregate fields must be numeric fields that Table::scan
+    // supports. With more than one partition the table is split by record
+    // position and the partitions are aggregated concurrently, each on its
+    // own session, then merged.
+    struct AggregateSpec {
+        vector<string> group_by;
+        vector<Aggregate> aggregates;
+        vector<Predicate> where;
+        std::size_t expected_groups = 0;    // sizes the hash table up front
+        std::size_t partitions = 1;
+    };
+
+    // count yields long_long_type, avg double_type, and sum, min and max the
+    // field's own type (integer sums widen to long_long_type). An aggregate
+    // with no non-null input in its group is empty. Empty groups are not
+    // reported, so an empty table yields no rows.
+    struct AggregateRow {
+        vector<boost::optional<FieldValue>> group;
+        vector<boost::optional<FieldValue>> values;
+    };
+
+    struct RowCacheStats {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        std::uint64_t evictions;
+        std::size_t rows;
+        std::size_t bytes;
+    };
+
+    struct KeyFilterStats {
+        bool ready;
+        std::size_t bytes;
+        std::uint64_t lookups;
+        std::uint64_t negatives;    // answered without a seek
+        bool failed;                // the build failed; enabling again retries it
+    };
+
+    // Walks a table in a series of transactions of up to records_per_chunk
+    // records each, halving the size when the version store fills up and
+    // doubling it back after each chunk that commits. Chunks commit durably,
+    // and after each commit on_commit receives the position of the last
+    // record done; passing it back as resume_from continues an interrupted
+    // walk at the next record, even if that one has since been deleted. The
+    // action must be idempotent, since a chunk that fails is run again.
+    struct ChunkOptions {
+        unsigned long records_per_chunk = 1000;
+        vector<char> resume_from;
+        function< void(const vector<char>& position) > on_commit;
+    };
+
+    // Joins records whose outer_fields equal the inner table's inner_fields,
+    // pairwise; a record missing any of them matches nothing. The inner
+    // table is searched through an index whose leading fields are the join
+    // fields when it has one. Otherwise its records are hashed in memory,
+    // and once they outgrow memory_budget bytes both tables are split into
+    // partitions on temporary tables and joined one partition at a time.
+    struct JoinSpec {
+        vector<string> outer_fields;
+        vector<string> inner_fields;
+        std::size_t memory_budget = 64 * 1024 * 1024;
+    };
+
+    enum class join_method { index_nested_loop, hash, partitioned_hash };
+
+    // How a query reads its table: every record in primary key order, an
+    // index range narrowed by the predicates, or an index that holds every
+    // field the query needs so that records are never read. Ranges are
+    // inclusive key prefixes as for Table::count.
+    enum class query_access { table_scan, index_range, covering_index };
+
+    struct QueryPlan {
+        query_access access;
+        string index;
+        vector<FieldValue> lo;
+        vector<FieldValue> hi;
+    };
+
     namespace interface {
         struct Record {
             virtual ~Record() {}
 
             virtual void set_field(const string& fieldname, FieldValue field) = 0;
             virtual auto get_field(const string& fieldname) const -> FieldValue = 0;
+            virtual void foreach_field(function< void(const string& fieldname, const FieldValue& field) > action) const = 0;
         };
     }
 
     using record_ptr = unique_ptr <interface::Record>;
 
+    auto make_record() -> record_ptr;
+
+    namespace interface {
+        // Reads a long value in pieces, so that memory use is bounded by
+        // the caller's buffer rather than by the size of the value.
+        struct LongValueReader {
+            virtual ~LongValueReader() {}
+
+            virtual auto size() const -> std::uint64_t = 0;
+            virtual auto read(void* buffer, std::size_t count) -> std::size_t = 0;
+            virtual auto read(std::ostream& sink) -> std::uint64_t = 0;
+        };
+
+        // Appends to a long value. Data is handed to ESENT straight from
+        // the caller's memory (which may be a mapped file); only reading
+        // from a stream goes through a fixed size chunk buffer.
+        struct LongValueWriter {
+            virtual ~LongValueWriter() {}
+
+            virtual void write(const void* data, std::size_t count) = 0;
+            virtual auto write(std::istream& source) -> std::uint64_t = 0;
+        };
+    }
+
+    namespace interface {
+        // Built by chaining, then run by foreach_record. Predicates are
+        // ANDed, compared with the raw column bytes before any record is
+        // built, and never match nulls; their values must have the field's
+        // type. Records hold only the selected fields (all of them if none
+        // are selected). A query must not outlive its table.
+        struct Query {
+            virtual ~Query() {}
+
+            virtual auto where(const Predicate& predicate) -> Query& = 0;
+            virtual auto select(const vector<string>& fieldnames) -> Query& = 0;
+            virtual auto limit(std::size_t count) -> Query& = 0;
+
+            virtual auto plan() -> QueryPlan = 0;
+            virtual void foreach_record(function< auto(record_ptr) -> bool > action) = 0;
+        };
+    }
+
+    using query_ptr = unique_ptr<interface::Query>;
+
     namespace interface {
         struct Table {
             virtual ~Table() {}
 
             virtual void create_field(const string& name, field_type type) = 0;
+            virtual void create_field(const string& name, field_type type, field_flags flags) = 0;
             virtual void delete_field(const string& name) = 0;
             virtual void rename_field(const string& oldname, const string& newname) = 0;
 
             //virtual auto create_record() const->record_ptr = 0;
             virtual void add_record(record_ptr record) = 0;
+            virtual void add_record(record_ptr record, const string& fieldname,
+                function< void(LongValueWriter& writer) > write) = 0;
 
             virtual auto fields() const -> vector<FieldDescriptor> = 0;
 
+            virtual void create_index(const string& name, const vector<string>& fieldnames, index_flags flags) = 0;
+            virtual auto indexes() const -> vector<IndexDescriptor> = 0;
+
+            // the record with the given primary key, or null if there is none
+            virtual auto find(const vector<FieldValue>& key) -> record_ptr = 0;
+
+            // Keeps rows found by primary key in memory, up to byte_budget
+            // bytes, for every cursor on this table in the process; 0 turns
+            // the cache off. Writes made through jato invalidate it.
+            virtual void cache_rows(std::size_t byte_budget) = 0;
+            virtual auto row_cache_stats() const -> RowCacheStats = 0;
+
+            // Lets find answer most lookups of missing keys without a seek,
+            // using a Bloom filter of the primary keys that jato's inserts
+            // keep up to date. A copy saved clean by save_key_filter is
+            // loaded; otherwise the filter is built by a background scan
+            // and find seeks until it is ready. Writes made without jato
+            // are not seen, so only use it on tables that jato alone
+            // writes. Save when no inserts are in progress in any process,
+            // e.g. before closing the database; the first insert in each
+            // process marks the saved copy stale. If the background scan
+            // fails, key_filter_stats reports it and find keeps seeking.
+            virtual void enable_key_filter(unsigned bits_per_key) = 0;
+            virtual void save_key_filter() = 0;
+            virtual auto key_filter_stats() const -> KeyFilterStats = 0;
+
+            // Adds delta to an escrow field of the record with the given
+            // primary key and returns the new value. Like jato's other
+            // single writes it commits without waiting for the log, so a
+            // crash soon after can lose an increment whose value was
+            // returned; run it in Database::transaction, which commits
+            // durably, when the value must survive a crash.
+            virtual auto increment(const vector<FieldValue>& key, const string& fieldname, std::int64_t delta) -> std::int64_t = 0;
+
+            // Inserts the record, or replaces the fields it has in the
+            // record with its primary key, with a single seek. Returns true
+            // if it inserted. Escrow fields can only be set by the insert.
+            virtual auto upsert(record_ptr record) -> bool = 0;
+
+            // Calls merge with the record that has the key, or null if
+            // there is none, and writes the record it returns in the same
+            // transaction; returning null writes nothing. The record must
+            // keep the key: key fields it has must match, and a record to
+            // insert needs them all, or merge throws. Returns true if it
+            // wrote. merge can be called twice when another session inserts
+            // the key meanwhile; concurrent merges of one record end in a
+            // conflict_error rather than a lost update.
+            virtual auto merge(const vector<FieldValue>& key,
+                function< auto(record_ptr current) -> record_ptr > merge) -> bool = 0;
+
+            // Exact counts walk the index without reading records. Estimates
+            // count exactly up to exact_limit entries (0 for no exact pass)
+            // and beyond that extrapolate from record positions. Ranges are
+            // inclusive key prefixes on the named index; an empty bound
+            // leaves that end open.
+            virtual auto count() -> std::uint64_t = 0;
+            virtual auto count(const string& indexname,
+                const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> std::uint64_t = 0;
+            virtual auto estimate_count(unsigned long exact_limit) -> std::uint64_t = 0;
+            virtual auto estimate_count(const string& indexname,
+                const vector<FieldValue>& lo, const vector<FieldValue>& hi, unsigned long exact_limit) -> std::uint64_t = 0;
+
             virtual void foreach_record(function< auto(record_ptr) -> bool > action) = 0;
+            virtual void foreach_record(const vector<string>& fieldnames, function< auto(record_ptr) -> bool > action) = 0;
+            virtual void foreach_chunked(const ChunkOptions& options, function< auto(record_ptr) -> bool > action) = 0;
+            virtual auto query() -> query_ptr = 0;
+
+            // Deletes the records in an inclusive key range, as for count,
+            // in transactions that shrink while the version store cannot
+            // hold them, and returns how many it deleted.
+            virtual auto delete_range(const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> std::uint64_t = 0;
+            virtual auto delete_range(const string& indexname,
+                const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> std::uint64_t = 0;
+
+            // Empties the table and its views by creating it again with the
+            // same fields and indexes, in one transaction. It cannot run
+            // inside a transaction or while any other cursor has the table
+            // open.
+            virtual void truncate() = 0;
+
+            // visits the records in an inclusive key range of an index, as for count
+            virtual void foreach_record(const string& indexname, const vector<FieldValue>& lo,
+                const vector<FieldValue>& hi, function< auto(record_ptr) -> bool > action) = 0;
+
+            // calls action with each pair of joined records until it returns false
+            virtual auto join(Table& inner, const JoinSpec& spec,
+                function< auto(const Record& outer, const Record& inner) -> bool > action) -> join_method = 0;
+
+            // retrieves fixed size numeric fields in blocks of batch_size rows
+            virtual void scan(const vector<string>& fieldnames, std::size_t batch_size,
+                function< auto(const RecordBatch& batch) -> bool > action) = 0;
+
+            virtual auto aggregate(const AggregateSpec& spec) -> vector<AggregateRow> = 0;
+
+            // Reads a long value of the record current in a foreach_record
+            // or foreach_chunked callback of this table, including those
+            // over an index range and the ones a join makes. Queries walk
+            // cursors of their own, so their callbacks cannot use it.
+            virtual void read_long_value(const string& fieldname,
+                function< void(LongValueReader& reader) > read) = 0;
         };
     }
 
     using table_ptr = unique_ptr<interface::Table>;
 
+    // A materialized aggregate over a base table: a table named name with
+    // one record per distinct value of the group_by fields, holding those
+    // fields, a long_long_type "count" of the base records and a
+    // long_long_type "sum_<field>" for each summed long, long long or
+    // currency field (currency in units of 1/10000). jato's writes to the
+    // base table update it in the same transaction with escrow deltas, so
+    // writers to one group do not conflict, and a group's record goes away
+    // when its count reaches zero. Base records with a null group field
+    // are left out, and writes made without jato are not seen.
+    struct ViewSpec {
+        string name;
+        vector<string> group_by;
+        vector<string> sums;
+    };
+
+    // Write conflicts are retried after a random delay of up to
+    // initial_backoff_ms, doubling on each attempt up to max_backoff_ms.
+    struct RetryPolicy {
+        unsigned attempts = 10;     // including the first
+        unsigned long initial_backoff_ms = 1;
+        unsigned long max_backoff_ms = 100;
+    };
+
+    // counted per table by every session in the process
+    struct ConflictStats {
+        string table;
+        std::uint64_t conflicts;
+        std::uint64_t retries;
+    };
+
+    // A long-lived snapshot keeps old record versions alive in the version
+    // store that writers share. A snapshot older than warn_after_ms is
+    // reported once through on_long_reader; one older than abort_after_ms
+    // fails its next read. 0 disables either limit.
+    struct SnapshotOptions {
+        unsigned long warn_after_ms = 0;
+        unsigned long abort_after_ms = 0;
+        function< void(const string& tablename, unsigned long age_ms) > on_long_reader;
+    };
+
+    namespace interface {
+        // A read-only transaction on a session of its own. Tables opened
+        // from it see the database as it was when the snapshot was taken
+        // and can no longer be read once the snapshot is destroyed.
+        struct Snapshot {
+            virtual ~Snapshot() {}
+
+            virtual auto open_table(const string& tablename) -> table_ptr = 0;
+            virtual auto age_ms() const -> unsigned long = 0;
+        };
+    }
+
+    using snapshot_ptr = unique_ptr<interface::Snapshot>;
+
+    // A sweep deletes expired records in transactions of up to
+    // records_per_transaction records, until none are left or slice_ms
+    // has passed, and the next one starts interval_ms later. Short
+    // transactions keep the version store small.
+    struct TtlOptions {
+        unsigned long interval_ms = 1000;
+        unsigned long records_per_transaction = 100;
+        unsigned long slice_ms = 50;
+    };
+
+    // counted by every sweeper of the table in the process
+    struct TtlStats {
+        std::uint64_t swept;
+        std::uint64_t sweeps;
+        std::uint64_t failures;     // sweeps that threw; retried next interval
+    };
+
+    enum class change_kind { inserted, updated, deleted, truncated };
+
+    // A change to a record, published when its transaction commits.
+    // Sequence numbers grow across all the tables of a database, in the
+    // order in which the transactions committed in this process. Inserts
+    // have only an after image, deletes only a before image and a
+    // truncated table neither.
+    struct ChangeEvent {
+        std::uint64_t sequence;
+        string table;
+        change_kind kind;
+        std::shared_ptr<const interface::Record> before;
+        std::shared_ptr<const interface::Record> after;
+    };
+
+    // Events wait in a ring of capacity slots (rounded up to a power of
+    // two) until they are polled. Events that find the ring full are
+    // dropped, unless there is a spool: every event is appended to the
+    // spool file once its transaction commits, and the file is flushed to
+    // disk after each batch of appends; those that did not fit are read
+    // back from it once the ring has been drained. An event committed just
+    // before a crash can be missing from the spool, since it is written
+    // after the commit. A spool keeps growing until it is removed while
+    // nothing subscribes with it.
+    struct ChangeFeedOptions {
+        std::size_t capacity = 4096;
+        sys::path spool_path;       // empty for no spool
+    };
+
+    namespace interface {
+        // The changes committed through jato to a database after the feed
+        // was subscribed. Writes to a view's table are not reported. Only
+        // one thread at a time may poll a feed.
+        struct ChangeFeed {
+            virtual ~ChangeFeed() {}
+
+            // calls action with the waiting events in sequence order until
+            // it returns false, and returns how many it was called with
+            virtual auto poll(function< auto(const ChangeEvent& event) -> bool > action) -> std::size_t = 0;
+            virtual auto dropped() const -> std::uint64_t = 0;
+        };
+    }
+
+    using change_feed_ptr = unique_ptr<interface::ChangeFeed>;
+
+    // Calls action with the events in a spool file that come after
+    // after_sequence until it returns false. Sequence numbers carry on
+    // from the spool's last event when it is subscribed with again.
+    void replay_changes(const sys::path& spool_path, std::uint64_t after_sequence,
+        function< auto(const ChangeEvent& event) -> bool > action);
+
     namespace interface {
         struct Database {
             virtual ~Database() {}
 
+            // Commits if action returns and rolls back if it throws. Retries
+            // only help at the outermost level, where a rollback discards
+            // the conflicting snapshot.
             virtual void transaction(function< void() > action) = 0;
+            virtual void transaction(const RetryPolicy& policy, function< void() > action) = 0;
+            virtual auto conflict_stats() const -> vector<ConflictStats> = 0;
+
+            virtual auto snapshot() -> snapshot_ptr = 0;
+            virtual auto snapshot(const SnapshotOptions& options) -> snapshot_ptr = 0;
 
             virtual void create_table(const string& tablename) = 0;
             virtual void delete_table(const string& tablename) = 0;
@@ -132,24 +586,170 @@ namespace jato {
             virtual void rename_table(const string& oldname, const string& newname) = 0;
 
             virtual auto tables() const -> vector<TableDescriptor> = 0;
+
+            // Creates the view filled from the base table's records. It
+            // waits for writes in progress to the base table to end, and
+            // jato's writes to it in this process wait until it returns;
+            // other processes must not write the base table meanwhile. It
+            // cannot run inside a transaction. Deleting the base table stops
+            // maintenance; renaming it is refused.
+            virtual void create_view(const string& tablename, const ViewSpec& spec) = 0;
+            virtual auto views(const string& tablename) -> vector<ViewSpec> = 0;
+
+            virtual auto subscribe_changes(const ChangeFeedOptions& options) -> change_feed_ptr = 0;
+
+            // Records whose expiry field (a datetime_type in local time,
+            // like every OLE date) is not after the current local time are
+            // hidden from find, foreach_record, foreach_chunked and queries,
+            // and deleted in the background by a sweeper on a session of its
+            // own, through a sparse index on the field. Counts, scans and
+            // aggregates see them until they are swept. The sweeper runs
+            // until this database is closed or the table is deleted or
+            // renamed; a failed sweep is counted and retried next interval.
+            virtual void enable_ttl(const string& tablename, const string& fieldname, const TtlOptions& options) = 0;
+            virtual auto ttl_stats(const string& tablename) -> TtlStats = 0;
             virtual void with_table(const string& tablename, function<void(Table& table)>) = 0;
         };
     }
 
     using database_ptr = unique_ptr<interface::Database>;
 
+    // Completions are handed to executor, which should queue them on the
+    // caller's event loop; without one they run on the worker thread.
+    struct AsyncOptions {
+        std::size_t workers = 4;
+        function< void(function< void() > completion) > executor;
+    };
+
+    namespace interface {
+        // A fixed pool of worker threads, each with its own session and its
+        // own open copy of a database. Work runs on whichever worker is free,
+        // so tables opened in one piece of work must not outlive it.
+        struct AsyncDatabase {
+            virtual ~AsyncDatabase() {}
+
+            // done receives null if work returned and its exception if not
+            virtual void post(function< void(Database& database) > work,
+                function< void(std::exception_ptr error) > done) = 0;
+
+            // Delivers copies of the batches through the executor one at a
+            // time; the worker reads ahead by at most one batch.
+            virtual void scan(const string& tablename, const vector<string>& fieldnames, std::size_t batch_size,
+                function< auto(const RecordBatch& batch) -> bool > action,
+                function< void(std::exception_ptr error) > done) = 0;
+
+            virtual auto pending() const -> std::size_t = 0;
+        };
+    }
+
+    using async_database_ptr = unique_ptr<interface::AsyncDatabase>;
+
+    namespace detail {
+        template <typename T>
+        struct fulfil {
+            template <typename Work>
+            static void run(std::promise<T>& promise, Work& work, interface::Database& database) {
+                promise.set_value(work(database));
+            }
+        };
+
+        template <>
+        struct fulfil<void> {
+            template <typename Work>
+            static void run(std::promise<void>& promise, Work& work, interface::Database& database) {
+                work(database);
+                promise.set_value();
+            }
+        };
+    }
+
+    // runs work(Database&) on the pool and returns a future for its result
+    template <typename Work>
+    auto async_call(interface::AsyncDatabase& pool, Work work)
+        -> std::future<decltype(work(std::declval<interface::Database&>()))> {
+        using result_type = decltype(work(std::declval<interface::Database&>()));
+        auto promise = std::make_shared<std::promise<result_type>>();
+        pool.post([promise, work](interface::Database& database) mutable {
+            detail::fulfil<result_type>::run(*promise, work, database);
+        }, [promise](std::exception_ptr error) {
+            if (error) promise->set_exception(error);
+        });
+        return promise->get_future();
+    }
+
+    // runs database.transaction(policy, work) on the pool
+    template <typename Work>
+    auto async_transaction(interface::AsyncDatabase& pool, const RetryPolicy& policy, Work work) -> std::future<void> {
+        return async_call(pool, [policy, work](interface::Database& database) {
+            database.transaction(policy, [&](){ work(database); });
+        });
+    }
+
+    struct SortKey {
+        string field;
+        bool descending;
+    };
+
+    // Records carry the listed fields; keys name some of them. With a
+    // limit only the first limit records are kept, in memory.
+    struct SortSpec {
+        vector<FieldDescriptor> fields;
+        vector<SortKey> keys;
+        std::size_t limit = 0;
+    };
+
+    namespace interface {
+        // Sorts records with bounded memory: they go to an ESENT temporary
+        // table, which spills to the instance's temporary database once it
+        // outgrows the cache. That is jato's external sort: ESENT writes
+        // the sorted runs and merges them, so there is no spill file or
+        // merge of jato's own. Records with equal keys keep their order.
+        struct Sorter {
+            virtual ~Sorter() {}
+
+            virtual void add(const Record& record) = 0;
+
+            // visits the records in order, once; nothing can be added after
+            virtual void foreach_record(function< auto(record_ptr) -> bool > action) = 0;
+        };
+    }
+
+    using sorter_ptr = unique_ptr<interface::Sorter>;
+
     namespace interface {
         struct Session {
             virtual ~Session() {}
 
             virtual void create_database(const sys::path& path) = 0;
             virtual auto open_database(const sys::path& path) -> database_ptr = 0;
+
+            // Creates and loads a rebuildable database on a private instance
+            // with crash recovery turned off. The database is shut down and
+            // checked for consistency before returning; later opens are
+            // logged as usual. A failed load deletes the partial database.
+            virtual void bulk_load(const sys::path& path, function<void(Database& database)> load) = 0;
+
+            virtual auto open_async_database(const sys::path& path, const AsyncOptions& options) -> async_database_ptr = 0;
+
+            virtual auto make_sorter(const SortSpec& spec) -> sorter_ptr = 0;
         };
     }
 
     using session_ptr = unique_ptr<interface::Session> ;
 
+    // Sessions made with the same instance name share one ESENT instance;
+    // each distinct name gets its own instance with its own log and system
+    // files. Options are applied when the named instance is first created.
+    struct InstanceOptions {
+        string name;
+        sys::path system_path;      // checkpoint file; empty for the engine default
+        sys::path log_path;         // transaction logs; empty for the engine default
+        sys::path temp_path;        // temporary database; empty for the engine default
+        unsigned long cache_size_max = 0;   // database pages; 0 for the engine default
+    };
+
     auto make_session() -> session_ptr;
+    auto make_session(const InstanceOptions& options) -> session_ptr;
 
     void drop_database(const sys::path& path);
 
@@ -0,0 +1,605 @@
+#pragma once
+
+#include "jato.h"
+#include "jet.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace jato {
+
+    //
+    // jet::error handling
+    //
+    auto map_exception(jet::error& ex) -> jato::error;
+
+    inline auto is_write_conflict(JET_ERR code) -> bool {
+        return code == JET_errWriteConflict || code == JET_errWriteConflictPrimaryIndex;
+    }
+
+    inline auto is_version_store_full(JET_ERR code) -> bool {
+        return code == JET_errVersionStoreOutOfMemory || code == JET_errVersionStoreOutOfMemoryAndCleanupTimedOut;
+    }
+
+    template <typename T>
+    auto jet_function(function< auto() -> T > fn) -> T {
+        try {
+            return fn();
+        } catch (jet::error& ex) {
+            if (is_write_conflict(ex.code())) throw conflict_error(map_exception(ex).what(), string());
+            if (is_version_store_full(ex.code())) throw version_store_error(map_exception(ex).what());
+            throw map_exception(ex);
+        }
+    }
+
+    inline void jet_action(function< void() > action) {
+        try {
+            action();
+        } catch (jet::error& ex) {
+            if (is_write_conflict(ex.code())) throw conflict_error(map_exception(ex).what(), string());
+            if (is_version_store_full(ex.code())) throw version_store_error(map_exception(ex).what());
+            throw map_exception(ex);
+        }
+    }
+
+    //
+    // write conflict counters, by database file and table
+    //
+    void count_conflict(const string& dbname, const string& tablename);
+    void count_retry(const string& dbname, const string& tablename);
+    auto conflict_stats(const string& dbname) -> vector<ConflictStats>;
+
+    // jet_function for work on one table: write conflicts that do not yet
+    // name a table are counted against this one and carry its name
+    template <typename T>
+    auto table_function(const string& dbname, const string& tablename, function< auto() -> T > fn) -> T {
+        try {
+            return jet_function<T>(fn);
+        } catch (conflict_error& ex) {
+            if (!ex.table().empty()) throw;
+            count_conflict(dbname, tablename);
+            throw conflict_error(ex.what(), tablename);
+        }
+    }
+
+    inline void table_action(const string& dbname, const string& tablename, function< void() > action) {
+        table_function<bool>(dbname, tablename, [&](){
+            action();
+            return true;
+        });
+    }
+
+    //
+    // snapshots: tables opened from one check it before reading
+    //
+    struct snapshot_state {
+        std::chrono::steady_clock::time_point started;
+        SnapshotOptions options;
+        bool warned;
+        bool closed;
+    };
+
+    using snapshot_state_ptr = std::shared_ptr<snapshot_state>;
+
+    auto snapshot_age_ms(const snapshot_state& state) -> unsigned long;
+    void check_snapshot(snapshot_state& state, const string& tablename);
+
+    // a worker pool whose workers each call open for their database
+    auto make_async_database(function< auto() -> database_ptr > open, const AsyncOptions& options) -> async_database_ptr;
+
+    //
+    // field values as stored in ESENT columns
+    //
+    struct column {
+        string name;
+        JET_COLUMNID id;
+        field_type type;
+        JET_GRBIT bits;
+    };
+
+    struct field_data {
+        const void* data;
+        unsigned long size;
+    };
+
+    auto is_long_value(field_type type) -> bool;
+    auto field_type_of(const FieldValue& value) -> field_type;
+    auto field_bytes(const FieldValue& value) -> field_data;    // points into value
+    auto make_field(field_type type, const void* data, unsigned long size) -> FieldValue;
+
+    // compares bookmarks (normalized keys) in index order
+    auto bookmark_less(const vector<char>& a, const vector<char>& b) -> bool;
+
+    //
+    // cursors
+    //
+
+    // A second cursor on the same table, so that seeks, ranges and index
+    // changes do not disturb the position of the table's own cursor.
+    class cursor_copy {
+    public:
+        cursor_copy(JET_SESID session, JET_TABLEID table)
+            : session(session), id(jet::dup_cursor(session, table, 0)) {}
+
+        cursor_copy(const cursor_copy&) = delete;
+        auto operator=(const cursor_copy&) -> cursor_copy& = delete;
+
+        ~cursor_copy() {
+            JetCloseTable(session, id);
+        }
+
+        JET_SESID session;
+        JET_TABLEID id;
+    };
+
+    void make_index_key(JET_SESID session, JET_TABLEID table, const vector<FieldValue>& values, JET_GRBIT last_bits);
+
+    // positions the cursor on the first entry of an inclusive key range
+    // and limits it to the range; false if the range is empty
+    auto enter_range(const cursor_copy& cursor, const string& indexname,
+        const vector<FieldValue>& lo, const vector<FieldValue>& hi) -> bool;
+
+    // what a query needs of the table it reads
+    struct query_source {
+        jet::session_ptr session;
+        JET_TABLEID table_id;
+        std::map<string, column> columns;
+        vector<IndexDescriptor> indexes;
+        function< void() > check_snapshot;
+        string expiry_field;        // rows past it are left out; empty without a TTL
+    };
+
+    auto make_query(query_source source) -> query_ptr;
+
+    //
+    // sorting on ESENT temporary tables
+    //
+
+    // Records ordered by group, then by the sort keys, then by when they
+    // were added, and read back once. ESENT sorts in memory and spills to
+    // the instance's temporary database once a run outgrows its cache.
+    // This is the temporary table layer behind both Sorter and the join's
+    // partitions; a group can stand in for a partition or a spill run.
+    class sorted_run {
+    public:
+        sorted_run(jet::session_ptr session, const vector<FieldDescriptor>& fields, const vector<SortKey>& keys);
+        ~sorted_run();
+
+        sorted_run(const sorted_run&) = delete;
+        auto operator=(const sorted_run&) -> sorted_run& = delete;
+
+        void add(const interface::Record& record, std::int64_t group);
+
+        // the next record and its group, or null after the last one
+        auto next(std::int64_t& group) -> record_ptr;
+
+    private:
+        jet::session_ptr session;
+        JET_TABLEID table_id;
+        JET_COLUMNID group_id;
+        JET_COLUMNID sequence_id;
+        vector<column> columns;
+        std::int64_t next_sequence;
+        bool reading;
+        vector<char> buffer;
+    };
+
+    // a sorter whose temporary table lives in session
+    auto make_sorter(jet::session_ptr session, const SortSpec& spec) -> sorter_ptr;
+
+    // joins through the inner table's interface; spills go to session
+    auto join_tables(jet::session_ptr session, interface::Table& outer, interface::Table& inner, const JoinSpec& spec,
+        function< auto(const interface::Record& outer, const interface::Record& inner) -> bool > action) -> join_method;
+
+    //
+    // work-stealing scheduler for parallel table work
+    //
+
+    // What a task knows about where it runs. Tasks that run in the same
+    // slot run on the same thread, one after another. A worker's slot keeps
+    // a session for each level of nested run across jobs until the worker
+    // runs out of work; the slot of threads outside the pool, which several
+    // callers of run may share, has a session per job instead.
+    class worker_context {
+    public:
+        worker_context(std::size_t slot, jet::session_ptr& session)
+            : slot_index(slot), slot_session(session) {}
+
+        auto slot() const -> std::size_t { return slot_index; }
+
+        // this slot's session on instance, begun on first use
+        auto session(const jet::instance_ptr& instance) -> jet::session_ptr;
+
+    private:
+        std::size_t slot_index;
+        jet::session_ptr& slot_session;
+    };
+
+    using task = function< void(worker_context& worker) >;
+
+    // A process-wide pool with one thread per core. Each worker pops its own
+    // newest task first and, when idle, steals the oldest task of another.
+    // The thread calling run helps with its own job until it is done, so
+    // jobs may start nested jobs.
+    class scheduler {
+    public:
+        // never destroyed: joining its workers during static destruction
+        // can hang
+        static auto shared() -> scheduler&;
+
+        explicit scheduler(std::size_t workers);
+        ~scheduler();
+
+        scheduler(const scheduler&) = delete;
+        auto operator=(const scheduler&) -> scheduler& = delete;
+
+        // runs every task and rethrows the first exception once all are done
+        void run(const vector<task>& tasks);
+
+        // queues a task that nobody waits for; an exception it lets out is
+        // dropped, so it should record its own failures
+        void post(task work);
+
+        auto workers() const -> std::size_t { return queues.size(); }
+
+    private:
+        struct job;
+        struct queued_task {
+            job* owner;
+            std::size_t index;
+        };
+        struct queue {
+            std::mutex lock;
+            std::deque<queued_task> tasks;
+        };
+        // touched only by the worker's own thread
+        struct worker_sessions {
+            std::deque<jet::session_ptr> levels;    // by depth of nested run
+            std::size_t depth = 0;
+        };
+
+        void enqueue(job& owner, std::size_t first);
+        void work(std::size_t worker);
+        auto take(std::size_t worker, queued_task& next) -> bool;
+        auto take_from(job& owner, queued_task& next) -> bool;
+        void execute(const queued_task& next, std::size_t slot);
+        auto current_slot() const -> std::size_t;
+
+        vector<unique_ptr<queue>> queues;
+        vector<unique_ptr<worker_sessions>> sessions;
+        vector<std::thread> threads;
+        std::map<std::thread::id, std::size_t> slots;   // written before the workers start
+        std::mutex idle_lock;
+        std::condition_variable idle;
+        std::size_t queued = 0;
+        bool stopping = false;
+    };
+
+    //
+    // hash aggregation over scan batches
+    //
+    class aggregator {
+    public:
+        explicit aggregator(const AggregateSpec& spec);
+
+        auto scanned_fields() const -> const vector<string>& { return fields; }
+
+        void add(const RecordBatch& batch);
+        void merge(const aggregator& other);
+        auto rows() const -> vector<AggregateRow>;
+
+    private:
+        struct accumulator {
+            std::uint64_t count;
+            std::int64_t integer_sum;
+            double real_sum;
+            std::int64_t integer_min;
+            std::int64_t integer_max;
+            double real_min;
+            double real_max;
+        };
+
+        auto find_slot(const std::uint64_t* key) -> std::size_t;
+        void grow();
+        void combine(accumulator& into, const accumulator& from) const;
+
+        AggregateSpec spec;
+        vector<string> fields;
+        vector<field_type> group_types;
+        vector<field_type> value_types;
+        std::size_t width;          // key words: one per group field plus a null mask
+        std::size_t capacity;       // always a power of two
+        std::size_t size = 0;
+        vector<std::uint64_t> keys;
+        vector<std::uint8_t> used;
+        vector<accumulator> accumulators;
+    };
+
+    class record_impl : public interface::Record {
+    public: // interface
+        void set_field(const string& fieldname, FieldValue field) final override;
+        auto get_field(const string& fieldname) const -> FieldValue final override;
+        void foreach_field(function< void(const string& fieldname, const FieldValue& field) > action) const final override;
+
+    private:
+        std::map<string, FieldValue> fields;
+    };
+
+    //
+    // rows found by primary key, shared by every cursor on a table and
+    // keyed by the primary index's normalized key
+    //
+    class row_cache {
+    public:
+        using row = std::shared_ptr<const record_impl>;
+
+        row_cache();
+
+        row_cache(const row_cache&) = delete;
+        auto operator=(const row_cache&) -> row_cache& = delete;
+
+        void configure(std::size_t byte_budget);
+        auto enabled() const -> bool { return budget != 0; }
+
+        auto lookup(const string& key) -> row;      // null on a miss
+        auto generation(const string& key) -> std::uint64_t;
+
+        // caches value unless key may have changed since generation was read
+        void insert(const string& key, row value, std::uint64_t generation);
+        void invalidate(const string& key);
+        void clear();
+
+        auto stats() const -> RowCacheStats;
+
+    private:
+        using lru_list = std::list<std::pair<string, row>>;
+
+        struct shard {
+            mutable std::mutex lock;
+            lru_list lru;     // most recently used first
+            std::unordered_map<string, lru_list::iterator> index;
+            std::size_t bytes = 0;
+            std::uint64_t generation = 0;
+        };
+
+        static const std::size_t shard_count = 16;
+
+        auto shard_of(const string& key) -> shard&;
+        void evict(shard& target, std::size_t shard_budget);
+
+        std::array<shard, shard_count> shards;
+        std::atomic<std::size_t> budget;
+        std::atomic<std::uint64_t> hits;
+        std::atomic<std::uint64_t> misses;
+        std::atomic<std::uint64_t> evictions;
+    };
+
+    auto shared_row_cache(const string& dbname, const string& tablename) -> std::shared_ptr<row_cache>;
+    void drop_row_cache(const string& dbname, const string& tablename);
+
+    //
+    // materialized views, kept up to date by jato's writes to their base table
+    //
+    struct view_def {
+        string base;
+        ViewSpec spec;
+        vector<JET_COLUMNID> group_ids;     // in the view's table
+        JET_COLUMNID count_id;
+        vector<JET_COLUMNID> sum_ids;
+    };
+
+    using view_list = std::shared_ptr<const vector<view_def>>;
+
+    // the views over tablename, read from a side table once per process
+    auto table_views(jet::instance_ptr instance, const string& dbname, const string& tablename) -> view_list;
+
+    // The views over tablename for a write to it. The write counts as in
+    // progress, holding off create_view, for as long as the list is kept
+    // and, inside a transaction, until the transaction ends.
+    auto views_for_write(jet::session& session, jet::instance_ptr instance, const string& dbname, const string& tablename) -> view_list;
+
+    // Creates the view's table and fills it from base in one transaction,
+    // once the writes in progress to base have ended; writes wait for it.
+    void create_view(jet::session& session, JET_DBID db, const string& dbname,
+        interface::Table& base, const string& basename, const ViewSpec& spec);
+
+    // forgets the views over tablename and the view named tablename
+    void drop_views(JET_SESID session, JET_DBID db, const string& dbname, const string& tablename);
+
+    // Adds count_delta records with the given sums to a group of a view
+    // whose table is open on cursor, in the session's transaction. A group
+    // that another session added unseen raises conflict_error.
+    void apply_view_delta(jet::instance_ptr instance, jet::session& session, const string& dbname,
+        JET_TABLEID cursor, const view_def& view, const vector<FieldValue>& group,
+        std::int64_t count_delta, const vector<std::int64_t>& sum_deltas);
+
+    // the group of a base record and what it adds to each sum; false if a
+    // group field is null
+    auto view_group(const interface::Record& record, const ViewSpec& spec,
+        vector<FieldValue>& group, vector<std::int64_t>& sums) -> bool;
+
+    //
+    // committed changes, handed to every change feed of a database
+    //
+    struct change_subscription;
+
+    class change_hub {
+    public:
+        change_hub();
+
+        change_hub(const change_hub&) = delete;
+        auto operator=(const change_hub&) -> change_hub& = delete;
+
+        // whether there is anyone to build events for
+        auto active() const -> bool { return subscriber_count != 0; }
+
+        // held across the commits that publish, so that sequence numbers
+        // follow commit order
+        auto commit_gate() const -> std::shared_ptr<std::mutex> { return gate; }
+
+        // Numbers the event and queues it for delivery. It runs under the
+        // commit gate right after the commit, so it does no I/O and does
+        // not throw.
+        void publish(ChangeEvent event);
+
+        // Hands the queued events to every feed in sequence order, unless
+        // another thread is doing so already and will take them too. It
+        // does not throw: a feed that cannot take an event counts it as
+        // dropped.
+        void deliver();
+
+        // sequence numbers carry on after spooled_sequence
+        void add(std::shared_ptr<change_subscription> feed, std::uint64_t spooled_sequence);
+        void remove(const change_subscription* feed);
+
+        // lets events into the ring again once the feed's reader has read
+        // its spool up to where delivery stopped
+        auto end_spill(change_subscription& feed, std::uint64_t read_offset) -> bool;
+
+    private:
+        std::mutex lock;            // the feeds, the numbering and the outbox
+        std::mutex delivery;        // held by the thread delivering, which writes the spools
+        std::shared_ptr<std::mutex> gate;
+        std::uint64_t next_sequence;
+        std::deque<ChangeEvent> outbox;
+        vector<std::shared_ptr<change_subscription>> feeds;
+        std::atomic<std::size_t> subscriber_count;
+    };
+
+    // one per database in the process
+    auto shared_change_hub(const string& dbname) -> std::shared_ptr<change_hub>;
+    auto subscribe_changes(std::shared_ptr<change_hub> hub, const ChangeFeedOptions& options) -> change_feed_ptr;
+
+    //
+    // records that expire once the time in a datetime field has passed
+    //
+    struct ttl_state {
+        ttl_state();
+
+        auto field() -> string;
+
+        std::mutex lock;
+        string expiry_field;        // empty unless enabled
+        std::atomic<std::uint64_t> swept;
+        std::atomic<std::uint64_t> sweeps;
+        std::atomic<std::uint64_t> failures;
+    };
+
+    auto shared_ttl(const string& dbname, const string& tablename) -> std::shared_ptr<ttl_state>;
+    void drop_ttl(const string& dbname, const string& tablename);
+
+    auto datetime_now() -> double;     // local time, as an OLE automation date
+    auto ttl_index_name(const string& fieldname) -> string;
+
+    // deletes expired records for one time slice; returns how many
+    auto sweep_expired(jet::instance_ptr instance, jet::session_ptr session, jet::db_ptr data,
+        const string& tablename, const string& fieldname, const TtlOptions& options) -> std::uint64_t;
+
+    class ttl_sweeper {
+    public:
+        ttl_sweeper(jet::instance_ptr instance, const string& dbname, const string& tablename,
+            const string& fieldname, const TtlOptions& options);
+        ~ttl_sweeper();     // stops sweeping once the current slice is over
+
+        ttl_sweeper(const ttl_sweeper&) = delete;
+        auto operator=(const ttl_sweeper&) -> ttl_sweeper& = delete;
+
+        auto table() const -> const string& { return tablename; }
+
+    private:
+        void run();
+
+        jet::instance_ptr instance;
+        string dbname;
+        string tablename;
+        string fieldname;
+        TtlOptions options;
+        std::shared_ptr<ttl_state> state;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping;
+        std::thread worker;
+    };
+
+    //
+    // blocked Bloom filter over primary keys (record bookmarks)
+    //
+    class key_filter {
+    public:
+        explicit key_filter(std::size_t blocks);
+        explicit key_filter(const vector<std::uint64_t>& words);
+
+        key_filter(const key_filter&) = delete;
+        auto operator=(const key_filter&) -> key_filter& = delete;
+
+        // sized for expected_keys keys at bits_per_key bits each
+        static auto blocks_for(std::uint64_t expected_keys, unsigned bits_per_key) -> std::size_t;
+
+        void add(const vector<char>& key);
+        auto may_contain(const vector<char>& key) const -> bool;
+
+        auto words() const -> vector<std::uint64_t>;
+        auto bytes() const -> std::size_t;
+
+    private:
+        std::size_t block_count;
+        unique_ptr<std::atomic<std::uint64_t>[]> bits;
+    };
+
+    // the filter of a table, shared by every cursor on it in the process
+    struct key_filter_state {
+        key_filter_state();
+
+        auto current() -> std::shared_ptr<key_filter>;
+
+        // called by the background build when it stops; a build that did
+        // not fill the filter drops it, so that it can be enabled again
+        void finish_build(bool filled);
+
+        // stops a background build and waits for it
+        void cancel_build();
+
+        std::mutex lock;
+        std::condition_variable built;
+        std::shared_ptr<key_filter> filter;     // null until enabled
+        bool building;                          // guarded by lock
+        std::atomic<bool> cancelled;            // the build should stop
+        std::atomic<bool> ready;                // the filter holds every key
+        std::atomic<bool> failed;               // the last build failed
+        std::atomic<bool> saved_unchecked;      // no insert has checked the saved copy since start or save
+        std::atomic<std::uint64_t> lookups;
+        std::atomic<std::uint64_t> negatives;
+    };
+
+    auto shared_key_filter(const string& dbname, const string& tablename) -> std::shared_ptr<key_filter_state>;
+
+    // forgets the filter of a table that is going away, once its build stops
+    void drop_key_filter(const string& dbname, const string& tablename);
+
+    // Saved filters live in a side table. A copy is only loaded if it was
+    // saved clean; saving a null filter marks the saved copy stale.
+    auto load_key_filter(JET_SESID session, JET_DBID db, const string& tablename) -> std::shared_ptr<key_filter>;
+    void save_key_filter(JET_SESID session, JET_DBID db, const string& tablename, const key_filter* filter);
+    void delete_saved_key_filter(JET_SESID session, JET_DBID db, const string& tablename);
+
+    // The first insert in each process, and the first after each save,
+    // marks any clean saved copy stale. It does so on a session of its own
+    // so that the mark stays even if the insert's transaction rolls back.
+    void mark_key_filter_stale(key_filter_state& state, jet::instance_ptr instance, const string& dbname, const string& tablename);
+
+    // Adds the bookmark of every record of the table, reading on session.
+    // Returns false if cancelled was set before it finished.
+    auto fill_key_filter(jet::session_ptr session, const string& dbname, const string& tablename, key_filter& filter,
+        const std::atomic<bool>& cancelled) -> bool;
+
+}
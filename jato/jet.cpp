@@ -1,5 +1,6 @@
 #include "jet.h"
 
+#include <algorithm>
 #include <unordered_map>
 #include <string>
 #include <tuple>
@@ -91,6 +92,10 @@ namespace jet {
             JetBeginTransaction2(session, bits));
     }
 
+    void cancel_update(JET_SESID session, JET_TABLEID table) {
+        JetPrepareUpdate(session, table, JET_prepCancel);
+    }
+
     void close_database(JET_SESID session, JET_DBID db, JET_GRBIT bits) {
         handle_errors(
             "jet::close_database",
@@ -310,12 +315,121 @@ namespace jet {
         return make_tuple(enum_column_count, enum_column);
     }
 
+    auto escrow_update(
+        JET_SESID session,
+        JET_TABLEID table,
+        JET_COLUMNID column,
+        void* delta,
+        unsigned long delta_size,
+        void* old_value,
+        unsigned long old_value_size,
+        JET_GRBIT bits
+    ) -> unsigned long {
+        unsigned long old_value_actual = 0;
+        handle_errors(
+            "jet::escrow_update",
+            JetEscrowUpdate(session, table, column, delta, delta_size,
+            old_value, old_value_size, &old_value_actual, bits));
+        return old_value_actual;
+    }
+
     void free_buffer(char* buffer) {
         handle_errors(
             "jet::free_buffer",
             JetFreeBuffer(buffer));
     }
 
+    auto get_column_info(JET_SESID session, JET_TABLEID table, const string& columnname) -> JET_COLUMNDEF {
+        JET_COLUMNDEF column_def;
+        column_def.cbStruct = sizeof(column_def);
+        handle_errors(
+            "jet::get_column_info",
+            JetGetTableColumnInfo(session, table, columnname.c_str(), &column_def, sizeof(column_def), JET_ColInfo));
+        return column_def;
+    }
+
+    auto get_column_list(JET_SESID session, JET_TABLEID table) -> vector<column_info> {
+        JET_COLUMNLIST list;
+        list.cbStruct = sizeof(list);
+        handle_errors(
+            "jet::get_column_list",
+            JetGetTableColumnInfo(session, table, NULL, &list, sizeof(list), JET_ColInfoList));
+
+        // the column list is a temporary table with one record per column
+        vector<column_info> columns;
+        try {
+            for (auto more = move(session, list.tableid, JET_MoveFirst, 0); more;
+                more = move(session, list.tableid, JET_MoveNext, 0)) {
+                char name[JET_cbNameMost + 1] = { 0 };
+                column_info column;
+                retrieve_column(session, list.tableid, list.columnidcolumnname, name, JET_cbNameMost, 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidcolumnid, &column.id, sizeof(column.id), 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidcoltyp, &column.type, sizeof(column.type), 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidgrbit, &column.bits, sizeof(column.bits), 0, nullptr);
+                column.max_size = 0;
+                column.code_page = 0;
+                retrieve_column(session, list.tableid, list.columnidcbMax, &column.max_size, sizeof(column.max_size), 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidCp, &column.code_page, sizeof(column.code_page), 0, nullptr);
+                column.default_value.resize(JET_cbColumnMost);
+                auto result = retrieve_column(session, list.tableid, list.columnidDefault,
+                    column.default_value.data(), static_cast<unsigned long>(column.default_value.size()), 0, nullptr);
+                column.default_value.resize(std::get<0>(result) == JET_wrnColumnNull ? 0 : std::get<1>(result));
+                column.name = name;
+                columns.push_back(column);
+            }
+        } catch (error&) {
+            JetCloseTable(session, list.tableid);
+            throw;
+        }
+        close_table(session, list.tableid);
+        return columns;
+    }
+
+    auto get_index_list(JET_SESID session, JET_TABLEID table) -> vector<index_info> {
+        JET_INDEXLIST list;
+        list.cbStruct = sizeof(list);
+        handle_errors(
+            "jet::get_index_list",
+            JetGetTableIndexInfo(session, table, NULL, &list, sizeof(list), JET_IdxInfoList));
+
+        // the index list is a temporary table with one record per index column
+        vector<index_info> indexes;
+        try {
+            for (auto more = move(session, list.tableid, JET_MoveFirst, 0); more;
+                more = move(session, list.tableid, JET_MoveNext, 0)) {
+                char name[JET_cbNameMost + 1] = { 0 };
+                char columnname[JET_cbNameMost + 1] = { 0 };
+                JET_GRBIT bits = 0, column_bits = 0;
+                unsigned long columns = 0, position = 0;
+                retrieve_column(session, list.tableid, list.columnidindexname, name, JET_cbNameMost, 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidgrbitIndex, &bits, sizeof(bits), 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidcColumn, &columns, sizeof(columns), 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidiColumn, &position, sizeof(position), 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidcolumnname, columnname, JET_cbNameMost, 0, nullptr);
+                retrieve_column(session, list.tableid, list.columnidgrbitColumn, &column_bits, sizeof(column_bits), 0, nullptr);
+                if (indexes.empty() || indexes.back().name != name)
+                    indexes.push_back(index_info { name, bits, vector<string>(columns), vector<bool>(columns) });
+                if (position < indexes.back().columns.size()) {
+                    indexes.back().columns[position] = columnname;
+                    indexes.back().descending[position] = (column_bits & JET_bitKeyDescending) != 0;
+                }
+            }
+        } catch (error&) {
+            JetCloseTable(session, list.tableid);
+            throw;
+        }
+        close_table(session, list.tableid);
+        return indexes;
+    }
+
+    auto get_database_file_info(const string& filename) -> JET_DBINFOMISC {
+        JET_DBINFOMISC info;
+        handle_errors(
+            "jet::get_database_file_info",
+            JetGetDatabaseFileInfo(filename.c_str(), &info, sizeof(info), JET_DbInfoMisc));
+        return info;
+    }
+
     void init(JET_INSTANCE& instance) {
         handle_errors(
             "jet::init",
@@ -334,6 +448,74 @@ namespace jet {
         return bookmark;
     }
 
+    void get_bookmark(JET_SESID session, JET_TABLEID table, vector<char>& bookmark) {
+        // reuses the caller's buffer, growing it only when it is too small
+        if (bookmark.size() < JET_cbBookmarkMost) bookmark.resize(JET_cbBookmarkMost);
+        unsigned long actual_size = 0;
+        auto code = JetGetBookmark(session, table, bookmark.data(), static_cast<unsigned long>(bookmark.size()), &actual_size);
+        if (code == JET_errBufferTooSmall) {
+            bookmark.resize(actual_size);
+            code = JetGetBookmark(session, table, bookmark.data(), static_cast<unsigned long>(bookmark.size()), &actual_size);
+        }
+        handle_errors("jet::get_bookmark(3)", code);
+        bookmark.resize(actual_size);
+    }
+
+    void goto_bookmark(JET_SESID session, JET_TABLEID table, const vector<char>& bookmark) {
+        handle_errors(
+            "jet::goto_bookmark",
+            JetGotoBookmark(session, table, const_cast<char*>(bookmark.data()), static_cast<unsigned long>(bookmark.size())));
+    }
+
+    auto get_record_position(JET_SESID session, JET_TABLEID table) -> JET_RECPOS {
+        JET_RECPOS position = { sizeof(JET_RECPOS), 0, 0, 0 };
+        handle_errors(
+            "jet::get_record_position",
+            JetGetRecordPosition(session, table, &position, sizeof(position)));
+        return position;
+    }
+
+    void goto_position(JET_SESID session, JET_TABLEID table, unsigned long entries_lt, unsigned long entries_total) {
+        JET_RECPOS position = { sizeof(JET_RECPOS), entries_lt, 0, entries_total };
+        handle_errors(
+            "jet::goto_position",
+            JetGotoPosition(session, table, &position));
+    }
+
+    auto index_record_count(JET_SESID session, JET_TABLEID table, unsigned long max_count) -> unsigned long {
+        unsigned long count = 0;
+        handle_errors(
+            "jet::index_record_count",
+            JetIndexRecordCount(session, table, &count, max_count));
+        return count;
+    }
+
+    void make_key(JET_SESID session, JET_TABLEID table, const void* data, unsigned long data_size, JET_GRBIT bits) {
+        handle_errors(
+            "jet::make_key",
+            JetMakeKey(session, table, data, data_size, bits));
+    }
+
+    auto move(JET_SESID session, JET_TABLEID table, long rows, JET_GRBIT bits) -> bool {
+        auto code = JetMove(session, table, rows, bits);
+        if (code == JET_errNoCurrentRecord) return false;
+        handle_errors("jet::move", code);
+        return true;
+    }
+
+    auto normalize_path(const string& filename) -> string {
+        auto size = GetFullPathNameA(filename.c_str(), 0, NULL, NULL);
+        string full(size, '\0');
+        if (size == 0 || (size = GetFullPathNameA(filename.c_str(), size, &full[0], NULL)) == 0 || size >= full.size())
+            throw error(JET_errInvalidPath, "jet::normalize_path");
+        full.resize(size);
+        // Windows paths ignore case
+        std::transform(full.begin(), full.end(), full.begin(), [](char c) {
+            return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+        });
+        return full;
+    }
+
     auto open_database(JET_SESID session, const string& filename) -> JET_DBID {
         JET_DBID db = 0;
         handle_errors(
@@ -350,16 +532,135 @@ namespace jet {
         return table;
     }
 
+    auto open_temp_table(JET_SESID session, const JET_COLUMNDEF* columns, unsigned long count,
+        JET_GRBIT bits, JET_COLUMNID* column_ids) -> JET_TABLEID {
+        JET_TABLEID table = 0;
+        handle_errors(
+            "jet::open_temp_table",
+            JetOpenTempTable(session, columns, count, bits, &table, column_ids));
+        return table;
+    }
+
+    void prepare_update(JET_SESID session, JET_TABLEID table, unsigned long prep) {
+        handle_errors(
+            "jet::prepare_update",
+            JetPrepareUpdate(session, table, prep));
+    }
+
+    void rename_column(JET_SESID session, JET_TABLEID table, const string& oldname, const string& newname) {
+        handle_errors(
+            "jet::rename_column",
+            JetRenameColumn(session, table, oldname.c_str(), newname.c_str(), 0));
+    }
+
     void rename_table(JET_SESID session, JET_DBID db, const string& oldname, const string& newname) {
         handle_errors(
             "jet::rename_table",
             JetRenameTable(session, db, oldname.c_str(), newname.c_str()));
     }
 
+    void retrieve_key(JET_SESID session, JET_TABLEID table, vector<char>& key, JET_GRBIT bits) {
+        // reuses the caller's buffer, growing it only when it is too small
+        if (key.size() < JET_cbKeyMost) key.resize(JET_cbKeyMost);
+        unsigned long actual_size = 0;
+        auto code = JetRetrieveKey(session, table, key.data(), static_cast<unsigned long>(key.size()), &actual_size, bits);
+        if (code == JET_errBufferTooSmall || code == JET_wrnBufferTruncated) {
+            key.resize(actual_size);
+            code = JetRetrieveKey(session, table, key.data(), static_cast<unsigned long>(key.size()), &actual_size, bits);
+        }
+        handle_errors("jet::retrieve_key", code);
+        key.resize(actual_size);
+    }
+
+    auto retrieve_column(
+        JET_SESID session,
+        JET_TABLEID table,
+        JET_COLUMNID column,
+        void* data,
+        unsigned long data_size,
+        JET_GRBIT bits,
+        JET_RETINFO* retinfo
+    ) -> tuple<JET_ERR, unsigned long> {
+        unsigned long actual_size = 0;
+        auto code = JetRetrieveColumn(session, table, column, data, data_size, &actual_size, bits, retinfo);
+        if (code != JET_wrnColumnNull && code != JET_wrnBufferTruncated)
+            handle_errors("jet::retrieve_column", code);
+        return make_tuple(code, actual_size);
+    }
+
+    void retrieve_columns(JET_SESID session, JET_TABLEID table, JET_RETRIEVECOLUMN* columns, unsigned long count) {
+        auto code = JetRetrieveColumns(session, table, columns, count);
+        if (code != JET_wrnColumnNull && code != JET_wrnBufferTruncated)
+            handle_errors("jet::retrieve_columns", code);
+    }
+
+    void set_column(
+        JET_SESID session,
+        JET_TABLEID table,
+        JET_COLUMNID column,
+        const void* data,
+        unsigned long data_size,
+        JET_GRBIT bits,
+        JET_SETINFO* setinfo
+    ) {
+        handle_errors(
+            "jet::set_column",
+            JetSetColumn(session, table, column, data, data_size, bits, setinfo));
+    }
+
+    auto seek(JET_SESID session, JET_TABLEID table, JET_GRBIT bits) -> bool {
+        auto code = JetSeek(session, table, bits);
+        // an inequality seek that lands on a different key is not news
+        if (code == JET_errRecordNotFound) return false;
+        if (code != JET_wrnSeekNotEqual) handle_errors("jet::seek", code);
+        return true;
+    }
+
+    void set_current_index(JET_SESID session, JET_TABLEID table, const string& indexname) {
+        handle_errors(
+            "jet::set_current_index",
+            JetSetCurrentIndex(session, table, indexname.empty() ? NULL : indexname.c_str()));
+    }
+
+    auto set_index_range(JET_SESID session, JET_TABLEID table, JET_GRBIT bits) -> bool {
+        auto code = JetSetIndexRange(session, table, bits);
+        if (code == JET_errNoCurrentRecord) return false;
+        handle_errors("jet::set_index_range", code);
+        return true;
+    }
+
+    void set_system_parameter(JET_INSTANCE instance, unsigned long paramid, JET_API_PTR value) {
+        handle_errors(
+            "jet::set_system_parameter(1)",
+            JetSetSystemParameter(instance == 0 ? NULL : &instance, 0, paramid, value, NULL));
+    }
+
+    void set_system_parameter(JET_INSTANCE instance, unsigned long paramid, const string& value) {
+        handle_errors(
+            "jet::set_system_parameter(2)",
+            JetSetSystemParameter(instance == 0 ? NULL : &instance, 0, paramid, 0, value.c_str()));
+    }
+
     void term(JET_INSTANCE instance) {
         handle_errors(
             "jet::term",
             JetTerm(instance));
     }
 
-}
\ No newline at end of file
+    void update(JET_SESID session, JET_TABLEID table) {
+        handle_errors(
+            "jet::update(1)",
+            JetUpdate(session, table, NULL, 0, NULL));
+    }
+
+    // leaves the bookmark of the inserted or updated record in bookmark
+    void update(JET_SESID session, JET_TABLEID table, vector<char>& bookmark) {
+        if (bookmark.size() < JET_cbBookmarkMost) bookmark.resize(JET_cbBookmarkMost);
+        unsigned long actual_size = 0;
+        handle_errors(
+            "jet::update(2)",
+            JetUpdate(session, table, bookmark.data(), static_cast<unsigned long>(bookmark.size()), &actual_size));
+        bookmark.resize(actual_size);
+    }
+
+}
@@ -2,11 +2,15 @@
 
 #include <esent.h>
 
+#include <algorithm>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <stdexcept>
 #include <memory>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 namespace jet {
@@ -30,6 +34,23 @@ namespace jet {
         const char* _origin;
     };
 
+    struct column_info {
+        string name;
+        JET_COLUMNID id;
+        JET_COLTYP type;
+        JET_GRBIT bits;
+        unsigned long max_size;
+        unsigned short code_page;
+        vector<char> default_value;     // empty if there is none
+    };
+
+    struct index_info {
+        string name;
+        JET_GRBIT bits;
+        vector<string> columns;     // in key order
+        vector<bool> descending;    // for each of the columns
+    };
+
     using warning_handler = std::function < void(JET_ERR code, const char* origin) >;
 
     auto set_warning_handler(warning_handler handler) -> warning_handler;
@@ -54,6 +75,8 @@ namespace jet {
     auto begin_session(JET_INSTANCE instance, const string& username, const string& password) -> JET_SESID;
     void begin_transaction(JET_SESID session);
     void begin_transaction(JET_SESID session, JET_GRBIT bits);
+    // does not throw, so that it can be used while unwinding
+    void cancel_update(JET_SESID session, JET_TABLEID table);
     void close_database(JET_SESID session, JET_DBID db, JET_GRBIT bits);
     void close_table(JET_SESID session, JET_TABLEID table);
     void commit_transaction(JET_SESID session, JET_GRBIT bits);
@@ -98,17 +121,88 @@ namespace jet {
         JET_GRBIT bits
     ) -> tuple<unsigned long, JET_ENUMCOLUMN*> ;
 
+    // returns the size of the value before the delta was applied
+    auto escrow_update(
+        JET_SESID session,
+        JET_TABLEID table,
+        JET_COLUMNID column,
+        void* delta,
+        unsigned long delta_size,
+        void* old_value,
+        unsigned long old_value_size,
+        JET_GRBIT bits
+    ) -> unsigned long;
+
     void free_buffer(char* buffer);
+    auto get_column_info(JET_SESID session, JET_TABLEID table, const string& columnname) -> JET_COLUMNDEF;
+    auto get_column_list(JET_SESID session, JET_TABLEID table) -> vector<column_info>;
+    auto get_index_list(JET_SESID session, JET_TABLEID table) -> vector<index_info>;
+    auto get_database_file_info(const string& filename) -> JET_DBINFOMISC;
     void init(JET_INSTANCE& instance);
     auto get_bookmark(JET_SESID session, JET_TABLEID table) -> vector<char> ;
+    void get_bookmark(JET_SESID session, JET_TABLEID table, vector<char>& bookmark);
+    void goto_bookmark(JET_SESID session, JET_TABLEID table, const vector<char>& bookmark);
+    auto get_record_position(JET_SESID session, JET_TABLEID table) -> JET_RECPOS;
+    void goto_position(JET_SESID session, JET_TABLEID table, unsigned long entries_lt, unsigned long entries_total);
+    auto index_record_count(JET_SESID session, JET_TABLEID table, unsigned long max_count) -> unsigned long;
+    void make_key(JET_SESID session, JET_TABLEID table, const void* data, unsigned long data_size, JET_GRBIT bits);
+    auto move(JET_SESID session, JET_TABLEID table, long rows, JET_GRBIT bits) -> bool;
+    // an absolute path in one spelling, so that it can identify a file
+    auto normalize_path(const string& filename) -> string;
     auto open_database(JET_SESID session, const string& filename) -> JET_DBID;
     auto open_table(JET_SESID session, JET_DBID db, const string& tablename) -> JET_TABLEID;
+    auto open_temp_table(JET_SESID session, const JET_COLUMNDEF* columns, unsigned long count,
+        JET_GRBIT bits, JET_COLUMNID* column_ids) -> JET_TABLEID;
+    void prepare_update(JET_SESID session, JET_TABLEID table, unsigned long prep);
+    void rename_column(JET_SESID session, JET_TABLEID table, const string& oldname, const string& newname);
     void rename_table(JET_SESID session, JET_DBID db, const string& oldname, const string& newname);
+    void retrieve_key(JET_SESID session, JET_TABLEID table, vector<char>& key, JET_GRBIT bits);
+
+    // JET_wrnColumnNull and JET_wrnBufferTruncated are returned rather than
+    // reported to the warning handler; the second value is the actual size
+    auto retrieve_column(
+        JET_SESID session,
+        JET_TABLEID table,
+        JET_COLUMNID column,
+        void* data,
+        unsigned long data_size,
+        JET_GRBIT bits,
+        JET_RETINFO* retinfo
+    ) -> tuple<JET_ERR, unsigned long>;
+
+    // per-column JET_wrnColumnNull and JET_wrnBufferTruncated are left in
+    // the err members rather than reported to the warning handler
+    void retrieve_columns(JET_SESID session, JET_TABLEID table, JET_RETRIEVECOLUMN* columns, unsigned long count);
+
+    void set_column(
+        JET_SESID session,
+        JET_TABLEID table,
+        JET_COLUMNID column,
+        const void* data,
+        unsigned long data_size,
+        JET_GRBIT bits,
+        JET_SETINFO* setinfo
+    );
+
+    auto seek(JET_SESID session, JET_TABLEID table, JET_GRBIT bits) -> bool;
+    void set_current_index(JET_SESID session, JET_TABLEID table, const string& indexname);
+    auto set_index_range(JET_SESID session, JET_TABLEID table, JET_GRBIT bits) -> bool;
+    void set_system_parameter(JET_INSTANCE instance, unsigned long paramid, JET_API_PTR value);
+    void set_system_parameter(JET_INSTANCE instance, unsigned long paramid, const string& value);
     void term(JET_INSTANCE instance);
+    void update(JET_SESID session, JET_TABLEID table);
+    void update(JET_SESID session, JET_TABLEID table, vector<char>& bookmark);
+
+    struct system_parameter {
+        unsigned long id;
+        JET_API_PTR value;
+        string text;
+    };
 
     class instance {
     public:
-        instance() {
+        explicit instance(const string& name, const vector<system_parameter>& parameters)
+            : name(name), parameters(parameters) {
             init();
         }
 
@@ -127,21 +221,65 @@ namespace jet {
 
         void init() {
             if (instance_id == 0) {
-                instance_id = jet::create_instance("xyzzy");
-                jet::init(instance_id);
+                instance_id = jet::create_instance(name);
+                try {
+                    // instance parameters must be set between JetCreateInstance and JetInit
+                    for (auto& parameter : parameters) {
+                        if (parameter.text.empty())
+                            set_system_parameter(instance_id, parameter.id, parameter.value);
+                        else
+                            set_system_parameter(instance_id, parameter.id, parameter.text);
+                    }
+                    jet::init(instance_id);
+                } catch (error&) {
+                    jet::term(instance_id);
+                    instance_id = 0;
+                    throw;
+                }
             }
         }
 
         void shutdown() {
             if (instance_id != 0) {
                 jet::term(instance_id);
+                instance_id = 0;
             }
         }
 
         auto id() const -> JET_INSTANCE { return instance_id; }
+        auto instance_name() const -> const string& { return name; }
+
+        // Attachments belong to the instance, not to a session, so they are
+        // reference counted here and shared by every session that opens the
+        // database. The last release detaches it. Filenames are keys, so
+        // they must be normalized (db does that).
+        void attach(JET_SESID session, const string& filename) {
+            std::lock_guard<std::mutex> guard(attachments_lock);
+            auto it = attachments.find(filename);
+            if (it == attachments.end()) {
+                attach_database(session, filename, 0);
+                attachments[filename] = 1;
+            } else {
+                ++it->second;
+            }
+        }
+
+        void release(JET_SESID session, const string& filename) {
+            std::lock_guard<std::mutex> guard(attachments_lock);
+            auto it = attachments.find(filename);
+            if (it == attachments.end()) return;
+            if (--it->second == 0) {
+                attachments.erase(it);
+                detach_database(session, filename);
+            }
+        }
 
     private:
+        string name;
+        vector<system_parameter> parameters;
         JET_INSTANCE instance_id = 0;
+        std::mutex attachments_lock;
+        std::map<string, unsigned long> attachments;
     };
 
     using instance_ptr = shared_ptr<instance>;
@@ -175,48 +313,179 @@ namespace jet {
         void end() {
             if (session_id != 0) {
                 end_session(session_id);
+                session_id = 0;
             }
         }
 
         void create_db(const std::string& filename) {
-            auto db_id = create_database(session_id, filename);
+            create_db(filename, 0);
+        }
+
+        void create_db(const std::string& filename, JET_GRBIT bits) {
+            // JetCreateDatabase leaves the database attached; detach it so
+            // that later opens go through the instance's attachment count
+            auto db_id = create_database(session_id, filename, 0, bits);
             close_database(session_id, db_id, 0);
+            detach_database(session_id, filename);
         }
 
         auto open_db(const std::string& filename) -> db_ptr {
             return make_shared<db>(shared_from_this(), filename);
         }
 
+        // Transactions begun here are counted, so that callers can tell
+        // whether what they read has been committed, and can defer work
+        // until the outermost transaction ends.
+        void begin_transaction(JET_GRBIT bits) {
+            jet::begin_transaction(session_id, bits);
+            ++depth;
+        }
+
+        void commit_transaction(JET_GRBIT bits) {
+            if (depth == 1) {
+                commit_outermost(bits);
+                return;
+            }
+            jet::commit_transaction(session_id, bits);
+            --depth;
+            // what the inner level did now stands or falls with the outer one
+            for (auto& hook : commit_hooks)
+                if (hook.level > depth) hook.level = depth;
+        }
+
+        // does not throw, so that it can be used while unwinding
+        void rollback() {
+            if (JetRollback(session_id, 0) < JET_errSuccess || depth == 0) return;
+            commit_hooks.erase(std::remove_if(commit_hooks.begin(), commit_hooks.end(),
+                [&](const commit_hook& hook) { return hook.level >= depth; }),
+                commit_hooks.end());
+            if (--depth == 0) end_transaction();
+        }
+
+        auto transaction_depth() const -> unsigned { return depth; }
+
+        // runs hook when the outermost transaction commits or rolls back,
+        // or at once outside a transaction
+        void at_transaction_end(std::function< void() > hook) {
+            if (depth == 0)
+                hook();
+            else
+                transaction_end_hooks.push_back(hook);
+        }
+
+        // runs hook when the outermost transaction commits, or at once
+        // outside a transaction; rolling back the level it was added in
+        // drops it
+        void at_commit(std::function< void() > hook) {
+            at_commit(nullptr, hook);
+        }
+
+        // As above, but with gate locked across the commit and the hook,
+        // so that hooks sharing a gate run in the order in which their
+        // transactions committed. The hook should be quick.
+        void at_commit(std::shared_ptr<std::mutex> gate, std::function< void() > hook) {
+            if (depth != 0) {
+                commit_hook entry = { depth, gate, hook };
+                commit_hooks.push_back(entry);
+            } else if (gate) {
+                std::lock_guard<std::mutex> guard(*gate);
+                hook();
+            } else {
+                hook();
+            }
+        }
+
         auto id() -> JET_SESID { return session_id; }
+        auto owner() const -> const instance_ptr& { return instance; }
 
     private:
+        struct commit_hook {
+            unsigned level;                     // the level it was added in
+            std::shared_ptr<std::mutex> gate;   // may be null
+            std::function< void() > hook;
+        };
+
+        // The gates are taken in address order, so that sessions sharing
+        // several cannot deadlock, and held until the hooks have run.
+        void commit_outermost(JET_GRBIT bits) {
+            vector<std::shared_ptr<std::mutex>> gates;
+            for (auto& hook : commit_hooks)
+                if (hook.gate) gates.push_back(hook.gate);
+            std::sort(gates.begin(), gates.end());
+            gates.erase(std::unique(gates.begin(), gates.end()), gates.end());
+            {
+                vector<std::unique_lock<std::mutex>> held;
+                for (auto& gate : gates) held.push_back(std::unique_lock<std::mutex>(*gate));
+                jet::commit_transaction(session_id, bits);
+                --depth;
+                run_commit_hooks();
+            }
+            end_transaction();
+        }
+
+        void end_transaction() {
+            auto hooks = std::move(transaction_end_hooks);
+            transaction_end_hooks.clear();
+            for (auto& hook : hooks) hook();
+        }
+
+        void run_commit_hooks() {
+            auto hooks = std::move(commit_hooks);
+            commit_hooks.clear();
+            for (auto& hook : hooks) hook.hook();
+        }
+
         instance_ptr instance;
         JET_SESID session_id = 0;
+        unsigned depth = 0;
+        vector<std::function< void() >> transaction_end_hooks;
+        vector<commit_hook> commit_hooks;
     };
 
     using session_ptr = shared_ptr<session>;
 
     class db {
     public:
-        db(session_ptr session, const string& filename)
-            : session(session), filename(filename) {
+        db(session_ptr session, const string& path)
+            : session(session), filename(normalize_path(path)) {
 
-            attach_database(session->id(), filename, 0);
-            db_id = open_database(session->id(), filename);
+            session->owner()->attach(session->id(), filename);
+            try {
+                db_id = open_database(session->id(), filename);
+            } catch (error&) {
+                session->owner()->release(session->id(), filename);
+                throw;
+            }
         }
 
         db(const db&) = delete;
         db(const db&&) = delete;
-        
-        ~db() {}
+
+        ~db() {
+            try {
+                close();
+            } catch (error&) {
+                // TODO: log it?
+            }
+        }
 
         auto operator=(const db&) -> db& = delete;
 
+        void close() {
+            if (db_id != 0) {
+                auto closing = db_id;
+                db_id = 0;
+                close_database(session->id(), closing, 0);
+                session->owner()->release(session->id(), filename);
+            }
+        }
+
         auto id() const->JET_DBID { return db_id; }
+        auto name() const -> const string& { return filename; }
 
     private:
-        string filename;
         session_ptr session;
+        string filename;
         JET_DBID db_id = 0;
     };
 }